@@ -21,36 +21,84 @@
 
 #include <sys/epoll.h>
 
+static unsigned event_use_uring; /* create io_uring event bases? */
+
+/*
+ * Select the backend of the event bases created from now on: "epoll", or
+ * "io_uring" when built with io_uring support
+ */
+int
+event_backend(char *name)
+{
+    if (strcmp(name, "epoll") == 0) {
+        event_use_uring = 0;
+        return 0;
+    }
+
+#ifdef NC_HAVE_IO_URING
+    if (strcmp(name, "io_uring") == 0) {
+        event_use_uring = 1;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
 struct event_base *
 event_base_create(int nevent, event_cb_t cb)
 {
     struct event_base *evb;
     int status, ep;
     struct epoll_event *event;
+    struct event_uring *uring;
 
     ASSERT(nevent > 0);
 
-    ep = epoll_create(nevent);
-    if (ep < 0) {
-        log_error("epoll create of size %d failed: %s", nevent, strerror(errno));
-        return NULL;
+    uring = NULL;
+#ifdef NC_HAVE_IO_URING
+    if (event_use_uring) {
+        uring = event_uring_create(nevent);
+        if (uring == NULL) {
+            log_warn("io_uring create of size %d failed, falling back to "
+                     "epoll", nevent);
+        }
     }
+#endif
 
-    event = nc_calloc(nevent, sizeof(*event));
-    if (event == NULL) {
-        status = close(ep);
-        if (status < 0) {
-            log_error("close e %d failed, ignored: %s", ep, strerror(errno));
+    /* an io_uring event base needs no epoll instance */
+    ep = -1;
+    event = NULL;
+
+    if (uring == NULL) {
+        ep = epoll_create(nevent);
+        if (ep < 0) {
+            log_error("epoll create of size %d failed: %s", nevent,
+                      strerror(errno));
+            return NULL;
+        }
+
+        event = nc_calloc(nevent, sizeof(*event));
+        if (event == NULL) {
+            status = close(ep);
+            if (status < 0) {
+                log_error("close e %d failed, ignored: %s", ep,
+                          strerror(errno));
+            }
+            return NULL;
         }
-        return NULL;
     }
 
     evb = nc_alloc(sizeof(*evb));
     if (evb == NULL) {
-        nc_free(event);
-        status = close(ep);
-        if (status < 0) {
-            log_error("close e %d failed, ignored: %s", ep, strerror(errno));
+        event_uring_destroy(uring);
+        if (ep >= 0) {
+            nc_free(event);
+            status = close(ep);
+            if (status < 0) {
+                log_error("close e %d failed, ignored: %s", ep,
+                          strerror(errno));
+            }
         }
         return NULL;
     }
@@ -59,8 +107,10 @@ event_base_create(int nevent, event_cb_t cb)
     evb->event = event;
     evb->nevent = nevent;
     evb->cb = cb;
+    evb->uring = uring;
 
-    log_debug(LOG_INFO, "e %d with nevent %d", evb->ep, evb->nevent);
+    log_debug(LOG_INFO, "e %d with nevent %d%s", evb->ep, evb->nevent,
+              uring != NULL ? " on io_uring" : "");
 
     return evb;
 }
@@ -74,6 +124,13 @@ event_base_destroy(struct event_base *evb)
         return;
     }
 
+    if (evb->uring != NULL) {
+        ASSERT(evb->ep < 0);
+        event_uring_destroy(evb->uring);
+        nc_free(evb);
+        return;
+    }
+
     ASSERT(evb->ep > 0);
 
     nc_free(evb->event);
@@ -94,7 +151,7 @@ event_add_in(struct event_base *evb, struct conn *c)
     struct epoll_event event;
     int ep = evb->ep;
 
-    ASSERT(ep > 0);
+    ASSERT(ep > 0 || evb->uring != NULL);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
 
@@ -102,6 +159,10 @@ event_add_in(struct event_base *evb, struct conn *c)
         return 0;
     }
 
+    if (evb->uring != NULL) {
+        return event_uring_add_in(evb->uring, c);
+    }
+
     event.events = (uint32_t)(EPOLLIN | EPOLLET);
     event.data.ptr = c;
 
@@ -129,7 +190,7 @@ event_add_out(struct event_base *evb, struct conn *c)
     struct epoll_event event;
     int ep = evb->ep;
 
-    ASSERT(ep > 0);
+    ASSERT(ep > 0 || evb->uring != NULL);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
     ASSERT(c->recv_active);
@@ -138,6 +199,10 @@ event_add_out(struct event_base *evb, struct conn *c)
         return 0;
     }
 
+    if (evb->uring != NULL) {
+        return event_uring_add_out(evb->uring, c);
+    }
+
     event.events = (uint32_t)(EPOLLIN | EPOLLOUT | EPOLLET);
     event.data.ptr = c;
 
@@ -159,7 +224,7 @@ event_del_out(struct event_base *evb, struct conn *c)
     struct epoll_event event;
     int ep = evb->ep;
 
-    ASSERT(ep > 0);
+    ASSERT(ep > 0 || evb->uring != NULL);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
     ASSERT(c->recv_active);
@@ -168,6 +233,10 @@ event_del_out(struct event_base *evb, struct conn *c)
         return 0;
     }
 
+    if (evb->uring != NULL) {
+        return event_uring_del_out(evb->uring, c);
+    }
+
     event.events = (uint32_t)(EPOLLIN | EPOLLET);
     event.data.ptr = c;
 
@@ -189,10 +258,14 @@ event_add_conn(struct event_base *evb, struct conn *c)
     struct epoll_event event;
     int ep = evb->ep;
 
-    ASSERT(ep > 0);
+    ASSERT(ep > 0 || evb->uring != NULL);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
 
+    if (evb->uring != NULL) {
+        return event_uring_add_conn(evb->uring, c);
+    }
+
     event.events = (uint32_t)(EPOLLIN | EPOLLOUT | EPOLLET);
     event.data.ptr = c;
 
@@ -214,10 +287,14 @@ event_del_conn(struct event_base *evb, struct conn *c)
     int status;
     int ep = evb->ep;
 
-    ASSERT(ep > 0);
+    ASSERT(ep > 0 || evb->uring != NULL);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
 
+    if (evb->uring != NULL) {
+        return event_uring_del_conn(evb->uring, c);
+    }
+
     status = epoll_ctl(ep, EPOLL_CTL_DEL, c->sd, NULL);
     if (status < 0) {
         log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
@@ -237,9 +314,14 @@ event_wait(struct event_base *evb, int timeout)
     struct epoll_event *event = evb->event;
     int nevent = evb->nevent;
 
+    ASSERT(nevent > 0);
+
+    if (evb->uring != NULL) {
+        return event_uring_wait(evb, timeout);
+    }
+
     ASSERT(ep > 0);
     ASSERT(event != NULL);
-    ASSERT(nevent > 0);
 
     for (;;) {
         int i, nsd;
@@ -294,6 +376,55 @@ event_wait(struct event_base *evb, int timeout)
     NOT_REACHED();
 }
 
+/*
+ * Return the max # reads and writes that the event base can run as one
+ * batch, or 0 if every read and write has to be a syscall of its own;
+ * only an io_uring event base batches them
+ */
+int
+event_batch_size(struct event_base *evb)
+{
+    return evb->uring != NULL ? EVENT_BATCH_SIZE : 0;
+}
+
+/*
+ * Queue a recv of at most size bytes on conn 'c' into buf, for the next
+ * event_batch_run, which stores its result in res
+ */
+int
+event_batch_recv(struct event_base *evb, struct conn *c, void *buf,
+                 size_t size, ssize_t *res)
+{
+    ASSERT(evb->uring != NULL);
+
+    return event_uring_batch_recv(evb->uring, c->sd, buf, size, res);
+}
+
+/*
+ * Queue a writev of iov on conn 'c', for the next event_batch_run, which
+ * stores its result in res
+ */
+int
+event_batch_writev(struct event_base *evb, struct conn *c,
+                   const struct iovec *iov, int iovcnt, ssize_t *res)
+{
+    ASSERT(evb->uring != NULL);
+
+    return event_uring_batch_writev(evb->uring, c->sd, iov, iovcnt, res);
+}
+
+/*
+ * Run the reads and writes queued on the event base, returning once all
+ * of them completed
+ */
+int
+event_batch_run(struct event_base *evb)
+{
+    ASSERT(evb->uring != NULL);
+
+    return event_uring_batch_run(evb->uring);
+}
+
 void
 event_loop_stats(event_stats_cb_t cb, void *arg)
 {
@@ -330,6 +461,10 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
             break;
         }
 
+        if (st->quit) {
+            break;
+        }
+
         cb(st, &n);
     }
 
@@ -22,6 +22,8 @@
 
 #define EVENT_SIZE  1024
 
+#define EVENT_BATCH_SIZE 64 /* max # reads or writes per batch */
+
 #define EVENT_READ  0x0000ff
 #define EVENT_WRITE 0x00ff00
 #define EVENT_ERR   0xff0000
@@ -47,6 +49,8 @@ struct event_base {
 
 #elif NC_HAVE_EPOLL
 
+struct event_uring;
+
 struct event_base {
     int                ep;      /* epoll descriptor */
 
@@ -54,8 +58,35 @@ struct event_base {
     int                nevent;  /* # event */
 
     event_cb_t         cb;      /* event callback */
+
+    struct event_uring *uring;  /* io_uring backend, or NULL for epoll */
 };
 
+#ifdef NC_HAVE_IO_URING
+struct event_uring *event_uring_create(int nevent);
+void event_uring_destroy(struct event_uring *uring);
+int event_uring_add_in(struct event_uring *uring, struct conn *c);
+int event_uring_add_out(struct event_uring *uring, struct conn *c);
+int event_uring_del_out(struct event_uring *uring, struct conn *c);
+int event_uring_add_conn(struct event_uring *uring, struct conn *c);
+int event_uring_del_conn(struct event_uring *uring, struct conn *c);
+int event_uring_wait(struct event_base *evb, int timeout);
+int event_uring_batch_recv(struct event_uring *uring, int sd, void *buf, size_t size, ssize_t *res);
+int event_uring_batch_writev(struct event_uring *uring, int sd, const struct iovec *iov, int iovcnt, ssize_t *res);
+int event_uring_batch_run(struct event_uring *uring);
+#else
+#define event_uring_destroy(_u)
+#define event_uring_add_in(_u, _c)      (-1)
+#define event_uring_add_out(_u, _c)     (-1)
+#define event_uring_del_out(_u, _c)     (-1)
+#define event_uring_add_conn(_u, _c)    (-1)
+#define event_uring_del_conn(_u, _c)    (-1)
+#define event_uring_wait(_evb, _t)      (-1)
+#define event_uring_batch_recv(_u, _s, _b, _n, _r)      (-1)
+#define event_uring_batch_writev(_u, _s, _v, _n, _r)    (-1)
+#define event_uring_batch_run(_u)                       (-1)
+#endif
+
 #elif NC_HAVE_EVENT_PORTS
 
 #include <port.h>
@@ -73,6 +104,7 @@ struct event_base {
 # error missing scalable I/O event notification mechanism
 #endif
 
+int event_backend(char *name);
 struct event_base *event_base_create(int size, event_cb_t cb);
 void event_base_destroy(struct event_base *evb);
 
@@ -83,6 +115,10 @@ int event_del_out(struct event_base *evb, struct conn *c);
 int event_add_conn(struct event_base *evb, struct conn *c);
 int event_del_conn(struct event_base *evb, struct conn *c);
 int event_wait(struct event_base *evb, int timeout);
+int event_batch_size(struct event_base *evb);
+int event_batch_recv(struct event_base *evb, struct conn *c, void *buf, size_t size, ssize_t *res);
+int event_batch_writev(struct event_base *evb, struct conn *c, const struct iovec *iov, int iovcnt, ssize_t *res);
+int event_batch_run(struct event_base *evb);
 void event_loop_stats(event_stats_cb_t cb, void *arg);
 
 #endif /* _NC_EVENT_H */
@@ -0,0 +1,787 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+#ifdef NC_HAVE_IO_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring event backend, selected with --event=io_uring
+ *
+ * Every connection is watched by a single multishot poll request that
+ * posts a completion whenever the socket is woken up, which gives us the
+ * same edge triggered semantics as EPOLLET. Interest changes and removals
+ * are queued as submissions and handed to the kernel together with the
+ * wait for completions, so that one io_uring_enter replaces epoll_wait and
+ * all the epoll_ctl calls of a loop iteration. No epoll instance is
+ * created for an io_uring event base.
+ *
+ * The user data of a poll request carries the descriptor and a generation
+ * number. The generation is bumped on removal, which lets us drop
+ * completions that were posted for a descriptor before it was reused.
+ *
+ * Reads and writes go through a second ring, in batches: the core queues
+ * the recv of every readable client and server connection, and the
+ * writev of every connection with output to flush, and the whole batch is
+ * submitted and reaped with one io_uring_enter (see event_batch_run). The
+ * ring would wait for a socket that is not ready, non-blocking or not, so
+ * each read and write is flagged not to; it then completes at once with
+ * the bytes transferred or -EAGAIN, just like the recv or writev it
+ * replaces.
+ * Keeping them off the poll ring means that the wait for a batch never
+ * has to step over poll completions. No buffers are registered with
+ * either ring.
+ */
+
+#define URING_UDATA_IGNORE  0ULL
+
+#define uring_udata(_fd, _gen)  (((uint64_t)(_gen) << 32) | (uint32_t)(_fd))
+#define uring_udata_fd(_ud)     ((int)((_ud) & 0xffffffffULL))
+#define uring_udata_gen(_ud)    ((uint32_t)((_ud) >> 32))
+
+struct event_uring_fd {
+    struct conn *conn;  /* watched connection, or NULL */
+    uint32_t    gen;    /* generation of the poll request */
+};
+
+struct uring_ring {
+    int                   fd;        /* io_uring descriptor */
+    uint32_t              features;  /* io_uring features */
+
+    void                  *ring;     /* mmap-ed sq and cq rings */
+    size_t                ring_len;  /* length of ring */
+    struct io_uring_sqe   *sqe;      /* mmap-ed sqe[] */
+    size_t                sqe_len;   /* length of sqe[] */
+
+    uint32_t              *sq_head;  /* sq head, advanced by the kernel */
+    uint32_t              *sq_tail;  /* sq tail, advanced by us */
+    uint32_t              *sq_array; /* sq index array */
+    uint32_t              sq_mask;   /* sq ring mask */
+    uint32_t              sq_nentry; /* # sq entries */
+
+    uint32_t              *cq_head;  /* cq head, advanced by us */
+    uint32_t              *cq_tail;  /* cq tail, advanced by the kernel */
+    struct io_uring_cqe   *cqe;      /* cqe[] */
+    uint32_t              cq_mask;   /* cq ring mask */
+};
+
+struct event_uring {
+    struct uring_ring     poll;      /* ring of the poll requests */
+    struct uring_ring     io;        /* ring of the batched reads and writes */
+
+    struct io_uring_cqe   *event;    /* event[] - completions reaped */
+    int                   nevent;    /* # event */
+
+    struct event_uring_fd *fds;      /* fds[] - indexed by descriptor */
+    int                   nfds;      /* # fds */
+
+    ssize_t               *res[EVENT_BATCH_SIZE]; /* result of each queued io */
+    struct msghdr         msg[EVENT_BATCH_SIZE];  /* header of each queued write */
+    uint32_t              nio;       /* # reads and writes queued */
+    uint32_t              io_gen;    /* generation of the batch */
+};
+
+static int
+uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+            void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static uint32_t
+uring_poll_mask(uint32_t mask)
+{
+#ifndef NC_LITTLE_ENDIAN
+    /* poll32_events is expected with its half words swapped */
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    return mask;
+}
+
+static uint32_t
+uring_conn_mask(struct conn *c)
+{
+    uint32_t mask = POLLIN;
+
+    if (c->send_active) {
+        mask |= POLLOUT;
+    }
+
+    return mask;
+}
+
+static int
+uring_ring_init(struct uring_ring *r, uint32_t entries)
+{
+    struct io_uring_params params;
+    uint8_t *ring;
+    size_t sq_len, cq_len;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+
+    fd = uring_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        /* kernel older than 5.19 */
+        memset(&params, 0, sizeof(params));
+        fd = uring_setup(entries, &params);
+    }
+    if (fd < 0) {
+        log_error("io_uring setup of size %"PRIu32" failed: %s", entries,
+                  strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Require a single mmap for both rings, timeouts on wait and multishot
+     * poll; the last one has no feature flag of its own, but came with
+     * resource tags in 5.13
+     */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_RSRC_TAGS)) {
+        log_error("io_uring on fd %d lacks required features %08"PRIx32, fd,
+                  params.features);
+        close(fd);
+        return -1;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_len = params.cq_off.cqes +
+             params.cq_entries * sizeof(struct io_uring_cqe);
+
+    r->fd = fd;
+    r->features = params.features;
+    r->ring_len = MAX(sq_len, cq_len);
+    r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->ring == MAP_FAILED) {
+        log_error("mmap of io_uring %d rings failed: %s", fd, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    r->sqe_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqe = mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqe == MAP_FAILED) {
+        log_error("mmap of io_uring %d sqes failed: %s", fd, strerror(errno));
+        munmap(r->ring, r->ring_len);
+        close(fd);
+        return -1;
+    }
+
+    ring = r->ring;
+    r->sq_head = (uint32_t *)(ring + params.sq_off.head);
+    r->sq_tail = (uint32_t *)(ring + params.sq_off.tail);
+    r->sq_array = (uint32_t *)(ring + params.sq_off.array);
+    r->sq_mask = *(uint32_t *)(ring + params.sq_off.ring_mask);
+    r->sq_nentry = params.sq_entries;
+
+    r->cq_head = (uint32_t *)(ring + params.cq_off.head);
+    r->cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+    r->cqe = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    r->cq_mask = *(uint32_t *)(ring + params.cq_off.ring_mask);
+
+    log_debug(LOG_INFO, "io_uring %d with %"PRIu32" sq and %"PRIu32" cq "
+              "entries", fd, params.sq_entries, params.cq_entries);
+
+    return 0;
+}
+
+static void
+uring_ring_deinit(struct uring_ring *r)
+{
+    int status;
+
+    munmap(r->sqe, r->sqe_len);
+    munmap(r->ring, r->ring_len);
+
+    status = close(r->fd);
+    if (status < 0) {
+        log_error("close io_uring %d failed, ignored: %s", r->fd,
+                  strerror(errno));
+    }
+}
+
+struct event_uring *
+event_uring_create(int nevent)
+{
+    struct event_uring *uring;
+
+    ASSERT(nevent > 0);
+
+    uring = nc_alloc(sizeof(*uring));
+    if (uring == NULL) {
+        return NULL;
+    }
+
+    if (uring_ring_init(&uring->poll, (uint32_t)nevent) < 0) {
+        nc_free(uring);
+        return NULL;
+    }
+
+    if (uring_ring_init(&uring->io, EVENT_BATCH_SIZE) < 0) {
+        uring_ring_deinit(&uring->poll);
+        nc_free(uring);
+        return NULL;
+    }
+
+    uring->event = nc_calloc(nevent, sizeof(*uring->event));
+    if (uring->event == NULL) {
+        uring_ring_deinit(&uring->io);
+        uring_ring_deinit(&uring->poll);
+        nc_free(uring);
+        return NULL;
+    }
+    uring->nevent = nevent;
+
+    uring->fds = NULL;
+    uring->nfds = 0;
+
+    uring->nio = 0;
+    uring->io_gen = 0;
+
+    return uring;
+}
+
+void
+event_uring_destroy(struct event_uring *uring)
+{
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->fds != NULL) {
+        nc_free(uring->fds);
+    }
+    nc_free(uring->event);
+    uring_ring_deinit(&uring->io);
+    uring_ring_deinit(&uring->poll);
+
+    nc_free(uring);
+}
+
+/*
+ * Hand all queued submissions to the kernel, optionally waiting for
+ * completions
+ */
+static int
+uring_submit(struct uring_ring *r, uint32_t min_complete, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    uint32_t to_submit, flags;
+    int n;
+
+    to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    flags = 0;
+
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+        memset(&arg, 0, sizeof(arg));
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    n = uring_enter(r->fd, to_submit, min_complete, flags,
+                    flags != 0 ? &arg : NULL, flags != 0 ? sizeof(arg) : 0);
+    if (n < 0 && errno != EINTR && errno != ETIME) {
+        log_error("io_uring enter on %d with %"PRIu32" sqes failed: %s",
+                  r->fd, to_submit, strerror(errno));
+    }
+
+    return n;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct uring_ring *r)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail, idx;
+
+    tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_nentry) {
+        /* sq is full; flush it */
+        if (uring_submit(r, 0, 0) < 0) {
+            return NULL;
+        }
+    }
+
+    idx = tail & r->sq_mask;
+    sqe = &r->sqe[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+static int
+uring_poll_add(struct event_uring *uring, struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&uring->poll);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->sd;
+    sqe->poll32_events = uring_poll_mask(uring_conn_mask(c));
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_udata(c->sd, uring->fds[c->sd].gen);
+
+    return 0;
+}
+
+/*
+ * Update the events of the poll request of conn 'c', or remove the poll
+ * request altogether if 'update' is false
+ */
+static int
+uring_poll_update(struct event_uring *uring, struct conn *c, uint32_t gen,
+                  bool update)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&uring->poll);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_udata(c->sd, gen);
+    if (update) {
+        sqe->poll32_events = uring_poll_mask(uring_conn_mask(c));
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    }
+    if (uring->poll.features & IORING_FEAT_CQE_SKIP) {
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    }
+    sqe->user_data = URING_UDATA_IGNORE;
+
+    return 0;
+}
+
+static int
+uring_fds_grow(struct event_uring *uring, int sd)
+{
+    struct event_uring_fd *fds;
+    int nfds;
+
+    nfds = MAX(uring->nfds * 2, sd + 1);
+    nfds = MAX(nfds, uring->nevent);
+
+    fds = nc_realloc(uring->fds, (size_t)nfds * sizeof(*fds));
+    if (fds == NULL) {
+        return -1;
+    }
+    memset(&fds[uring->nfds], 0, (size_t)(nfds - uring->nfds) * sizeof(*fds));
+
+    uring->fds = fds;
+    uring->nfds = nfds;
+
+    return 0;
+}
+
+int
+event_uring_add_in(struct event_uring *uring, struct conn *c)
+{
+    int status;
+
+    ASSERT(c->sd < uring->nfds && uring->fds[c->sd].conn == c);
+
+    c->recv_active = 1;
+
+    status = uring_poll_update(uring, c, uring->fds[c->sd].gen, true);
+    if (status < 0) {
+        log_error("io_uring %d update on sd %d failed", uring->poll.fd, c->sd);
+    }
+
+    return status;
+}
+
+int
+event_uring_add_out(struct event_uring *uring, struct conn *c)
+{
+    int status;
+
+    ASSERT(c->sd < uring->nfds && uring->fds[c->sd].conn == c);
+
+    c->send_active = 1;
+
+    status = uring_poll_update(uring, c, uring->fds[c->sd].gen, true);
+    if (status < 0) {
+        log_error("io_uring %d update on sd %d failed", uring->poll.fd, c->sd);
+        c->send_active = 0;
+    }
+
+    return status;
+}
+
+int
+event_uring_del_out(struct event_uring *uring, struct conn *c)
+{
+    int status;
+
+    ASSERT(c->sd < uring->nfds && uring->fds[c->sd].conn == c);
+
+    c->send_active = 0;
+
+    status = uring_poll_update(uring, c, uring->fds[c->sd].gen, true);
+    if (status < 0) {
+        log_error("io_uring %d update on sd %d failed", uring->poll.fd, c->sd);
+        c->send_active = 1;
+    }
+
+    return status;
+}
+
+int
+event_uring_add_conn(struct event_uring *uring, struct conn *c)
+{
+    struct event_uring_fd *fd;
+    int status;
+
+    if (c->sd >= uring->nfds && uring_fds_grow(uring, c->sd) < 0) {
+        log_error("io_uring %d add of sd %d failed: %s", uring->poll.fd, c->sd,
+                  strerror(ENOMEM));
+        return -1;
+    }
+
+    fd = &uring->fds[c->sd];
+    ASSERT(fd->conn == NULL);
+
+    fd->conn = c;
+    fd->gen++;
+    c->recv_active = 1;
+    c->send_active = 1;
+
+    status = uring_poll_add(uring, c);
+    if (status < 0) {
+        log_error("io_uring %d add of sd %d failed", uring->poll.fd, c->sd);
+        fd->conn = NULL;
+        c->recv_active = 0;
+        c->send_active = 0;
+    }
+
+    return status;
+}
+
+int
+event_uring_del_conn(struct event_uring *uring, struct conn *c)
+{
+    struct event_uring_fd *fd;
+    int status;
+
+    ASSERT(c->sd < uring->nfds);
+
+    fd = &uring->fds[c->sd];
+    if (fd->conn != c) {
+        return 0;
+    }
+
+    fd->conn = NULL;
+    c->recv_active = 0;
+    c->send_active = 0;
+
+    status = uring_poll_update(uring, c, fd->gen, false);
+    if (status < 0) {
+        log_error("io_uring %d remove of sd %d failed", uring->poll.fd, c->sd);
+        return status;
+    }
+
+    /*
+     * Completions posted from now on are stale. The removal is submitted
+     * with the next wait, which also releases the reference that the poll
+     * request holds on the socket.
+     */
+    fd->gen++;
+
+    return 0;
+}
+
+int
+event_uring_wait(struct event_base *evb, int timeout)
+{
+    struct event_uring *uring = evb->uring;
+
+    ASSERT(uring != NULL);
+
+    for (;;) {
+        uint32_t head, tail;
+        int i, n, nsd;
+
+        head = *uring->poll.cq_head;
+        tail = __atomic_load_n(uring->poll.cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            n = uring_submit(&uring->poll, 1, timeout);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != ETIME && errno != EBUSY) {
+                    return -1;
+                }
+            }
+
+            tail = __atomic_load_n(uring->poll.cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (timeout == -1) {
+                    continue;
+                }
+                return 0;
+            }
+        } else {
+            /* flush updates queued since the last wait */
+            uring_submit(&uring->poll, 0, 0);
+        }
+
+        for (n = 0; head != tail && n < uring->nevent; head++, n++) {
+            uring->event[n] = uring->poll.cqe[head & uring->poll.cq_mask];
+        }
+        __atomic_store_n(uring->poll.cq_head, head, __ATOMIC_RELEASE);
+
+        for (i = 0, nsd = 0; i < n; i++) {
+            struct io_uring_cqe *cqe = &uring->event[i];
+            struct event_uring_fd *fd;
+            struct conn *c;
+            uint32_t events = 0;
+            int sd;
+
+            if (cqe->user_data == URING_UDATA_IGNORE) {
+                /* update or removal raced with the end of the poll */
+                continue;
+            }
+
+            sd = uring_udata_fd(cqe->user_data);
+            if (sd >= uring->nfds) {
+                continue;
+            }
+
+            fd = &uring->fds[sd];
+            c = fd->conn;
+            if (c == NULL || fd->gen != uring_udata_gen(cqe->user_data)) {
+                /* stale completion of a removed poll request */
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                /* multishot poll was terminated by the kernel; rearm it */
+                if (uring_poll_add(uring, c) < 0) {
+                    log_error("io_uring %d rearm of sd %d failed", uring->poll.fd,
+                              sd);
+                    events |= EVENT_ERR;
+                }
+            }
+
+            log_debug(LOG_VVERB, "io_uring %"PRId32" triggered on conn %p",
+                      cqe->res, c);
+
+            if (cqe->res < 0) {
+                if (cqe->res != -ECANCELED) {
+                    events |= EVENT_ERR;
+                }
+            } else {
+                if (cqe->res & POLLERR) {
+                    events |= EVENT_ERR;
+                }
+
+                if (cqe->res & (POLLIN | POLLHUP)) {
+                    events |= EVENT_READ;
+                }
+
+                /*
+                 * Completions reaped in the same batch may predate an
+                 * interest change; report writability only if asked for
+                 */
+                if ((cqe->res & POLLOUT) && c->send_active) {
+                    events |= EVENT_WRITE;
+                }
+            }
+
+            if (events == 0) {
+                continue;
+            }
+
+            nsd++;
+
+            if (evb->cb != NULL) {
+                evb->cb(c, events);
+            }
+        }
+
+        if (nsd > 0 || timeout != -1) {
+            return nsd;
+        }
+    }
+
+    NOT_REACHED();
+}
+
+static struct io_uring_sqe *
+uring_batch_get(struct event_uring *uring, ssize_t *res)
+{
+    struct io_uring_sqe *sqe;
+
+    ASSERT(uring->nio < EVENT_BATCH_SIZE);
+
+    sqe = uring_get_sqe(&uring->io);
+    if (sqe == NULL) {
+        return NULL;
+    }
+
+    /* the io ring is as large as a batch, so the sqe was not flushed */
+    sqe->user_data = uring_udata(uring->nio, uring->io_gen);
+
+    *res = -ECANCELED;
+    uring->res[uring->nio++] = res;
+
+    return sqe;
+}
+
+int
+event_uring_batch_recv(struct event_uring *uring, int sd, void *buf,
+                       size_t size, ssize_t *res)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_batch_get(uring, res);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)size;
+    sqe->msg_flags = MSG_DONTWAIT;
+
+    return 0;
+}
+
+int
+event_uring_batch_writev(struct event_uring *uring, int sd,
+                         const struct iovec *iov, int iovcnt, ssize_t *res)
+{
+    struct io_uring_sqe *sqe;
+    struct msghdr *msg;
+
+    sqe = uring_batch_get(uring, res);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    msg = &uring->msg[uring->nio - 1];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = (struct iovec *)iov;
+    msg->msg_iovlen = (size_t)iovcnt;
+
+    /* a writev that can be told not to wait on a socket */
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+
+    return 0;
+}
+
+/*
+ * Submit the reads and writes queued since the last run and wait for all
+ * of them, storing the result of each, the # bytes transferred or a
+ * negative errno, where it was asked for. Return the # completed, which
+ * is less than the # queued only if io_uring_enter itself failed; the
+ * results left out read -ECANCELED.
+ */
+int
+event_uring_batch_run(struct event_uring *uring)
+{
+    struct uring_ring *r = &uring->io;
+    uint32_t head, tail, ndone, idx;
+    int n;
+
+    if (uring->nio == 0) {
+        return 0;
+    }
+
+    for (ndone = 0; ndone < uring->nio; ) {
+        n = uring_submit(r, uring->nio - ndone, -1);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r->cqe[head & r->cq_mask];
+
+            if (uring_udata_gen(cqe->user_data) != uring->io_gen) {
+                /* late completion of a batch that failed */
+                continue;
+            }
+
+            idx = (uint32_t)uring_udata_fd(cqe->user_data);
+            ASSERT(idx < uring->nio);
+
+            *uring->res[idx] = cqe->res;
+            ndone++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (ndone < uring->nio) {
+        /* take back what the kernel has not consumed yet */
+        __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head,
+                         __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+
+    log_debug(LOG_VVERB, "io_uring %d ran %"PRIu32" of %"PRIu32" io", r->fd,
+              ndone, uring->nio);
+
+    uring->nio = 0;
+    uring->io_gen++;
+
+    return (int)ndone;
+}
+
+#endif /* NC_HAVE_IO_URING */
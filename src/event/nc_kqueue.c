@@ -21,6 +21,16 @@
 
 #include <sys/event.h>
 
+/*
+ * Select the backend of the event bases created from now on; only
+ * "kqueue" is supported here
+ */
+int
+event_backend(char *name)
+{
+    return strcmp(name, "kqueue") == 0 ? 0 : -1;
+}
+
 struct event_base *
 event_base_create(int nevent, event_cb_t cb)
 {
@@ -345,6 +355,35 @@ event_wait(struct event_base *evb, int timeout)
     NOT_REACHED();
 }
 
+int
+event_batch_size(struct event_base *evb)
+{
+    return 0;
+}
+
+int
+event_batch_recv(struct event_base *evb, struct conn *c, void *buf,
+                 size_t size, ssize_t *res)
+{
+    NOT_REACHED();
+    return -1;
+}
+
+int
+event_batch_writev(struct event_base *evb, struct conn *c,
+                   const struct iovec *iov, int iovcnt, ssize_t *res)
+{
+    NOT_REACHED();
+    return -1;
+}
+
+int
+event_batch_run(struct event_base *evb)
+{
+    NOT_REACHED();
+    return -1;
+}
+
 void
 event_loop_stats(event_stats_cb_t cb, void *arg)
 {
@@ -398,6 +437,10 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
             }
         }
 
+        if (st->quit) {
+            break;
+        }
+
         cb(st, &nreturned);
     }
 
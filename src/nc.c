@@ -44,6 +44,21 @@
 #define NC_MBUF_SIZE        MBUF_SIZE
 #define NC_MBUF_MIN_SIZE    MBUF_MIN_SIZE
 #define NC_MBUF_MAX_SIZE    MBUF_MAX_SIZE
+#define NC_MBUF_ARENA       "off"
+
+#define NC_WORKERS          1
+#define NC_WORKERS_MAX      64
+
+#define NC_MEM_BUDGET       0 /* in MB, unlimited */
+#define NC_MAX_NFREE        1024
+
+#ifdef NC_HAVE_EPOLL
+#define NC_EVENT_BACKEND    "epoll"
+#elif NC_HAVE_KQUEUE
+#define NC_EVENT_BACKEND    "kqueue"
+#else
+#define NC_EVENT_BACKEND    "evport"
+#endif
 
 #if 1 //shenzheng 2015-1-26 log rotating
 #define NC_LOG_ROTATE_DEFAULT			LOG_ROTATE_DEFAULT
@@ -91,6 +106,11 @@ static struct option long_options[] = {
     { "stats-addr",     	required_argument,  NULL,   'a' },
     { "pid-file",       	required_argument,  NULL,   'p' },
     { "mbuf-size",      	required_argument,  NULL,   'm' },
+    { "mbuf-arena",     	required_argument,  NULL,   'H' },
+    { "mem-budget",     	required_argument,  NULL,   'b' },
+    { "max-free",       	required_argument,  NULL,   'f' },
+    { "workers",        	required_argument,  NULL,   'w' },
+    { "event",          	required_argument,  NULL,   'e' },
 #if 1 //shenzheng 2015-1-26 log rotating
 	{ "log-rorate",     	no_argument,  		NULL,   'R' },
 	{ "log-file-max-size",  required_argument,  NULL,   'M' },
@@ -114,15 +134,15 @@ static struct option long_options[] = {
 #if 1 //shenzheng 2015-1-26 log rotating && proxy administer && zookeeper
 #if 1 //shenzheng 2015-6-18 zookeeper
 #ifdef NC_ZOOKEEPER
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:RM:C:A:P:z:Z:SK";
+static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:H:b:f:w:e:RM:C:A:P:z:Z:SK";
 #else
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:RM:C:A:P:";
+static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:H:b:f:w:e:RM:C:A:P:";
 #endif
 #else //shenzheng 2015-6-18 zookeeper
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:RM:C:A:P:z:Z:SK";
+static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:H:b:f:w:e:RM:C:A:P:z:Z:SK";
 #endif
 #else
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:";
+static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:H:b:f:w:e:";
 #endif //shenzheng 2015-4-28 log rotating && proxy administer && zookeeper
 
 static rstatus_t
@@ -260,6 +280,8 @@ nc_show_usage(void)
         "Usage: nutcracker [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "                  [-c conf file] [-s stats port] [-a stats addr]" CRLF
         "                  [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "                  [-H mbuf arena] [-b mem budget] [-f max free]" CRLF
+        "                  [-w workers] [-e event backend]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -277,13 +299,19 @@ nc_show_usage(void)
         "  -i, --stats-interval=N    : set stats aggregation interval in msec (default: %d msec)" CRLF
         "  -p, --pid-file=S          : set pid file (default: %s)" CRLF
         "  -m, --mbuf-size=N         : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
+        "  -H, --mbuf-arena=S        : carve mbufs out of 2MB regions, off, thp or hugetlb (default: %s)" CRLF
+        "  -b, --mem-budget=N        : set memory budget in MB, 0 for unlimited (default: %d MB)" CRLF
+        "  -f, --max-free=N          : set max # objects kept on each free list, 0 for unlimited (default: %d)" CRLF
+        "  -w, --workers=N           : set number of worker threads (default: %d, max: %d)" CRLF
+        "  -e, --event=S             : set event backend, epoll or io_uring on linux (default: %s)" CRLF
         "",
         NC_LOG_DEFAULT, NC_LOG_MIN, NC_LOG_MAX,
         NC_LOG_PATH != NULL ? NC_LOG_PATH : "stderr",
         NC_CONF_PATH,
         NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL,
         NC_PID_FILE != NULL ? NC_PID_FILE : "off",
-        NC_MBUF_SIZE
+        NC_MBUF_SIZE, NC_MBUF_ARENA, NC_MEM_BUDGET, NC_MAX_NFREE, NC_WORKERS, NC_WORKERS_MAX,
+        NC_EVENT_BACKEND
 		);
 
 #if 1 //shenzheng 2015-1-26 log rotating
@@ -391,6 +419,11 @@ nc_set_default_options(struct instance *nci)
     nci->hostname[NC_MAXHOSTNAMELEN - 1] = '\0';
 
     nci->mbuf_chunk_size = NC_MBUF_SIZE;
+    nci->mbuf_arena = NC_MBUF_ARENA;
+    nci->mem_budget = (size_t)NC_MEM_BUDGET * 1024 * 1024;
+    nci->max_nfree = NC_MAX_NFREE;
+    nci->workers = NC_WORKERS;
+    nci->event_backend = NC_EVENT_BACKEND;
 
     nci->pid = (pid_t)-1;
     nci->pid_filename = NULL;
@@ -520,6 +553,62 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->mbuf_chunk_size = (size_t)value;
             break;
 
+        case 'H':
+            if (mbuf_arena_type(optarg) < 0) {
+                log_stderr("nutcracker: mbuf arena '%s' is not one of off, "
+                           "thp or hugetlb", optarg);
+                return NC_ERROR;
+            }
+
+            nci->mbuf_arena = optarg;
+            break;
+
+        case 'b':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -b requires a number");
+                return NC_ERROR;
+            }
+
+            nci->mem_budget = (size_t)value * 1024 * 1024;
+            break;
+
+        case 'f':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -f requires a number");
+                return NC_ERROR;
+            }
+
+            nci->max_nfree = (uint32_t)value;
+            break;
+
+        case 'w':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker: option -w requires a non-zero number");
+                return NC_ERROR;
+            }
+
+            if (value > NC_WORKERS_MAX) {
+                log_stderr("nutcracker: number of workers must be between 1 "
+                           "and %d", NC_WORKERS_MAX);
+                return NC_ERROR;
+            }
+
+            nci->workers = (uint32_t)value;
+            break;
+
+        case 'e':
+            if (event_backend(optarg) < 0) {
+                log_stderr("nutcracker: event backend '%s' is not supported",
+                           optarg);
+                return NC_ERROR;
+            }
+
+            nci->event_backend = optarg;
+            break;
+
 #if 1 //shenzheng 2015-1-26 log rotating
 		case 'R':
 			LOG_RORATE = 1;
@@ -601,6 +690,9 @@ nc_get_options(int argc, char **argv, struct instance *nci)
                 break;
 
             case 'm':
+            case 'b':
+            case 'f':
+            case 'w':
             case 'v':
             case 's':
             case 'i':
@@ -608,6 +700,8 @@ nc_get_options(int argc, char **argv, struct instance *nci)
                 break;
 
             case 'a':
+            case 'H':
+            case 'e':
                 log_stderr("nutcracker: option -%c requires a string", optopt);
                 break;
 
@@ -654,6 +748,39 @@ nc_get_options(int argc, char **argv, struct instance *nci)
         }
     }
 
+    /*
+     * Proxy administer, config reload and zookeeper operate on a single
+     * context, so they are only available with one worker
+     */
+    if (nci->workers > 1 && nci->proxy_adm_port > 0) {
+        log_stderr("nutcracker: option -w cannot be combined with -P");
+        return NC_ERROR;
+    }
+
+    /*
+     * Config reload registers connections from the proxy administer and
+     * zookeeper threads, which only the thread safe epoll backend allows
+     */
+    if (strcmp(nci->event_backend, "io_uring") == 0 &&
+        nci->proxy_adm_port > 0) {
+        log_stderr("nutcracker: option -e io_uring cannot be combined with -P");
+        return NC_ERROR;
+    }
+
+#ifdef NC_ZOOKEEPER
+    if (nci->workers > 1 && (nci->zk_start || nci->zk_keep)) {
+        log_stderr("nutcracker: option -w cannot be combined with -S or -K");
+        return NC_ERROR;
+    }
+
+    if (strcmp(nci->event_backend, "io_uring") == 0 &&
+        (nci->zk_start || nci->zk_keep)) {
+        log_stderr("nutcracker: option -e io_uring cannot be combined with "
+                   "-S or -K");
+        return NC_ERROR;
+    }
+#endif
+
     return NC_OK;
 }
 
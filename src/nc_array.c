@@ -40,6 +40,7 @@ array_create(uint32_t n, size_t size)
     a->nelem = 0;
     a->size = size;
     a->nalloc = n;
+    a->borrowed = 0;
 
     return a;
 }
@@ -64,6 +65,7 @@ array_init(struct array *a, uint32_t n, size_t size)
     a->nelem = 0;
     a->size = size;
     a->nalloc = n;
+    a->borrowed = 0;
 
     return NC_OK;
 }
@@ -73,7 +75,7 @@ array_deinit(struct array *a)
 {
     ASSERT(a->nelem == 0);
 
-    if (a->elem != NULL) {
+    if (a->elem != NULL && !a->borrowed) {
         nc_free(a->elem);
     }
 }
@@ -107,9 +109,18 @@ array_push(struct array *a)
 
         /* the array is full; allocate new array */
         size = a->size * a->nalloc;
-        new = nc_realloc(a->elem, 2 * size);
-        if (new == NULL) {
-            return NULL;
+        if (a->borrowed) {
+            new = nc_alloc(2 * size);
+            if (new == NULL) {
+                return NULL;
+            }
+            nc_memcpy(new, a->elem, size);
+            a->borrowed = 0;
+        } else {
+            new = nc_realloc(a->elem, 2 * size);
+            if (new == NULL) {
+                return NULL;
+            }
         }
 
         a->elem = new;
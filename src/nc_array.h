@@ -24,13 +24,14 @@ typedef int (*array_compare_t)(const void *, const void *);
 typedef rstatus_t (*array_each_t)(void *, void *);
 
 struct array {
-    uint32_t nelem;  /* # element */
-    void     *elem;  /* element */
-    size_t   size;   /* element size */
-    uint32_t nalloc; /* # allocated element */
+    uint32_t nelem;      /* # element */
+    void     *elem;      /* element */
+    size_t   size;       /* element size */
+    uint32_t nalloc;     /* # allocated element */
+    unsigned borrowed:1; /* elem not owned? (see array_set) */
 };
 
-#define null_array { 0, NULL, 0, 0 }
+#define null_array { 0, NULL, 0, 0, 0 }
 
 static inline void
 array_null(struct array *a)
@@ -39,8 +40,14 @@ array_null(struct array *a)
     a->elem = NULL;
     a->size = 0;
     a->nalloc = 0;
+    a->borrowed = 0;
 }
 
+/*
+ * Use caller owned storage for the elements of an array. It is never
+ * freed by the array; array_push copies the elements to the heap once
+ * the storage is full.
+ */
 static inline void
 array_set(struct array *a, void *elem, size_t size, uint32_t nalloc)
 {
@@ -48,6 +55,7 @@ array_set(struct array *a, void *elem, size_t size, uint32_t nalloc)
     a->elem = elem;
     a->size = size;
     a->nalloc = nalloc;
+    a->borrowed = 1;
 }
 
 static inline uint32_t
@@ -0,0 +1,692 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * nutcracker-bench runs the message path of nutcracker on messages held in
+ * memory, with no sockets, servers or event loop, and reports the time it
+ * takes per message. The msg benchmarks also report the cache misses per
+ * message on Linux, where the cpu exposes counters for them to
+ * perf_event_open. It is not installed; build it with:
+ *
+ *   make -C src nutcracker-bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <nc_core.h>
+#include <nc_proto.h>
+
+#define BENCH_BYTES     (64 * 1024 * 1024) /* bytes fed per parser case */
+#define BENCH_NMIN      1000
+#define BENCH_NMAX      1000000
+#define BENCH_KEY       "key:000000000000"
+
+struct bench_case {
+    char   *name;     /* case name */
+    bool   request;   /* request or response? */
+    size_t vlen;      /* value length */
+};
+
+static struct bench_case bench_cases[] = {
+    { "get",  true,  0 },
+    { "set",  true,  16 },
+    { "set",  true,  1024 },
+    { "set",  true,  65536 },
+    { "set",  true,  1048576 },
+    { "mget", true,  16 },
+    { "bulk", false, 16 },
+    { "bulk", false, 1024 },
+    { "bulk", false, 65536 },
+    { "bulk", false, 1048576 },
+    { "mbulk", false, 16 },
+    { "mbulk", false, 1024 },
+    { NULL,   false, 0 }
+};
+
+#define BENCH_NELEM     16 /* # keys of mget and # elements of mbulk */
+
+static uint32_t bench_nlive[] = { 1, 256, 16384 };
+
+struct bench_counter {
+    char     *name;   /* column name */
+    uint32_t type;    /* perf event type */
+    uint64_t config;  /* perf event config */
+    int      fd;      /* perf event descriptor, or -1 if unavailable */
+};
+
+#ifdef __linux__
+static struct bench_counter bench_counters[] = {
+    { "llc miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+    { "l1d miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      -1 },
+};
+#else
+static struct bench_counter bench_counters[] = {
+    { "llc miss", 0, 0, -1 },
+    { "l1d miss", 0, 0, -1 },
+};
+#endif
+
+#define BENCH_NCOUNTER  NELEMS(bench_counters)
+
+static struct conn bench_conn;
+static struct msg_tqh bench_msgq;
+static uint32_t bench_n;
+static char *bench_test;
+
+static struct option long_options[] = {
+    { "help",       no_argument,        NULL,   'h' },
+    { "iterations", required_argument,  NULL,   'n' },
+    { "mbuf-size",  required_argument,  NULL,   'm' },
+    { "test",       required_argument,  NULL,   't' },
+    { NULL,         0,                  NULL,    0  }
+};
+
+static char short_options[] = "hn:m:t:";
+
+static void
+bench_show_usage(void)
+{
+    log_stderr(
+        "Usage: nutcracker-bench [-h] [-n iterations] [-m mbuf size]" CRLF
+        "                        [-t parser|msg]" CRLF
+        "" CRLF
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -n, --iterations=N     : set the # messages per case (default: %d bytes worth)" CRLF
+        "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
+        "  -t, --test=S           : run only the parser or the msg benchmarks" CRLF
+        "",
+        BENCH_BYTES, MBUF_SIZE);
+}
+
+static int64_t
+bench_nsec_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Open the cache miss counters of the calling thread, in user space only.
+ * A counter the kernel or the cpu does not provide, say in a virtual
+ * machine without a PMU, is left out and reported as "-".
+ */
+static void
+bench_counters_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    struct bench_counter *bc;
+    uint32_t i;
+
+    for (i = 0; i < BENCH_NCOUNTER; i++) {
+        bc = &bench_counters[i];
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = bc->type;
+        attr.config = bc->config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        bc->fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (bc->fd < 0) {
+            log_stderr("perf counter '%s' unavailable: %s", bc->name,
+                       strerror(errno));
+        }
+    }
+#endif
+}
+
+static void
+bench_counters_close(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < BENCH_NCOUNTER; i++) {
+        if (bench_counters[i].fd >= 0) {
+            close(bench_counters[i].fd);
+            bench_counters[i].fd = -1;
+        }
+    }
+}
+
+static void
+bench_counters_start(void)
+{
+#ifdef __linux__
+    uint32_t i;
+
+    for (i = 0; i < BENCH_NCOUNTER; i++) {
+        if (bench_counters[i].fd >= 0) {
+            ioctl(bench_counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(bench_counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/*
+ * Stop the counters and store in miss[] the count of each over n msgs,
+ * or -1 for a counter that is unavailable
+ */
+static void
+bench_counters_stop(uint32_t n, double *miss)
+{
+    uint64_t count;
+    uint32_t i;
+
+    for (i = 0; i < BENCH_NCOUNTER; i++) {
+        miss[i] = -1;
+
+        if (bench_counters[i].fd < 0) {
+            continue;
+        }
+
+#ifdef __linux__
+        ioctl(bench_counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+        if (read(bench_counters[i].fd, &count, sizeof(count)) ==
+            sizeof(count)) {
+            miss[i] = (double)count / n;
+        }
+    }
+}
+
+/*
+ * Print miss to buf as a column of width 10, or "-" if it is unavailable
+ */
+static char *
+bench_miss_string(char *buf, size_t size, double miss)
+{
+    if (miss < 0) {
+        nc_snprintf(buf, size, "%10s", "-");
+    } else {
+        nc_snprintf(buf, size, "%10.2f", miss);
+    }
+
+    return buf;
+}
+
+/*
+ * Return the wire bytes of case bc in a buffer allocated with nc_alloc,
+ * and their length in len
+ */
+static uint8_t *
+bench_message(struct bench_case *bc, size_t *len)
+{
+    uint8_t *buf, *p;
+    size_t size;
+    uint32_t i;
+
+    size = 64 + BENCH_NELEM * (64 + bc->vlen);
+    buf = nc_alloc(size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    p = buf;
+
+    if (strcmp(bc->name, "get") == 0) {
+        p += nc_snprintf(p, 64, "*2\r\n$3\r\nGET\r\n$%zu\r\n%s\r\n",
+                         sizeof(BENCH_KEY) - 1, BENCH_KEY);
+    } else if (strcmp(bc->name, "set") == 0) {
+        p += nc_snprintf(p, 64, "*3\r\n$3\r\nSET\r\n$%zu\r\n%s\r\n$%zu\r\n",
+                         sizeof(BENCH_KEY) - 1, BENCH_KEY, bc->vlen);
+        memset(p, 'v', bc->vlen);
+        p += bc->vlen;
+        p += nc_snprintf(p, 64, "\r\n");
+    } else if (strcmp(bc->name, "mget") == 0) {
+        p += nc_snprintf(p, 64, "*%d\r\n$4\r\nMGET\r\n", BENCH_NELEM + 1);
+        for (i = 0; i < BENCH_NELEM; i++) {
+            p += nc_snprintf(p, 64, "$%zu\r\n%s\r\n", sizeof(BENCH_KEY) - 1,
+                             BENCH_KEY);
+        }
+    } else {
+        if (strcmp(bc->name, "mbulk") == 0) {
+            p += nc_snprintf(p, 64, "*%d\r\n", BENCH_NELEM);
+            i = BENCH_NELEM;
+        } else {
+            i = 1;
+        }
+        while (i-- > 0) {
+            p += nc_snprintf(p, 64, "$%zu\r\n", bc->vlen);
+            memset(p, 'v', bc->vlen);
+            p += bc->vlen;
+            p += nc_snprintf(p, 64, "\r\n");
+        }
+    }
+
+    ASSERT((size_t)(p - buf) < size);
+    *len = (size_t)(p - buf);
+
+    return buf;
+}
+
+/*
+ * Feed len bytes of data to msg one mbuf of class cid at a time, the way
+ * msg_recv_chain and msg_parse do for a connection that reads faster than
+ * the bytes arrive. When parse is false, the bytes are only copied.
+ */
+static rstatus_t
+bench_feed(struct msg *msg, uint8_t *data, size_t len, uint32_t cid,
+           bool parse)
+{
+    struct mbuf *mbuf, *nbuf;
+    size_t n;
+
+    for (;;) {
+        mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+        if (mbuf == NULL || mbuf_full(mbuf)) {
+            mbuf = mbuf_get_class(cid);
+            if (mbuf == NULL) {
+                return NC_ENOMEM;
+            }
+            mbuf_insert(&msg->mhdr, mbuf);
+            msg->pos = mbuf->pos;
+        }
+
+        n = MIN(len, mbuf_size(mbuf));
+        mbuf_copy(mbuf, data, n);
+        msg->mlen += (uint32_t)n;
+        data += n;
+        len -= n;
+
+        if (!parse) {
+            if (len == 0) {
+                return NC_OK;
+            }
+            continue;
+        }
+
+        msg->parser(msg);
+
+        switch (msg->result) {
+        case MSG_PARSE_OK:
+            mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+            return (len == 0 && msg->pos == mbuf->last) ? NC_OK : NC_ERROR;
+
+        case MSG_PARSE_REPAIR:
+            nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
+            if (nbuf == NULL) {
+                return NC_ENOMEM;
+            }
+            mbuf_insert(&msg->mhdr, nbuf);
+            msg->pos = nbuf->pos;
+            break;
+
+        case MSG_PARSE_AGAIN:
+            if (len == 0) {
+                return NC_ERROR;
+            }
+            break;
+
+        default:
+            return NC_ERROR;
+        }
+    }
+
+    NOT_REACHED();
+    return NC_ERROR;
+}
+
+/*
+ * Return the # data bytes of an mbuf of class cid
+ */
+static uint32_t
+bench_mbuf_size(uint32_t cid)
+{
+    struct mbuf *mbuf;
+    uint32_t size;
+
+    mbuf = mbuf_get_class(cid);
+    if (mbuf == NULL) {
+        return 0;
+    }
+    size = mbuf_size(mbuf);
+    mbuf_put(mbuf);
+
+    return size;
+}
+
+/*
+ * Return the mean # nsec it takes to get a msg, feed it the n bytes of
+ * data in mbufs of class cid and put it, or -1 on error
+ */
+static int64_t
+bench_run(bool request, uint8_t *data, size_t len, uint32_t cid, bool parse,
+          uint32_t n)
+{
+    struct msg *msg;
+    rstatus_t status;
+    int64_t start;
+    uint32_t i;
+
+    start = bench_nsec_now();
+
+    for (i = 0; i < n; i++) {
+        msg = msg_get(&bench_conn, request, true);
+        if (msg == NULL) {
+            return -1;
+        }
+
+        status = bench_feed(msg, data, len, cid, parse);
+
+        msg_put(msg);
+
+        if (status != NC_OK) {
+            return -1;
+        }
+    }
+
+    return (bench_nsec_now() - start) / n;
+}
+
+/*
+ * Run the redis parsers over requests and responses with small, medium and
+ * large values. Each case is fed in default size mbufs and in the smallest
+ * ones, so that the values of all but the smallest cases span mbufs. The
+ * time of the copy into the mbufs alone is given next to the total.
+ */
+static rstatus_t
+bench_parser(void)
+{
+    struct bench_case *bc;
+    uint32_t cids[2], n, i;
+    uint8_t *data;
+    size_t len;
+    int64_t total, copy;
+
+    cids[0] = mbuf_class_default();
+    cids[1] = 0;
+
+    log_stderr("%-6s %-8s %9s %7s %10s %10s %8s", "parser", "case", "bytes",
+               "mbuf", "ns/msg", "copy ns", "MB/s");
+
+    for (bc = bench_cases; bc->name != NULL; bc++) {
+        data = bench_message(bc, &len);
+        if (data == NULL) {
+            return NC_ENOMEM;
+        }
+
+        n = bench_n;
+        if (n == 0) {
+            n = (uint32_t)MAX(BENCH_NMIN, MIN(BENCH_NMAX, BENCH_BYTES / len));
+        }
+
+        for (i = 0; i < NELEMS(cids); i++) {
+            total = bench_run(bc->request, data, len, cids[i], true, n);
+            copy = bench_run(bc->request, data, len, cids[i], false, n);
+            if (total < 0 || copy < 0) {
+                log_stderr("%s %s of %zu bytes failed to parse",
+                           bc->request ? "req" : "rsp", bc->name, len);
+                nc_free(data);
+                return NC_ERROR;
+            }
+
+            log_stderr("%-6s %-8s %9zu %7"PRIu32" %10"PRId64" %10"PRId64" %8.0f",
+                       bc->request ? "req" : "rsp", bc->name, len,
+                       bench_mbuf_size(cids[i]), total, copy,
+                       total > 0 ? (double)len * 1000 / (double)total : 0.0);
+        }
+
+        nc_free(data);
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Return the mean # nsec per msg it takes to receive GET requests in
+ * batches of nlive, the way a pipelining client has them in flight on its
+ * connection, and then walk and put them as req_done and rsp_send_done
+ * do, and store the cache misses per msg in miss[]. When cold is set
+ * every msg also gets its cold part, as fragmented and replace_server
+ * requests do, which approximates a struct msg that holds all its fields
+ * inline. Return -1 on error.
+ */
+static int64_t
+bench_msg_run(uint8_t *data, size_t len, uint32_t nlive, bool cold,
+              uint32_t n, double *miss)
+{
+    struct msg *msg;
+    rstatus_t status;
+    int64_t start;
+    uint32_t i, j;
+
+    TAILQ_INIT(&bench_msgq);
+    status = NC_OK;
+
+    bench_counters_start();
+    start = bench_nsec_now();
+
+    for (i = 0; i < n && status == NC_OK; i += nlive) {
+        for (j = 0; j < nlive && status == NC_OK; j++) {
+            msg = msg_get(&bench_conn, true, true);
+            if (msg == NULL) {
+                status = NC_ENOMEM;
+                break;
+            }
+            TAILQ_INSERT_TAIL(&bench_msgq, msg, c_tqe);
+
+            if (cold && msg_cold(msg) == NULL) {
+                status = NC_ENOMEM;
+                break;
+            }
+
+            status = bench_feed(msg, data, len, 0, true);
+        }
+
+        TAILQ_FOREACH(msg, &bench_msgq, c_tqe) {
+            msg->done = 1;
+        }
+
+        while (!TAILQ_EMPTY(&bench_msgq)) {
+            msg = TAILQ_FIRST(&bench_msgq);
+            if (!msg->done || msg->error || msg->swallow) {
+                status = NC_ERROR;
+            }
+            TAILQ_REMOVE(&bench_msgq, msg, c_tqe);
+            msg_put(msg);
+        }
+    }
+
+    start = bench_nsec_now() - start;
+    bench_counters_stop(i, miss);
+
+    if (status != NC_OK) {
+        return -1;
+    }
+
+    return start / i;
+}
+
+/*
+ * Run the msg life cycle of GET requests with few and with many of them
+ * in flight, with the cold part of each msg and without. Once the live
+ * msgs outgrow the cpu caches, the time and the cache misses per msg
+ * follow the # cache lines of struct msg that every request touches.
+ */
+static rstatus_t
+bench_msg(void)
+{
+    struct bench_case bc = { "get", true, 0 };
+    double miss[BENCH_NCOUNTER];
+    char mbuf[BENCH_NCOUNTER][16];
+    uint32_t n, i, j;
+    uint8_t *data;
+    size_t len;
+    int64_t nsec;
+
+    data = bench_message(&bc, &len);
+    if (data == NULL) {
+        return NC_ENOMEM;
+    }
+
+    n = bench_n != 0 ? bench_n : BENCH_NMAX;
+
+    bench_counters_open();
+
+    log_stderr("msg hot %zu bytes cold %zu bytes", sizeof(struct msg),
+               sizeof(struct msg_cold));
+    log_stderr("%-6s %-8s %-5s %9s %10s %10s %10s", "msg", "case", "part",
+               "live", "ns/msg", bench_counters[0].name,
+               bench_counters[1].name);
+
+    for (i = 0; i < NELEMS(bench_nlive) * 2; i++) {
+        bool cold = (i % 2) != 0;
+        uint32_t nlive = bench_nlive[i / 2];
+
+        nsec = bench_msg_run(data, len, nlive, cold, n, miss);
+        if (nsec < 0) {
+            log_stderr("req get with %"PRIu32" live msgs failed", nlive);
+            bench_counters_close();
+            nc_free(data);
+            return NC_ERROR;
+        }
+
+        for (j = 0; j < BENCH_NCOUNTER; j++) {
+            bench_miss_string(mbuf[j], sizeof(mbuf[j]), miss[j]);
+        }
+
+        log_stderr("%-6s %-8s %-5s %9"PRIu32" %10"PRId64" %s %s", "req",
+                   bc.name, cold ? "cold" : "hot", nlive, nsec, mbuf[0],
+                   mbuf[1]);
+    }
+
+    bench_counters_close();
+    nc_free(data);
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_get_options(int argc, char **argv, struct instance *nci)
+{
+    int c, value;
+
+    opterr = 0;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) {
+            /* no more options */
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            return NC_ERROR;
+
+        case 'n':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker-bench: option -n requires a positive number");
+                return NC_ERROR;
+            }
+            bench_n = (uint32_t)value;
+            break;
+
+        case 'm':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker-bench: option -m requires a non-zero number");
+                return NC_ERROR;
+            }
+            if (value < MBUF_MIN_SIZE || value > MBUF_MAX_SIZE) {
+                log_stderr("nutcracker-bench: mbuf chunk size must be between %zu and"
+                           " %zu bytes", MBUF_MIN_SIZE, MBUF_MAX_SIZE);
+                return NC_ERROR;
+            }
+            nci->mbuf_chunk_size = (size_t)value;
+            break;
+
+        case 't':
+            if (strcmp(optarg, "parser") != 0 && strcmp(optarg, "msg") != 0) {
+                log_stderr("nutcracker-bench: option -t requires parser or msg");
+                return NC_ERROR;
+            }
+            bench_test = optarg;
+            break;
+
+        default:
+            log_stderr("nutcracker-bench: invalid option -- '%c'", optopt);
+            return NC_ERROR;
+        }
+    }
+
+    return NC_OK;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct instance nci;
+    rstatus_t status;
+
+    memset(&nci, 0, sizeof(nci));
+    nci.mbuf_chunk_size = MBUF_SIZE;
+    nci.mbuf_arena = "off";
+
+    status = bench_get_options(argc, argv, &nci);
+    if (status != NC_OK) {
+        bench_show_usage();
+        exit(1);
+    }
+
+    status = log_init(LOG_EMERG, NULL);
+    if (status != NC_OK) {
+        exit(1);
+    }
+
+    bench_conn.sd = -1;
+
+    mbuf_init(&nci);
+    msg_init();
+
+    status = NC_OK;
+
+    if (bench_test == NULL || strcmp(bench_test, "parser") == 0) {
+        status = bench_parser();
+    }
+
+    if (status == NC_OK &&
+        (bench_test == NULL || strcmp(bench_test, "msg") == 0)) {
+        status = bench_msg();
+    }
+
+    msg_deinit();
+    mbuf_deinit();
+
+    exit(status == NC_OK ? 0 : 1);
+}
@@ -0,0 +1,288 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_cache.h>
+#include <nc_hashkit.h>
+
+struct cache *
+cache_create(size_t size, int ttl, uint32_t threshold)
+{
+    struct cache *cache;
+
+    ASSERT(size > 0);
+
+    cache = nc_zalloc(sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->epochs = nc_zalloc(sizeof(*cache->epochs));
+    if (cache->epochs == NULL) {
+        nc_free(cache);
+        return NULL;
+    }
+    cache->epochs->nref = 1;
+
+    cache->size = size;
+    cache->nbytes = 0;
+    cache->ttl = ttl;
+    cache->threshold = threshold;
+    cache->window = 0;
+    TAILQ_INIT(&cache->lru);
+    cache->reported = 0;
+
+    log_debug(LOG_VERB, "create cache %p of %zu bytes ttl %d threshold %"PRIu32"",
+              cache, size, ttl, threshold);
+
+    return cache;
+}
+
+static void
+cache_epochs_put(struct cache_epochs *epochs)
+{
+    if (nc_atomic_decr(epochs->nref) == 0) {
+        nc_free(epochs);
+    }
+}
+
+static void
+cache_remove(struct cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry **pp;
+
+    for (pp = &cache->slot[entry->hash % CACHE_NSLOT]; *pp != entry;
+         pp = &(*pp)->next) {
+        ASSERT(*pp != NULL);
+    }
+    *pp = entry->next;
+
+    TAILQ_REMOVE(&cache->lru, entry, tqe);
+
+    ASSERT(cache->nbytes >= sizeof(*entry) + entry->keylen + entry->len);
+    cache->nbytes -= sizeof(*entry) + entry->keylen + entry->len;
+
+    nc_free(entry);
+}
+
+void
+cache_destroy(struct cache *cache)
+{
+    while (!TAILQ_EMPTY(&cache->lru)) {
+        cache_remove(cache, TAILQ_FIRST(&cache->lru));
+    }
+
+    cache_epochs_put(cache->epochs);
+
+    nc_free(cache);
+}
+
+/*
+ * Make cache of a worker other than the first one use the invalidation
+ * epochs of owner, the cache of the same pool in the first worker, so
+ * that writes through any worker invalidate the entries of all of them.
+ * The size of the pool cache is split evenly between the workers. The
+ * epochs live until the last of these caches is destroyed, whichever
+ * worker or config reload that happens in.
+ */
+void
+cache_share(struct cache *cache, struct cache *owner, uint32_t nworker)
+{
+    ASSERT(nworker > 0);
+    ASSERT(TAILQ_EMPTY(&cache->lru));
+
+    cache->size /= nworker;
+
+    if (owner == NULL || owner == cache) {
+        return;
+    }
+
+    cache_epochs_put(cache->epochs);
+    nc_atomic_incr(owner->epochs->nref);
+    cache->epochs = owner->epochs;
+}
+
+/*
+ * Report the change in the bytes held by the cache of pool since the last
+ * report to the stats
+ */
+void
+cache_report(struct context *ctx, struct server_pool *pool)
+{
+    struct cache *cache = pool->cache;
+
+    if (cache->nbytes > cache->reported) {
+        stats_pool_incr_by(ctx, pool, hot_cache_bytes,
+                           (int64_t)(cache->nbytes - cache->reported));
+    } else if (cache->nbytes < cache->reported) {
+        stats_pool_decr_by(ctx, pool, hot_cache_bytes,
+                           (int64_t)(cache->reported - cache->nbytes));
+    }
+    cache->reported = cache->nbytes;
+}
+
+uint32_t
+cache_hash(uint8_t *key, uint32_t keylen)
+{
+    return hash_fnv1a_32((char *)key, keylen);
+}
+
+/*
+ * Count a read of the key with the given hash, and return true if the
+ * reads of its slot in the current window make it hot
+ */
+bool
+cache_hot(struct cache *cache, uint32_t hash, int64_t now)
+{
+    uint16_t *count;
+
+    if (now >= cache->window) {
+        memset(cache->count, 0, sizeof(cache->count));
+        cache->window = now + CACHE_WINDOW;
+    }
+
+    count = &cache->count[hash % CACHE_NSLOT];
+    if (*count < UINT16_MAX) {
+        (*count)++;
+    }
+
+    return *count >= cache->threshold;
+}
+
+uint32_t
+cache_epoch(struct cache *cache, uint32_t hash)
+{
+    return nc_atomic_get(cache->epochs->epoch[hash % CACHE_NSLOT]);
+}
+
+/*
+ * Invalidate the entries of the key with the given hash in every worker.
+ * The entries of its slot in this worker are released right away; the
+ * other workers drop theirs on their next lookup.
+ */
+void
+cache_invalidate(struct cache *cache, uint32_t hash)
+{
+    uint32_t idx = hash % CACHE_NSLOT;
+
+    nc_atomic_incr(cache->epochs->epoch[idx]);
+
+    while (cache->slot[idx] != NULL) {
+        cache_remove(cache, cache->slot[idx]);
+    }
+}
+
+/*
+ * Return the valid entry of the key for requests of the given type, or
+ * NULL. Expired and invalidated entries met on the way are released.
+ */
+struct cache_entry *
+cache_get(struct cache *cache, msg_type_t type, uint8_t *key, uint32_t keylen,
+          uint32_t hash, int64_t now)
+{
+    struct cache_entry *entry, *next;
+    uint32_t epoch;
+
+    epoch = cache_epoch(cache, hash);
+
+    for (entry = cache->slot[hash % CACHE_NSLOT]; entry != NULL; entry = next) {
+        next = entry->next;
+
+        if (entry->epoch != epoch || entry->expire <= now) {
+            cache_remove(cache, entry);
+            continue;
+        }
+
+        if (entry->type == type && entry->hash == hash &&
+            entry->keylen == keylen && memcmp(entry->data, key, keylen) == 0) {
+            TAILQ_REMOVE(&cache->lru, entry, tqe);
+            TAILQ_INSERT_TAIL(&cache->lru, entry, tqe);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Cache the response rsp to a request of the given type for the key, if
+ * the slot of the key was not invalidated since epoch was read when the
+ * request was received. Least recently used entries are evicted to make
+ * room. Return the # evicted entries.
+ */
+uint32_t
+cache_put(struct cache *cache, msg_type_t type, uint8_t *key, uint32_t keylen,
+          uint32_t hash, uint32_t epoch, struct msg *rsp, int64_t now)
+{
+    struct cache_entry *entry, *old;
+    struct mbuf *mbuf;
+    uint8_t *p;
+    size_t size;
+    uint32_t nevict;
+
+    size = sizeof(*entry) + keylen + rsp->mlen;
+    if (size > cache->size / CACHE_ENTRY_SHARE) {
+        return 0;
+    }
+
+    if (epoch != cache_epoch(cache, hash)) {
+        /* a write raced with the read that fetched rsp */
+        return 0;
+    }
+
+    old = cache_get(cache, type, key, keylen, hash, now);
+    if (old != NULL) {
+        cache_remove(cache, old);
+    }
+
+    nevict = 0;
+    while (cache->nbytes + size > cache->size) {
+        old = TAILQ_FIRST(&cache->lru);
+        ASSERT(old != NULL);
+        if (old->expire > now) {
+            nevict++;
+        }
+        cache_remove(cache, old);
+    }
+
+    entry = nc_alloc(size);
+    if (entry == NULL) {
+        return nevict;
+    }
+
+    entry->type = type;
+    entry->hash = hash;
+    entry->epoch = epoch;
+    entry->expire = now + cache->ttl;
+    entry->keylen = keylen;
+    entry->len = rsp->mlen;
+
+    nc_memcpy(entry->data, key, keylen);
+    p = entry->data + keylen;
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        nc_memcpy(p, mbuf->pos, mbuf_length(mbuf));
+        p += mbuf_length(mbuf);
+    }
+    ASSERT(p == entry->data + keylen + entry->len);
+
+    entry->next = cache->slot[hash % CACHE_NSLOT];
+    cache->slot[hash % CACHE_NSLOT] = entry;
+    TAILQ_INSERT_TAIL(&cache->lru, entry, tqe);
+    cache->nbytes += size;
+
+    return nevict;
+}
@@ -0,0 +1,83 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_CACHE_H_
+#define _NC_CACHE_H_
+
+/*
+ * Hot key response cache of a pool. Keys hash into CACHE_NSLOT slots;
+ * a slot counts the reads of its keys in the current sampling window,
+ * which tells hot keys apart, chains the entries of its keys, and has an
+ * invalidation epoch that every write to one of its keys bumps. An entry
+ * is only valid while the epoch of its slot is the one it was filled
+ * under, so a write invalidates the entries of the key in every worker,
+ * and a fill that raced with a write is dropped.
+ */
+#define CACHE_NSLOT         4096
+#define CACHE_WINDOW        1000    /* sampling window in msec */
+#define CACHE_ENTRY_SHARE   8       /* an entry takes at most 1/8 of the cache */
+
+struct cache_entry {
+    TAILQ_ENTRY(cache_entry) tqe;       /* link in lru q */
+    struct cache_entry       *next;     /* next entry in slot */
+    msg_type_t               type;      /* request type, e.g. get or gets */
+    uint32_t                 hash;      /* key hash */
+    uint32_t                 epoch;     /* slot epoch when filled */
+    int64_t                  expire;    /* expiry time in msec */
+    uint32_t                 keylen;    /* key length */
+    uint32_t                 len;       /* response length */
+    uint8_t                  data[1];   /* key followed by response */
+};
+
+TAILQ_HEAD(cache_tqh, cache_entry);
+
+/*
+ * Invalidation epochs of the caches of a pool in all workers, released
+ * by the last cache that drops its reference
+ */
+struct cache_epochs {
+    uint32_t                 nref;      /* # caches referencing the epochs */
+    uint32_t                 epoch[CACHE_NSLOT]; /* epochs by key slot */
+};
+
+struct cache {
+    size_t                   size;      /* max # bytes */
+    size_t                   nbytes;    /* # bytes held */
+    int                      ttl;       /* entry ttl in msec */
+    uint32_t                 threshold; /* # reads in a window that make a key hot */
+    int64_t                  window;    /* end of the sampling window in msec */
+    struct cache_tqh         lru;       /* entries, least recently used first */
+    struct cache_entry       *slot[CACHE_NSLOT]; /* entries by key slot */
+    uint16_t                 count[CACHE_NSLOT]; /* reads by key slot */
+    struct cache_epochs      *epochs;   /* invalidation epochs */
+    size_t                   reported;  /* nbytes last reported to stats */
+};
+
+struct cache *cache_create(size_t size, int ttl, uint32_t threshold);
+void cache_destroy(struct cache *cache);
+void cache_share(struct cache *cache, struct cache *owner, uint32_t nworker);
+void cache_report(struct context *ctx, struct server_pool *pool);
+
+uint32_t cache_hash(uint8_t *key, uint32_t keylen);
+bool cache_hot(struct cache *cache, uint32_t hash, int64_t now);
+uint32_t cache_epoch(struct cache *cache, uint32_t hash);
+void cache_invalidate(struct cache *cache, uint32_t hash);
+
+struct cache_entry *cache_get(struct cache *cache, msg_type_t type, uint8_t *key, uint32_t keylen, uint32_t hash, int64_t now);
+uint32_t cache_put(struct cache *cache, msg_type_t type, uint8_t *key, uint32_t keylen, uint32_t hash, uint32_t epoch, struct msg *rsp, int64_t now);
+
+#endif
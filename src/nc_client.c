@@ -130,7 +130,7 @@ client_close(struct context *ctx, struct conn *conn)
     client_close_stats(ctx, conn->owner, conn->err, conn->eof);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -156,7 +156,7 @@ client_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, c_tqe);
 
         /* dequeue the message (request) from client outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
 
         if (msg->done) {
             log_debug(LOG_INFO, "close c %d discarding %s req %"PRIu64" len "
@@ -164,6 +164,11 @@ client_close(struct context *ctx, struct conn *conn)
                       msg->error ? "error": "completed", msg->id, msg->mlen,
                       msg->type);
             req_put(msg);
+        } else if (msg->held) {
+            log_debug(LOG_INFO, "close c %d discarding held req %"PRIu64" "
+                      "len %"PRIu32" type %d", conn->sd, msg->id, msg->mlen,
+                      msg->type);
+            req_put(msg);
         } else {
             msg->swallow = 1;
 
@@ -177,7 +182,7 @@ client_close(struct context *ctx, struct conn *conn)
     }
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -98,6 +98,34 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, server_failure_limit) },
 
+    { string("mem_budget"),
+      conf_set_num,
+      offsetof(struct conf_pool, mem_budget) },
+
+    { string("max_keys_per_fragment"),
+      conf_set_num,
+      offsetof(struct conf_pool, max_keys_per_fragment) },
+
+    { string("partial_mget"),
+      conf_set_bool,
+      offsetof(struct conf_pool, partial_mget) },
+
+    { string("hot_cache_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_cache_size) },
+
+    { string("hot_cache_ttl"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_cache_ttl) },
+
+    { string("hot_cache_threshold"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_cache_threshold) },
+
+    { string("collapse_reads"),
+      conf_set_bool,
+      offsetof(struct conf_pool, collapse_reads) },
+
     { string("servers"),
       conf_add_server,
       offsetof(struct conf_pool, server) },
@@ -220,6 +248,13 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->server_connections = CONF_UNSET_NUM;
     cp->server_retry_timeout = CONF_UNSET_NUM;
     cp->server_failure_limit = CONF_UNSET_NUM;
+    cp->mem_budget = CONF_UNSET_NUM;
+    cp->max_keys_per_fragment = CONF_UNSET_NUM;
+    cp->partial_mget = CONF_UNSET_NUM;
+    cp->hot_cache_size = CONF_UNSET_NUM;
+    cp->hot_cache_ttl = CONF_UNSET_NUM;
+    cp->hot_cache_threshold = CONF_UNSET_NUM;
+    cp->collapse_reads = CONF_UNSET_NUM;
 
     array_null(&cp->server);
 
@@ -295,6 +330,7 @@ conf_pool_each_transform(void *elem, void *data)
     sp->continuum = NULL;
     sp->nlive_server = 0;
     sp->next_rebuild = 0LL;
+    timer_init(&sp->retry_timer, server_pool_retry, sp);
 
     sp->name = cp->name;
     sp->addrstr = cp->listen.pname;
@@ -322,6 +358,37 @@ conf_pool_each_transform(void *elem, void *data)
     sp->auto_eject_hosts = cp->auto_eject_hosts ? 1 : 0;
     sp->preconnect = cp->preconnect ? 1 : 0;
 
+    sp->mem_budget = (size_t)cp->mem_budget * 1024 * 1024;
+    sp->mem_reported = 0;
+    sp->mem_throttled = 0;
+
+    sp->max_keys_per_fragment = (uint32_t)cp->max_keys_per_fragment;
+    sp->partial_mget = cp->partial_mget ? 1 : 0;
+
+    sp->cache = NULL;
+    sp->collapse = NULL;
+
+    sp->mem_usage = mbuf_usage_create();
+    if (sp->mem_usage == NULL) {
+        return NC_ENOMEM;
+    }
+
+    if (cp->hot_cache_size > 0) {
+        sp->cache = cache_create((size_t)cp->hot_cache_size * 1024 * 1024,
+                                 cp->hot_cache_ttl,
+                                 (uint32_t)cp->hot_cache_threshold);
+        if (sp->cache == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    if (cp->collapse_reads) {
+        sp->collapse = nc_zalloc(MSG_COLLAPSE_NSLOT * sizeof(*sp->collapse));
+        if (sp->collapse == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
 #if 1 //shenzheng 2015-6-5 tcpkeepalive
 	sp->tcpkeepalive = cp->tcpkeepalive ? 1 : 0;
 	sp->tcpkeepidle = cp->tcpkeepidle;
@@ -378,6 +445,15 @@ conf_dump(struct conf *cf)
                   cp->server_retry_timeout);
         log_debug(LOG_VVERB, "  server_failure_limit: %d",
                   cp->server_failure_limit);
+        log_debug(LOG_VVERB, "  mem_budget: %d", cp->mem_budget);
+        log_debug(LOG_VVERB, "  max_keys_per_fragment: %d",
+                  cp->max_keys_per_fragment);
+        log_debug(LOG_VVERB, "  partial_mget: %d", cp->partial_mget);
+        log_debug(LOG_VVERB, "  hot_cache_size: %d", cp->hot_cache_size);
+        log_debug(LOG_VVERB, "  hot_cache_ttl: %d", cp->hot_cache_ttl);
+        log_debug(LOG_VVERB, "  hot_cache_threshold: %d",
+                  cp->hot_cache_threshold);
+        log_debug(LOG_VVERB, "  collapse_reads: %d", cp->collapse_reads);
 
         nserver = array_n(&cp->server);
         log_debug(LOG_VVERB, "  servers: %"PRIu32"", nserver);
@@ -1343,6 +1419,34 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->server_failure_limit = CONF_DEFAULT_SERVER_FAILURE_LIMIT;
     }
 
+    if (cp->mem_budget == CONF_UNSET_NUM) {
+        cp->mem_budget = CONF_DEFAULT_MEM_BUDGET;
+    }
+
+    if (cp->max_keys_per_fragment == CONF_UNSET_NUM) {
+        cp->max_keys_per_fragment = CONF_DEFAULT_MAX_KEYS_PER_FRAGMENT;
+    }
+
+    if (cp->partial_mget == CONF_UNSET_NUM) {
+        cp->partial_mget = CONF_DEFAULT_PARTIAL_MGET;
+    }
+
+    if (cp->hot_cache_size == CONF_UNSET_NUM) {
+        cp->hot_cache_size = CONF_DEFAULT_HOT_CACHE_SIZE;
+    }
+
+    if (cp->hot_cache_ttl == CONF_UNSET_NUM) {
+        cp->hot_cache_ttl = CONF_DEFAULT_HOT_CACHE_TTL;
+    }
+
+    if (cp->hot_cache_threshold == CONF_UNSET_NUM) {
+        cp->hot_cache_threshold = CONF_DEFAULT_HOT_CACHE_THRESHOLD;
+    }
+
+    if (cp->collapse_reads == CONF_UNSET_NUM) {
+        cp->collapse_reads = CONF_DEFAULT_COLLAPSE_READS;
+    }
+
 #if 1 //shenzheng 2015-6-5 tcpkeepalive
 	if (cp->tcpkeepalive == CONF_UNSET_NUM) {
 		cp->tcpkeepalive = CONF_DEFAULT_TCPKEEPALIVE;
@@ -2331,6 +2435,28 @@ conf_pool_each_compare(void *elem, void *data)
 		return NC_ERROR;
 	}
 
+	if (cp1->mem_budget != cp2->mem_budget) {
+		return NC_ERROR;
+	}
+
+	if (cp1->max_keys_per_fragment != cp2->max_keys_per_fragment) {
+		return NC_ERROR;
+	}
+
+	if (cp1->partial_mget != cp2->partial_mget) {
+		return NC_ERROR;
+	}
+
+	if (cp1->hot_cache_size != cp2->hot_cache_size ||
+	    cp1->hot_cache_ttl != cp2->hot_cache_ttl ||
+	    cp1->hot_cache_threshold != cp2->hot_cache_threshold) {
+		return NC_ERROR;
+	}
+
+	if (cp1->collapse_reads != cp2->collapse_reads) {
+		return NC_ERROR;
+	}
+
 	//servers
 	server_count1 = array_n(&cp1->server);
 	server_count2 = array_n(&cp2->server);
@@ -3131,7 +3257,8 @@ conf_create_from_zk(struct context * ctx, char *zk_servers, char *zk_path)
 	
 	cf_s.data = nc_zalloc(Zk_MAX_DATA_LEN*sizeof(cf_s.data));
 	cf_s.len = Zk_MAX_DATA_LEN;
-	if(cf_s.data == NULL)
+	
+if(cf_s.data == NULL)
 	{
 		return NULL;
 	}
@@ -56,6 +56,13 @@
 #define CONF_DEFAULT_SERVER_RETRY_TIMEOUT    30 * 1000      /* in msec */
 #define CONF_DEFAULT_SERVER_FAILURE_LIMIT    2
 #define CONF_DEFAULT_SERVER_CONNECTIONS      1
+#define CONF_DEFAULT_MEM_BUDGET              0              /* in MB */
+#define CONF_DEFAULT_MAX_KEYS_PER_FRAGMENT   0
+#define CONF_DEFAULT_PARTIAL_MGET            false
+#define CONF_DEFAULT_HOT_CACHE_SIZE          0              /* in MB */
+#define CONF_DEFAULT_HOT_CACHE_TTL           100            /* in msec */
+#define CONF_DEFAULT_HOT_CACHE_THRESHOLD     100            /* reads per sec */
+#define CONF_DEFAULT_COLLAPSE_READS          false
 #define CONF_DEFAULT_KETAMA_PORT             11211
 
 #if 1 //shenzheng 2015-1-8 log rotating
@@ -116,6 +123,13 @@ struct conf_pool {
     int                server_connections;    /* server_connections: */
     int                server_retry_timeout;  /* server_retry_timeout: in msec */
     int                server_failure_limit;  /* server_failure_limit: */
+    int                mem_budget;            /* mem_budget: in MB */
+    int                max_keys_per_fragment; /* max_keys_per_fragment: */
+    int                partial_mget;          /* partial_mget: */
+    int                hot_cache_size;        /* hot_cache_size: in MB */
+    int                hot_cache_ttl;         /* hot_cache_ttl: in msec */
+    int                hot_cache_threshold;   /* hot_cache_threshold: */
+    int                collapse_reads;        /* collapse_reads: */
     struct array       server;                /* servers: conf_server[] */
     unsigned           valid:1;               /* valid? */
 	
@@ -81,11 +81,12 @@
  * the queue.
  */
 
-static uint32_t nfree_connq;       /* # free conn q */
-static struct conn_tqh free_connq; /* free conn q */
-static uint64_t ntotal_conn;       /* total # connections counter from start */
-static uint32_t ncurr_conn;        /* current # connections */
-static uint32_t ncurr_cconn;       /* current # client connections */
+static __thread uint32_t nfree_connq;       /* # free conn q */
+static __thread uint32_t nfree_connq_peak;  /* max # free conn q */
+static __thread struct conn_tqh free_connq; /* free conn q */
+static uint64_t ntotal_conn;                /* total # connections counter from start */
+static uint32_t ncurr_conn;                 /* current # connections */
+static uint32_t ncurr_cconn;                /* current # client connections */
 
 #if 1 //shenzheng 2015-7-8 proxy administer
 static uint32_t nfree_connq_proxy_adm;       /* # free conn q for proxy administer  */
@@ -95,6 +96,83 @@ static uint32_t ncurr_conn_proxy_adm;        /* current # connections for proxy
 static uint32_t ncurr_cconn_proxy_adm;       /* current # client connections for proxy administer  */
 #endif //shenzheng 2015-7-8 proxy administer
 
+/*
+ * client receives a request, possibly parsing it, and sends a response
+ * downstream.
+ */
+static const struct conn_ops conn_client_ops = {
+    .recv = msg_recv,
+    .recv_next = req_recv_next,
+    .recv_done = req_recv_done,
+    .send = msg_send,
+    .send_next = rsp_send_next,
+    .send_done = rsp_send_done,
+    .close = client_close,
+    .active = client_active,
+    .ref = client_ref,
+    .unref = client_unref,
+    .enqueue_inq = NULL,
+    .dequeue_inq = NULL,
+    .enqueue_outq = req_client_enqueue_omsgq,
+    .dequeue_outq = req_client_dequeue_omsgq,
+};
+
+/*
+ * server receives a response, possibly parsing it, and sends a request
+ * upstream.
+ */
+static const struct conn_ops conn_server_ops = {
+    .recv = msg_recv,
+    .recv_next = rsp_recv_next,
+    .recv_done = rsp_recv_done,
+    .send = msg_send,
+    .send_next = req_send_next,
+    .send_done = req_send_done,
+    .close = server_close,
+    .active = server_active,
+    .ref = server_ref,
+    .unref = server_unref,
+    .enqueue_inq = req_server_enqueue_imsgq,
+    .dequeue_inq = req_server_dequeue_imsgq,
+    .enqueue_outq = req_server_enqueue_omsgq,
+    .dequeue_outq = req_server_dequeue_omsgq,
+};
+
+/* proxy only accepts client connections */
+static const struct conn_ops conn_proxy_ops = {
+    .recv = proxy_recv,
+    .close = proxy_close,
+    .ref = proxy_ref,
+    .unref = proxy_unref,
+};
+
+static const struct conn_ops conn_proxy_adm_client_ops = {
+    .recv = msg_recv_proxy_adm,
+    .recv_next = req_recv_next_proxy_adm,
+    .recv_done = req_recv_done_proxy_adm,
+    .send = msg_send_proxy_adm,
+    .send_next = rsp_send_next_proxy_adm,
+    .send_done = rsp_send_done_proxy_adm,
+    .close = proxy_adm_client_close,
+    .active = proxy_adm_client_active,
+    .ref = proxy_adm_client_ref,
+    .unref = proxy_adm_client_unref,
+    .enqueue_inq = NULL,
+    .dequeue_inq = NULL,
+    .enqueue_outq = req_client_enqueue_omsgq,
+    .dequeue_outq = req_client_dequeue_omsgq,
+};
+
+static const struct conn_ops conn_proxy_adm_ops = {
+    .recv = proxy_adm_recv,
+    .close = proxy_adm_close,
+    .ref = proxy_adm_ref,
+    .unref = proxy_adm_unref,
+};
+
+/* config reload connections are never driven by the event loop */
+static const struct conn_ops conn_reload_ops;
+
 /*
  * Return the context associated with this connection.
  */
@@ -141,14 +219,12 @@ _conn_get(void)
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
-    /*
-     * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
-     * {close, active}, parse, {ref, unref}, {enqueue_inq, dequeue_inq} and
-     * {enqueue_outq, dequeue_outq} are initialized by the wrapper.
-     */
+    /* handlers (ops) are initialized by the wrapper */
 
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
+    conn->shrink_bytes = 0;
+    conn->mbuf_cid = mbuf_class_large();
 
     conn->events = 0;
     conn->err = 0;
@@ -165,6 +241,10 @@ _conn_get(void)
     conn->done = 0;
     conn->redis = 0;
     conn->need_auth = 0;
+    conn->dirty = 0;
+    conn->stalled = 0;
+    conn->readable = 0;
+    conn->batched = 0;
 	
 #if 1 //shenzheng 2015-7-14 config-reload
 	conn->reload_conf = 0;
@@ -176,8 +256,8 @@ _conn_get(void)
 	conn->ctx = NULL;
 #endif //shenzheng 2015-7-28 replace server
 
-    ntotal_conn++;
-    ncurr_conn++;
+    nc_atomic_incr(ntotal_conn);
+    nc_atomic_incr(ncurr_conn);
 
     return conn;
 }
@@ -213,27 +293,14 @@ conn_get(void *owner, bool client, bool redis)
          * client receives a request, possibly parsing it, and sends a
          * response downstream.
          */
-        conn->recv = msg_recv;
-        conn->recv_next = req_recv_next;
-        conn->recv_done = req_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = rsp_send_next;
-        conn->send_done = rsp_send_done;
+        conn->ops = &conn_client_ops;
 
-        conn->close = client_close;
-        conn->active = client_active;
-
-        conn->ref = client_ref;
-        conn->unref = client_unref;
         conn->need_auth = conn_need_auth(owner, redis);
 
-        conn->enqueue_inq = NULL;
-        conn->dequeue_inq = NULL;
-        conn->enqueue_outq = req_client_enqueue_omsgq;
-        conn->dequeue_outq = req_client_dequeue_omsgq;
+        /* start at the smallest class; see msg_recv_chain() */
+        conn->mbuf_cid = 0;
 
-        ncurr_cconn++;
+        nc_atomic_incr(ncurr_cconn);
     } else {
         /*
          * server receives a response, possibly parsing it, and sends a
@@ -241,29 +308,15 @@ conn_get(void *owner, bool client, bool redis)
          */
         struct server *server = (struct server *)owner;
 
-        conn->recv = msg_recv;
-        conn->recv_next = rsp_recv_next;
-        conn->recv_done = rsp_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = req_send_next;
-        conn->send_done = req_send_done;
-
-        conn->close = server_close;
-        conn->active = server_active;
-
-        conn->ref = server_ref;
-        conn->unref = server_unref;
+        conn->ops = &conn_server_ops;
 
         conn->need_auth = conn_need_auth(server->owner, redis);
 
-        conn->enqueue_inq = req_server_enqueue_imsgq;
-        conn->dequeue_inq = req_server_dequeue_imsgq;
-        conn->enqueue_outq = req_server_enqueue_omsgq;
-        conn->dequeue_outq = req_server_dequeue_omsgq;
+        /* start at the default class; see msg_recv_chain() */
+        conn->mbuf_cid = mbuf_class_default();
     }
 
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
     log_debug(LOG_VVERB, "get conn %p client %d", conn, conn->client);
 
     return conn;
@@ -284,26 +337,9 @@ conn_get_proxy(void *owner)
 
     conn->proxy = 1;
 
-    conn->recv = proxy_recv;
-    conn->recv_next = NULL;
-    conn->recv_done = NULL;
-
-    conn->send = NULL;
-    conn->send_next = NULL;
-    conn->send_done = NULL;
-
-    conn->close = proxy_close;
-    conn->active = NULL;
-
-    conn->ref = proxy_ref;
-    conn->unref = proxy_unref;
+    conn->ops = &conn_proxy_ops;
 
-    conn->enqueue_inq = NULL;
-    conn->dequeue_inq = NULL;
-    conn->enqueue_outq = NULL;
-    conn->dequeue_outq = NULL;
-
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
 
     log_debug(LOG_VVERB, "get conn %p proxy %d", conn, conn->proxy);
 
@@ -325,13 +361,36 @@ conn_put(struct conn *conn)
 
     log_debug(LOG_VVERB, "put conn %p", conn);
 
+    /* closed before its pending output was flushed */
+    if (conn->dirty) {
+        LIST_REMOVE(conn, dirty_le);
+        conn->dirty = 0;
+    }
+
+    if (conn->stalled) {
+        LIST_REMOVE(conn, stall_le);
+        conn->stalled = 0;
+    }
+
+    if (conn->readable) {
+        LIST_REMOVE(conn, ready_le);
+        conn->readable = 0;
+    }
+
+    /* closed while the results of its batch are processed */
+    conn->batched = 0;
+
     nfree_connq++;
     TAILQ_INSERT_HEAD(&free_connq, conn, conn_tqe);
 
+    if (nfree_connq > nfree_connq_peak) {
+        nfree_connq_peak = nfree_connq;
+    }
+
     if (conn->client) {
-        ncurr_cconn--;
+        nc_atomic_decr(ncurr_cconn);
     }
-    ncurr_conn--;
+    nc_atomic_decr(ncurr_conn);
 }
 
 void
@@ -339,9 +398,31 @@ conn_init(void)
 {
     log_debug(LOG_DEBUG, "conn size %d", sizeof(struct conn));
     nfree_connq = 0;
+    nfree_connq_peak = 0;
     TAILQ_INIT(&free_connq);
 }
 
+/*
+ * Release up to nbatch conns from the free conn q of the calling thread
+ * while it holds more than nmax of them, least recently used first.
+ * Return the # conns released.
+ */
+uint32_t
+conn_trim(uint32_t nmax, uint32_t nbatch)
+{
+    struct conn *conn;
+    uint32_t n;
+
+    for (n = 0; n < nbatch && nfree_connq > nmax; n++) {
+        conn = TAILQ_LAST(&free_connq, conn_tqh);
+        TAILQ_REMOVE(&free_connq, conn, conn_tqe);
+        conn_free(conn);
+        nfree_connq--;
+    }
+
+    return n;
+}
+
 void
 conn_deinit(void)
 {
@@ -356,6 +437,49 @@ conn_deinit(void)
     ASSERT(nfree_connq == 0);
 }
 
+/*
+ * Account for the result of a read of at most size bytes on conn, the #
+ * bytes read or a negative errno, made by conn_recv() or as part of a
+ * batch (see event_batch_recv). Return the # bytes read, NC_EAGAIN if
+ * there was nothing to read, or NC_ERROR.
+ */
+ssize_t
+conn_recv_done(struct conn *conn, ssize_t n, size_t size)
+{
+    log_debug(LOG_VERB, "recv on sd %d %zd of %zu", conn->sd, n, size);
+
+    if (n > 0) {
+        if (n < (ssize_t) size) {
+            conn->recv_ready = 0;
+        }
+        conn->recv_bytes += (size_t)n;
+        return n;
+    }
+
+    if (n == 0) {
+        conn->recv_ready = 0;
+        conn->eof = 1;
+        log_debug(LOG_INFO, "recv on sd %d eof rb %zu sb %zu", conn->sd,
+                  conn->recv_bytes, conn->send_bytes);
+        return n;
+    }
+
+    if (n == -EINTR) {
+        /* still ready; read again */
+        log_debug(LOG_VERB, "recv on sd %d not ready - eintr", conn->sd);
+        return NC_EAGAIN;
+    } else if (n == -EAGAIN || n == -EWOULDBLOCK) {
+        conn->recv_ready = 0;
+        log_debug(LOG_VERB, "recv on sd %d not ready - eagain", conn->sd);
+        return NC_EAGAIN;
+    } else {
+        conn->recv_ready = 0;
+        conn->err = (err_t)-n;
+        log_error("recv on sd %d failed: %s", conn->sd, strerror(conn->err));
+        return NC_ERROR;
+    }
+}
+
 ssize_t
 conn_recv(struct conn *conn, void *buf, size_t size)
 {
@@ -365,45 +489,52 @@ conn_recv(struct conn *conn, void *buf, size_t size)
     ASSERT(size > 0);
     ASSERT(conn->recv_ready);
 
-    for (;;) {
+    do {
         n = nc_read(conn->sd, buf, size);
+    } while (n < 0 && errno == EINTR);
 
-        log_debug(LOG_VERB, "recv on sd %d %zd of %zu", conn->sd, n, size);
-
-        if (n > 0) {
-            if (n < (ssize_t) size) {
-                conn->recv_ready = 0;
-            }
-            conn->recv_bytes += (size_t)n;
-            return n;
-        }
+    return conn_recv_done(conn, n < 0 ? -errno : n, size);
+}
 
-        if (n == 0) {
-            conn->recv_ready = 0;
-            conn->eof = 1;
-            log_debug(LOG_INFO, "recv on sd %d eof rb %zu sb %zu", conn->sd,
-                      conn->recv_bytes, conn->send_bytes);
-            return n;
-        }
+/*
+ * Account for the result of a write of nsend bytes on conn, the # bytes
+ * written or a negative errno, made by conn_sendv() or as part of a batch
+ * (see event_batch_writev). Return the # bytes written, NC_EAGAIN if the
+ * socket was full, or NC_ERROR.
+ */
+ssize_t
+conn_sendv_done(struct conn *conn, ssize_t n, size_t nsend)
+{
+    log_debug(LOG_VERB, "sendv on sd %d %zd of %zu", conn->sd, n, nsend);
 
-        if (errno == EINTR) {
-            log_debug(LOG_VERB, "recv on sd %d not ready - eintr", conn->sd);
-            continue;
-        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            conn->recv_ready = 0;
-            log_debug(LOG_VERB, "recv on sd %d not ready - eagain", conn->sd);
-            return NC_EAGAIN;
-        } else {
-            conn->recv_ready = 0;
-            conn->err = errno;
-            log_error("recv on sd %d failed: %s", conn->sd, strerror(errno));
-            return NC_ERROR;
+    if (n > 0) {
+        if (n < (ssize_t) nsend) {
+            conn->send_ready = 0;
         }
+        conn->send_bytes += (size_t)n;
+        return n;
     }
 
-    NOT_REACHED();
+    if (n == 0) {
+        log_warn("sendv on sd %d returned zero", conn->sd);
+        conn->send_ready = 0;
+        return 0;
+    }
 
-    return NC_ERROR;
+    if (n == -EINTR) {
+        /* still ready; write again */
+        log_debug(LOG_VERB, "sendv on sd %d not ready - eintr", conn->sd);
+        return NC_EAGAIN;
+    } else if (n == -EAGAIN || n == -EWOULDBLOCK) {
+        conn->send_ready = 0;
+        log_debug(LOG_VERB, "sendv on sd %d not ready - eagain", conn->sd);
+        return NC_EAGAIN;
+    } else {
+        conn->send_ready = 0;
+        conn->err = (err_t)-n;
+        log_error("sendv on sd %d failed: %s", conn->sd, strerror(conn->err));
+        return NC_ERROR;
+    }
 }
 
 ssize_t
@@ -415,62 +546,44 @@ conn_sendv(struct conn *conn, struct array *sendv, size_t nsend)
     ASSERT(nsend != 0);
     ASSERT(conn->send_ready);
 
-    for (;;) {
-        n = nc_writev(conn->sd, sendv->elem, sendv->nelem);
-
-        log_debug(LOG_VERB, "sendv on sd %d %zd of %zu in %"PRIu32" buffers",
-                  conn->sd, n, nsend, sendv->nelem);
-
-        if (n > 0) {
-            if (n < (ssize_t) nsend) {
-                conn->send_ready = 0;
-            }
-            conn->send_bytes += (size_t)n;
-            return n;
-        }
-
-        if (n == 0) {
-            log_warn("sendv on sd %d returned zero", conn->sd);
-            conn->send_ready = 0;
-            return 0;
-        }
-
-        if (errno == EINTR) {
-            log_debug(LOG_VERB, "sendv on sd %d not ready - eintr", conn->sd);
-            continue;
-        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            conn->send_ready = 0;
-            log_debug(LOG_VERB, "sendv on sd %d not ready - eagain", conn->sd);
-            return NC_EAGAIN;
-        } else {
-            conn->send_ready = 0;
-            conn->err = errno;
-            log_error("sendv on sd %d failed: %s", conn->sd, strerror(errno));
-            return NC_ERROR;
-        }
-    }
+    log_debug(LOG_VVERB, "sendv on sd %d %zu in %"PRIu32" buffers", conn->sd,
+              nsend, sendv->nelem);
 
-    NOT_REACHED();
+    do {
+        n = nc_writev(conn->sd, sendv->elem, sendv->nelem);
+    } while (n < 0 && errno == EINTR);
 
-    return NC_ERROR;
+    return conn_sendv_done(conn, n < 0 ? -errno : n, nsend);
 }
 
 uint32_t
 conn_ncurr_conn(void)
 {
-    return ncurr_conn;
+    return nc_atomic_get(ncurr_conn);
 }
 
 uint64_t
 conn_ntotal_conn(void)
 {
-    return ntotal_conn;
+    return nc_atomic_get(ntotal_conn);
 }
 
 uint32_t
 conn_ncurr_cconn(void)
 {
-    return ncurr_cconn;
+    return nc_atomic_get(ncurr_cconn);
+}
+
+uint32_t
+conn_nfree_conn(void)
+{
+    return nfree_connq;
+}
+
+uint32_t
+conn_nfree_conn_peak(void)
+{
+    return nfree_connq_peak;
 }
 
 #if 1 //shenzheng 2015-4-27 proxy administer
@@ -520,14 +633,12 @@ _conn_get_proxy_adm(void)
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
-    /*
-     * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
-     * {close, active}, parse, {ref, unref}, {enqueue_inq, dequeue_inq} and
-     * {enqueue_outq, dequeue_outq} are initialized by the wrapper.
-     */
+    /* handlers (ops) are initialized by the wrapper */
 
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
+    conn->shrink_bytes = 0;
+    conn->mbuf_cid = mbuf_class_large();
 
     conn->events = 0;
     conn->err = 0;
@@ -593,54 +704,19 @@ conn_get_proxy_adm(void *owner, int sd, bool client)
 	if(client)
 	{
 		conn->client = 1;
-		conn->recv = msg_recv_proxy_adm;
-		conn->recv_next = req_recv_next_proxy_adm;
-		conn->recv_done = req_recv_done_proxy_adm;
-
-		conn->send = msg_send_proxy_adm;
-		conn->send_next = rsp_send_next_proxy_adm;
-		conn->send_done = rsp_send_done_proxy_adm;
-
-		conn->close = proxy_adm_client_close;
-		conn->active = proxy_adm_client_active;
-
-		conn->ref = proxy_adm_client_ref;
-		conn->unref = proxy_adm_client_unref;
+		conn->ops = &conn_proxy_adm_client_ops;
 		conn->need_auth = NULL;
 		
-		conn->enqueue_inq = NULL;
-		conn->dequeue_inq = NULL;
-		conn->enqueue_outq = req_client_enqueue_omsgq;
-		conn->dequeue_outq = req_client_dequeue_omsgq;		
-		
 		ncurr_cconn_proxy_adm++;
 	}
 	else
 	{
 		conn->proxy = 1;
-		conn->recv = proxy_adm_recv;
-	    conn->recv_next = NULL;
-	    conn->recv_done = NULL;
-
-	    conn->send = NULL;
-	    conn->send_next = NULL;
-	    conn->send_done = NULL;
-
-	    conn->close = proxy_adm_close;
-	    conn->active = NULL;
-
-	    conn->ref = proxy_adm_ref;
-	    conn->unref = proxy_adm_unref;
-
-	    conn->enqueue_inq = NULL;
-	    conn->dequeue_inq = NULL;
-	    conn->enqueue_outq = NULL;
-	    conn->dequeue_outq = NULL;
-
+		conn->ops = &conn_proxy_adm_ops;
     }
 	
 
-	conn->ref(conn, owner);
+	conn->ops->ref(conn, owner);
     log_debug(LOG_VVERB, "get conn %p client %d", conn, conn->client);
 
 	return conn;
@@ -668,14 +744,12 @@ _conn_get_for_reload(void)
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
-    /*
-     * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
-     * {close, active}, parse, {ref, unref}, {enqueue_inq, dequeue_inq} and
-     * {enqueue_outq, dequeue_outq} are initialized by the wrapper.
-     */
+    /* handlers (ops) are initialized by the wrapper */
 
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
+    conn->shrink_bytes = 0;
+    conn->mbuf_cid = mbuf_class_large();
 
     conn->events = 0;
     conn->err = 0;
@@ -700,8 +774,8 @@ _conn_get_for_reload(void)
 	conn->ctx = NULL;
 #endif //shenzheng 2015-7-28 replace server
 
-    ntotal_conn++;
-    ncurr_conn++;
+    nc_atomic_incr(ntotal_conn);
+    nc_atomic_incr(ncurr_conn);
 	
     return conn;
 }
@@ -721,26 +795,9 @@ conn_get_proxy_for_reload(void *owner)
 
     conn->proxy = 1;
 
-    conn->recv = proxy_recv;
-    conn->recv_next = NULL;
-    conn->recv_done = NULL;
-
-    conn->send = NULL;
-    conn->send_next = NULL;
-    conn->send_done = NULL;
-
-    conn->close = proxy_close;
-    conn->active = NULL;
+    conn->ops = &conn_proxy_ops;
 
-    conn->ref = proxy_ref;
-    conn->unref = proxy_unref;
-
-    conn->enqueue_inq = NULL;
-    conn->dequeue_inq = NULL;
-    conn->enqueue_outq = NULL;
-    conn->dequeue_outq = NULL;
-
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
 
     log_debug(LOG_VVERB, "get conn %p proxy %d", conn, conn->proxy);
 
@@ -761,24 +818,7 @@ conn_get_for_reload(void *owner)
 
     conn->proxy = 0;
 
-    conn->recv = NULL;
-    conn->recv_next = NULL;
-    conn->recv_done = NULL;
-
-    conn->send = NULL;
-    conn->send_next = NULL;
-    conn->send_done = NULL;
-
-    conn->close = NULL;
-    conn->active = NULL;
-
-    conn->ref = NULL;
-    conn->unref = NULL;
-
-    conn->enqueue_inq = NULL;
-    conn->dequeue_inq = NULL;
-    conn->enqueue_outq = NULL;
-    conn->dequeue_outq = NULL;
+    conn->ops = &conn_reload_ops;
 
 	conn->owner = owner;
 
@@ -797,7 +837,7 @@ conn_put_for_reload(struct conn *conn)
 
     log_debug(LOG_VVERB, "free conn %p", conn);
 
-    ncurr_conn--;
+    nc_atomic_decr(ncurr_conn);
 	nc_free(conn);
 }
 #endif //shenzheng 2015-7-14 config-reload
@@ -851,7 +891,7 @@ void conn_close_for_replace_server(struct conn *conn, int err)
 
 		log_debug(LOG_DEBUG, "pmsg->swallow %d", pmsg->swallow);
 
-		conn->unref(conn);
+		conn->ops->unref(conn);
 
 		if(pmsg->swallow)
 		{
@@ -870,7 +910,7 @@ void conn_close_for_replace_server(struct conn *conn, int err)
 	        pmsg->err = conn->err;
 
 	        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-	            event_add_out(ctx->evb, c_conn);
+	            core_dirty(ctx, c_conn);
 	        }
 		}
 		
@@ -36,20 +36,11 @@ typedef void (*conn_unref_t)(struct conn *);
 
 typedef void (*conn_msgq_t)(struct context *, struct conn *, struct msg *);
 
-struct conn {
-    TAILQ_ENTRY(conn)  conn_tqe;      /* link in server_pool / server / free q */
-    void               *owner;        /* connection owner - server_pool / server */
-
-    int                sd;            /* socket descriptor */
-    int                family;        /* socket address family */
-    socklen_t          addrlen;       /* socket length */
-    struct sockaddr    *addr;         /* socket address (ref in server or server_pool) */
-
-    struct msg_tqh     imsg_q;        /* incoming request Q */
-    struct msg_tqh     omsg_q;        /* outstanding request Q */
-    struct msg         *rmsg;         /* current message being rcvd */
-    struct msg         *smsg;         /* current message being sent */
-
+/*
+ * Handlers of a connection type. Every client, server or proxy connection
+ * of a kind shares one static table, referenced from the connection.
+ */
+struct conn_ops {
     conn_recv_t        recv;          /* recv (read) handler */
     conn_recv_next_t   recv_next;     /* recv next message handler */
     conn_recv_done_t   recv_done;     /* read done handler */
@@ -66,8 +57,30 @@ struct conn {
     conn_msgq_t        dequeue_inq;   /* connection inq msg dequeue handler */
     conn_msgq_t        enqueue_outq;  /* connection outq msg enqueue handler */
     conn_msgq_t        dequeue_outq;  /* connection outq msg dequeue handler */
+};
+
+struct conn {
+    TAILQ_ENTRY(conn)  conn_tqe;      /* link in server_pool / server / free q */
+    LIST_ENTRY(conn)   dirty_le;      /* link in context dirty list */
+    LIST_ENTRY(conn)   stall_le;      /* link in context stalled list */
+    LIST_ENTRY(conn)   ready_le;      /* link in context readable list */
+    void               *owner;        /* connection owner - server_pool / server */
+
+    int                sd;            /* socket descriptor */
+    int                family;        /* socket address family */
+    socklen_t          addrlen;       /* socket length */
+    struct sockaddr    *addr;         /* socket address (ref in server or server_pool) */
+
+    struct msg_tqh     imsg_q;        /* incoming request Q */
+    struct msg_tqh     omsg_q;        /* outstanding request Q */
+    struct msg         *rmsg;         /* current message being rcvd */
+    struct msg         *smsg;         /* current message being sent */
+
+    const struct conn_ops *ops;       /* handlers shared by connection type */
 
     size_t             recv_bytes;    /* received (read) bytes */
+    size_t             shrink_bytes;  /* recv_bytes at the last idle shrink */
+    uint32_t           mbuf_cid;      /* mbuf size class to read into */
     size_t             send_bytes;    /* sent (written) bytes */
 
     uint32_t           events;        /* connection io events */
@@ -85,6 +98,10 @@ struct conn {
     unsigned           done:1;        /* done? aka close? */
     unsigned           redis:1;       /* redis? */
     unsigned           need_auth:1;   /* need_auth? */
+    unsigned           dirty:1;       /* output pending flush? */
+    unsigned           stalled:1;     /* reads paused by memory budget? */
+    unsigned           readable:1;    /* read queued for the next batch? */
+    unsigned           batched:1;     /* read or write in the running batch? */
 
 #if 1 //shenzheng 2015-7-14 config-reload
 	unsigned           reload_conf:1;   /* for reload_conf? */
@@ -98,15 +115,21 @@ struct conn {
 };
 
 TAILQ_HEAD(conn_tqh, conn);
+LIST_HEAD(conn_lh, conn);
 
 struct context *conn_to_ctx(struct conn *conn);
 struct conn *conn_get(void *owner, bool client, bool redis);
 struct conn *conn_get_proxy(void *owner);
 void conn_put(struct conn *conn);
 ssize_t conn_recv(struct conn *conn, void *buf, size_t size);
+ssize_t conn_recv_done(struct conn *conn, ssize_t n, size_t size);
 ssize_t conn_sendv(struct conn *conn, struct array *sendv, size_t nsend);
+ssize_t conn_sendv_done(struct conn *conn, ssize_t n, size_t nsend);
 void conn_init(void);
 void conn_deinit(void);
+uint32_t conn_trim(uint32_t nmax, uint32_t nbatch);
+uint32_t conn_nfree_conn(void);
+uint32_t conn_nfree_conn_peak(void);
 uint32_t conn_ncurr_conn(void);
 uint64_t conn_ntotal_conn(void);
 uint32_t conn_ncurr_cconn(void);
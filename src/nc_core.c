@@ -24,6 +24,32 @@
 
 static uint32_t ctx_id; /* context generation */
 
+/*
+ * Client reads paused by the memory budget resume once usage falls
+ * below this percentage of the budget
+ */
+#define CORE_MEM_LOWAT  80
+
+/*
+ * Free lists are trimmed down to ctx->max_nfree at most this many objects
+ * per list at a time, every interval while there is nothing to trim and
+ * ten times as often while there is
+ */
+#define CORE_TRIM_INTERVAL  1000 /* in msec */
+#define CORE_TRIM_BATCH     256
+
+/*
+ * With more than one worker, every event loop wakes up at least this
+ * often to notice a stop request or the failure of another worker
+ */
+#define CORE_WORKER_INTERVAL 1000 /* in msec */
+
+static size_t core_mem_total;      /* memory in use by all workers */
+static uint64_t core_mem_nthrottle; /* # times reads were paused */
+
+static uint32_t core_quit;          /* worker threads asked to stop? */
+static uint32_t core_nfail;         /* # workers whose event loop failed */
+
 static rstatus_t
 core_calc_connections(struct context *ctx)
 {
@@ -37,7 +63,8 @@ core_calc_connections(struct context *ctx)
     }
 
     ctx->max_nfd = (uint32_t)limit.rlim_cur;
-    ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn - RESERVED_FDS;
+    /* descriptors are shared by the server connections of all workers */
+    ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn * ctx->nworker - RESERVED_FDS;
     log_debug(LOG_NOTICE, "max fds %"PRIu32" max client conns %"PRIu32" "
               "max server conns %"PRIu32"", ctx->max_nfd, ctx->max_ncconn,
               ctx->max_nsconn);
@@ -45,8 +72,115 @@ core_calc_connections(struct context *ctx)
     return NC_OK;
 }
 
+/*
+ * Split the memory budgets and hot key caches evenly between the workers;
+ * every worker only accounts for and throttles on its own memory. The
+ * caches of a pool share the invalidation epochs of the first worker.
+ */
+static void
+core_mem_init(struct instance *nci, struct context *ctx)
+{
+    uint32_t i, n;
+
+    ctx->mem_budget = nci->mem_budget / nci->workers;
+    ctx->mem_reported = 0;
+    ctx->mem_throttled = 0;
+
+    for (i = 0, n = array_n(&ctx->pool); i < n; i++) {
+        struct server_pool *pool = array_get(&ctx->pool, i);
+
+        pool->mem_budget /= nci->workers;
+
+        if (pool->cache != NULL) {
+            struct server_pool *owner = NULL;
+
+            if (ctx->worker > 0) {
+                owner = array_get(&nci->ctx->pool, i);
+            }
+            cache_share(pool->cache, owner != NULL ? owner->cache : NULL,
+                        nci->workers);
+        }
+    }
+}
+
+/*
+ * Shrink the read buffers of the client and server conns of ctx that are
+ * idle, i.e. that received nothing since the last shrink. Return the #
+ * mbufs released.
+ */
+static uint32_t
+core_shrink(struct context *ctx)
+{
+    struct array *pools;
+    struct conn *conn;
+    uint32_t i, j, n, nshrink;
+
+    nshrink = 0;
+
+    pools = ctx->which_pool ? &ctx->pool_swap : &ctx->pool;
+    for (i = 0, n = array_n(pools); i < n; i++) {
+        struct server_pool *pool = array_get(pools, i);
+
+        TAILQ_FOREACH(conn, &pool->c_conn_q, conn_tqe) {
+            if (conn->recv_bytes == conn->shrink_bytes) {
+                nshrink += msg_shrink(conn);
+            }
+            conn->shrink_bytes = conn->recv_bytes;
+        }
+
+        for (j = 0; j < array_n(&pool->server); j++) {
+            struct server *server = array_get(&pool->server, j);
+
+            TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+                if (conn->recv_bytes == conn->shrink_bytes) {
+                    nshrink += msg_shrink(conn);
+                }
+                conn->shrink_bytes = conn->recv_bytes;
+            }
+        }
+    }
+
+    return nshrink;
+}
+
+/*
+ * Release the read buffers of idle conns, and the objects on the free
+ * lists of the calling thread beyond ctx->max_nfree back to the
+ * allocator, in bounded batches so that a trim after a burst does not
+ * stall the event loop
+ */
+static void
+core_trim(struct context *ctx, struct timer *timer)
+{
+    uint32_t nshrink, ntrim;
+    int64_t interval;
+
+    nshrink = core_shrink(ctx);
+    if (nshrink > 0) {
+        log_debug(LOG_VERB, "released %"PRIu32" read buffers of idle conns",
+                  nshrink);
+    }
+
+    ntrim = 0;
+    if (ctx->max_nfree != 0) {
+        ntrim += mbuf_trim(ctx->max_nfree, CORE_TRIM_BATCH);
+        ntrim += msg_trim(ctx->max_nfree, CORE_TRIM_BATCH);
+        ntrim += conn_trim(ctx->max_nfree, CORE_TRIM_BATCH);
+    }
+
+    if (ntrim > 0) {
+        log_debug(LOG_VERB, "trimmed %"PRIu32" objects off the free lists",
+                  ntrim);
+        interval = CORE_TRIM_INTERVAL / 10;
+    } else {
+        interval = CORE_TRIM_INTERVAL;
+    }
+
+    timer_add(&ctx->timer, timer, timer_wheel_now(&ctx->timer) + interval);
+}
+
 static struct context *
-core_ctx_create(struct instance *nci)
+core_ctx_create(struct instance *nci, uint32_t worker)
 {
     rstatus_t status;
     struct context *ctx;
@@ -61,10 +195,26 @@ core_ctx_create(struct instance *nci)
     ctx->evb = NULL;
     array_null(&ctx->pool);
     ctx->max_timeout = nci->stats_interval;
+    if (nci->workers > 1) {
+        ctx->max_timeout = MIN(ctx->max_timeout, CORE_WORKER_INTERVAL);
+    }
     ctx->timeout = ctx->max_timeout;
     ctx->max_nfd = 0;
     ctx->max_ncconn = 0;
     ctx->max_nsconn = 0;
+    ctx->worker = worker;
+    ctx->nworker = nci->workers;
+    array_null(&ctx->workers);
+    timer_wheel_init(&ctx->timer);
+    timer_init(&ctx->trim, core_trim, NULL);
+    ctx->max_nfree = nci->max_nfree;
+    timer_add(&ctx->timer, &ctx->trim,
+              timer_wheel_now(&ctx->timer) + CORE_TRIM_INTERVAL);
+    LIST_INIT(&ctx->dirty);
+    LIST_INIT(&ctx->stalled);
+    LIST_INIT(&ctx->readable);
+    ctx->io = NULL;
+    ctx->nio = 0;
 #if 1 //shenzheng 2015-4-28 proxy administer
 	ctx->padm = NULL;
 #endif //shenzheng 2015-4-28 proxy administer
@@ -195,6 +345,8 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
+    core_mem_init(nci, ctx);
+
     /*
      * Get rlimit and calculate max client connections after we have
      * calculated max server connections
@@ -224,9 +376,17 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
-    /* create stats per server pool */
-    ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                              nci->hostname, &ctx->pool);
+    /*
+     * Create stats per server pool. Workers other than the first one only
+     * collect metrics, which are merged by the aggregator of the first
+     */
+    if (worker == 0) {
+        ctx->stats = stats_create(nci->stats_port, nci->stats_addr,
+                                  nci->stats_interval, nci->hostname,
+                                  nci->workers, &ctx->pool);
+    } else {
+        ctx->stats = stats_create_worker(nci->ctx->stats, worker, &ctx->pool);
+    }
     if (ctx->stats == NULL) {
 #if 1 //shenzheng 2015-6-11 zookeeper
 #ifdef NC_ZOOKEEPER
@@ -341,7 +501,7 @@ core_ctx_create(struct instance *nci)
     }
 
 #if 1 //shenzheng 2015-4-27 proxy administer
-	if(nci->proxy_adm_port > 0)
+	if(worker == 0 && nci->proxy_adm_port > 0)
 	{
 		ctx->padm = proxy_adm_create(ctx, nci->proxy_adm_addr, nci->proxy_adm_port);
 		if (ctx->padm == NULL) {
@@ -374,24 +534,81 @@ core_ctx_create(struct instance *nci)
 	}
 #endif //shenzheng 2015-4-27 proxy administer
 
+    /* read and write in batches if the event base can run them */
+    ctx->nio = (uint32_t)event_batch_size(ctx->evb);
+    if (ctx->nio != 0) {
+        ctx->io = nc_alloc(ctx->nio * sizeof(*ctx->io));
+        if (ctx->io == NULL) {
+            log_warn("alloc of %"PRIu32" batched io failed, reading and "
+                     "writing one conn at a time", ctx->nio);
+            ctx->nio = 0;
+        }
+    }
+
     log_debug(LOG_VVERB, "created ctx %p id %"PRIu32"", ctx, ctx->id);
 
     return ctx;
 }
 
+/*
+ * Ask the threads of the other workers to stop and wait for them. A
+ * worker notices on its next trip through the event loop, at most
+ * CORE_WORKER_INTERVAL later.
+ */
+static void
+core_workers_stop(struct context *ctx)
+{
+    int status;
+    uint32_t n;
+    pthread_t *tid;
+
+    n = array_n(&ctx->workers);
+    if (n == 0) {
+        return;
+    }
+
+    nc_atomic_incr(core_quit);
+
+    while (array_n(&ctx->workers) != 0) {
+        tid = array_pop(&ctx->workers);
+
+        status = pthread_join(*tid, NULL);
+        if (status != 0) {
+            log_error("join worker thread failed: %s", strerror(status));
+        }
+    }
+
+    log_debug(LOG_NOTICE, "stopped %"PRIu32" workers", n);
+}
+
 static void
 core_ctx_destroy(struct context *ctx)
 {
     log_debug(LOG_VVERB, "destroy ctx %p id %"PRIu32"", ctx, ctx->id);
+
+    /*
+     * The aggregator reads the stats of the other workers, so stop it
+     * before they destroy their own context on the way out
+     */
+    stats_stop_aggregator(ctx->stats);
+    core_workers_stop(ctx);
+    array_deinit(&ctx->workers);
+
     proxy_deinit(ctx);
     server_pool_disconnect(ctx);
     event_base_destroy(ctx->evb);
+    if (ctx->io != NULL) {
+        nc_free(ctx->io);
+    }
     stats_destroy(ctx->stats);
     server_pool_deinit(&ctx->pool);
     conf_destroy(ctx->cf);
 
 #if 1 //shenzheng 2015-4-28 proxy administer
-	proxy_adm_destroy(ctx->padm);
+	if(ctx->padm != NULL)
+	{
+		proxy_adm_destroy(ctx->padm);
+	}
 #endif //shenzheng 2015-4-28 proxy administer
 
 #if 1 //shenzheng 2015-5-8 config-reload
@@ -425,19 +642,117 @@ core_ctx_destroy(struct context *ctx)
     nc_free(ctx);
 }
 
+/*
+ * Event loop of a worker other than the first one. The worker runs until
+ * asked to stop by core_workers_stop() or until its loop fails, which it
+ * reports to the first worker through core_nfail, and then releases its
+ * context and the free lists of its thread.
+ */
+static void *
+core_worker_loop(void *arg)
+{
+    rstatus_t status;
+    struct context *ctx = arg;
+    uint32_t worker = ctx->worker;
+
+    mbuf_thread_init();
+    msg_thread_init();
+    conn_init();
+
+    log_debug(LOG_NOTICE, "worker %"PRIu32" running", worker);
+
+    while (nc_atomic_get(core_quit) == 0) {
+        status = core_loop(ctx);
+        if (status != NC_OK) {
+            log_error("worker %"PRIu32" event loop failed: %s", worker,
+                      strerror(errno));
+            nc_atomic_incr(core_nfail);
+            break;
+        }
+    }
+
+    core_ctx_destroy(ctx);
+
+    conn_deinit();
+    msg_thread_deinit();
+    mbuf_thread_deinit();
+
+    log_debug(LOG_NOTICE, "worker %"PRIu32" stopped", worker);
+
+    return NULL;
+}
+
+/*
+ * Create a context for every worker but the first one, which runs on
+ * the main thread, and start a thread per context. Each worker owns an
+ * event base, a SO_REUSEPORT listener per server pool and its own server
+ * connections, so nothing on the request path is shared between threads.
+ * On failure the workers started so far are stopped again.
+ */
+static rstatus_t
+core_workers_start(struct instance *nci, struct context *ctx)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    if (nci->workers <= 1) {
+        return NC_OK;
+    }
+
+    status = array_init(&ctx->workers, nci->workers - 1, sizeof(pthread_t));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 1; i < nci->workers; i++) {
+        struct context *wctx;
+        pthread_t *tid;
+        int err;
+
+        wctx = core_ctx_create(nci, i);
+        if (wctx == NULL) {
+            log_error("create worker %"PRIu32" failed", i);
+            core_workers_stop(ctx);
+            return NC_ERROR;
+        }
+
+        tid = array_push(&ctx->workers);
+        err = pthread_create(tid, NULL, core_worker_loop, wctx);
+        if (err != 0) {
+            log_error("worker %"PRIu32" create failed: %s", i, strerror(err));
+            array_pop(&ctx->workers);
+            core_ctx_destroy(wctx);
+            core_workers_stop(ctx);
+            return NC_ERROR;
+        }
+    }
+
+    log_debug(LOG_NOTICE, "started %"PRIu32" workers", nci->workers);
+
+    return NC_OK;
+}
+
 struct context *
 core_start(struct instance *nci)
 {
+    rstatus_t status;
     struct context *ctx;
 
     mbuf_init(nci);
     msg_init();
     conn_init();
 
-    ctx = core_ctx_create(nci);
+    ctx = core_ctx_create(nci, 0);
     if (ctx != NULL) {
         nci->ctx = ctx;
-        return ctx;
+
+        status = core_workers_start(nci, ctx);
+        if (status == NC_OK) {
+            return ctx;
+        }
+
+        core_ctx_destroy(ctx);
+        nci->ctx = NULL;
     }
 
     conn_deinit();
@@ -461,7 +776,7 @@ core_recv(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->recv(ctx, conn);
+    status = conn->ops->recv(ctx, conn);
     if (status != NC_OK) {
         log_debug(LOG_INFO, "recv on %c %d failed: %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -476,7 +791,7 @@ core_send(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->send(ctx, conn);
+    status = conn->ops->send(ctx, conn);
     if (status != NC_OK) {
         log_debug(LOG_INFO, "send on %c %d failed: status: %d errno: %d %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -512,7 +827,7 @@ core_close(struct context *ctx, struct conn *conn)
                  type, conn->sd, strerror(errno));
     }
 
-    conn->close(ctx, conn);
+    conn->ops->close(ctx, conn);
 }
 
 static void
@@ -531,63 +846,441 @@ core_error(struct context *ctx, struct conn *conn)
     core_close(ctx, conn);
 }
 
+void
+core_timeout_req(struct context *ctx, struct timer *timer)
+{
+    struct msg *msg;
+    struct conn *conn;
+
+    msg = (struct msg *)((char *)timer - offsetof(struct msg, tmo));
+    conn = timer->data;
+
+    /* skip over req that are in-error or done */
+
+    if (msg->error || msg->done) {
+        return;
+    }
+
+    /*
+     * timeout expired req and all the outstanding req on the timing
+     * out server
+     */
+
+    log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
+
+    conn->err = ETIMEDOUT;
+
+    if (conn->replace_server) {
+        conn_close_for_replace_server(conn, conn->err);
+    } else {
+        core_close(ctx, conn);
+    }
+}
+
+/*
+ * Queue conn for a write at the end of the current loop iteration.
+ * Output is written first and the write event is only armed when the
+ * socket cannot take all of it, which saves the two event_add_out and
+ * event_del_out round trips per burst on a lightly loaded connection.
+ */
+void
+core_dirty(struct context *ctx, struct conn *conn)
+{
+    if (conn->dirty || conn->send_active) {
+        /* already queued, or waiting for the write event */
+        return;
+    }
+
+    conn->dirty = 1;
+    LIST_INSERT_HEAD(&ctx->dirty, conn, dirty_le);
+}
+
+/*
+ * Write out the output of the dirty conns with one batch of writev per
+ * round. A conn whose socket took all it was given goes into the next
+ * round, the way msg_send() loops for as long as the socket is ready.
+ */
 static void
-core_timeout(struct context *ctx)
+core_flush_batch(struct context *ctx)
 {
-    for (;;) {
-        struct msg *msg;
-        struct conn *conn;
-        int64_t now, then;
+    struct msg_io *io;
+    struct conn *conn;
+    rstatus_t status;
+    uint32_t i, n;
+
+    while (!LIST_EMPTY(&ctx->dirty)) {
+        n = 0;
+        while (n < ctx->nio && (conn = LIST_FIRST(&ctx->dirty)) != NULL) {
+            LIST_REMOVE(conn, dirty_le);
+            conn->dirty = 0;
+
+            if (conn->send_active) {
+                continue;
+            }
+
+            io = &ctx->io[n++];
+            conn->batched = 1;
+
+            if (conn->err) {
+                io->conn = conn;
+                io->status = NC_ERROR;
+                continue;
+            }
+
+            io->status = NC_OK;
+            msg_send_prep(ctx, conn, io);
+            if (io->size != 0 && event_batch_writev(ctx->evb, conn, io->iov,
+                                                    io->niov, &io->res) < 0) {
+                io->status = NC_ERROR;
+            }
+        }
 
-        msg = msg_tmo_min();
-        if (msg == NULL) {
-            ctx->timeout = ctx->max_timeout;
-            return;
+        event_batch_run(ctx->evb);
+
+        for (i = 0; i < n; i++) {
+            io = &ctx->io[i];
+            conn = io->conn;
+
+            if (!conn->batched) {
+                /* closed while an earlier result was processed */
+                continue;
+            }
+            conn->batched = 0;
+
+            status = io->status;
+            if (status == NC_OK) {
+                status = msg_send_post(ctx, io);
+            }
+            if (status != NC_OK || conn->done || conn->err) {
+                core_close(ctx, conn);
+                continue;
+            }
+
+            if (!conn->send_ready) {
+                /* socket is full; write the rest on the write event */
+                status = event_add_out(ctx->evb, conn);
+                if (status != NC_OK) {
+                    conn->err = errno;
+                    core_close(ctx, conn);
+                }
+            } else if (io->msg != NULL) {
+                core_dirty(ctx, conn);
+            }
         }
+    }
+}
 
-        /* skip over req that are in-error or done */
+static void
+core_flush(struct context *ctx)
+{
+    struct conn *conn;
+    rstatus_t status;
 
-        if (msg->error || msg->done) {
-            msg_tmo_delete(msg);
+    if (ctx->nio != 0) {
+        core_flush_batch(ctx);
+        return;
+    }
+
+    while ((conn = LIST_FIRST(&ctx->dirty)) != NULL) {
+        LIST_REMOVE(conn, dirty_le);
+        conn->dirty = 0;
+
+        if (conn->send_active) {
             continue;
         }
 
-        /*
-         * timeout expired req and all the outstanding req on the timing
-         * out server
-         */
+        if (!conn->err) {
+            status = core_send(ctx, conn);
+        } else {
+            status = NC_ERROR;
+        }
+        if (status != NC_OK || conn->done || conn->err) {
+            core_close(ctx, conn);
+            continue;
+        }
 
-        conn = msg->tmo_rbe.data;
-        then = msg->tmo_rbe.key;
+        if (!conn->send_ready) {
+            /* socket is full; write the rest on the write event */
+            status = event_add_out(ctx->evb, conn);
+            if (status != NC_OK) {
+                conn->err = errno;
+                core_close(ctx, conn);
+            }
+        }
+    }
+}
 
-        now = nc_msec_now();
-        if (now < then) {
-            int delta = (int)(then - now);
-            ctx->timeout = MIN(delta, ctx->max_timeout);
-            return;
+/*
+ * Queue the read of readable conn for the next batch instead of reading
+ * it right away; see core_recv_batch()
+ */
+static void
+core_readable(struct context *ctx, struct conn *conn)
+{
+    if (conn->readable) {
+        return;
+    }
+
+    conn->readable = 1;
+    LIST_INSERT_HEAD(&ctx->readable, conn, ready_le);
+}
+
+/*
+ * Read the conns queued by core_readable() with one batch of recv per
+ * round. A read that filled its buffer leaves its conn ready and the conn
+ * goes into the next round, the way msg_recv() loops for as long as the
+ * socket is ready.
+ */
+static void
+core_recv_batch(struct context *ctx)
+{
+    struct msg_io *io;
+    struct conn *conn;
+    rstatus_t status;
+    uint32_t i, n;
+
+    while (!LIST_EMPTY(&ctx->readable)) {
+        n = 0;
+        while (n < ctx->nio && (conn = LIST_FIRST(&ctx->readable)) != NULL) {
+            LIST_REMOVE(conn, ready_le);
+            conn->readable = 0;
+
+            io = &ctx->io[n++];
+            conn->batched = 1;
+            conn->recv_ready = 1;
+
+            io->status = msg_recv_prep(ctx, conn, io);
+            if (io->status == NC_OK && io->size != 0 &&
+                event_batch_recv(ctx->evb, conn, io->mbuf->last, io->size,
+                                 &io->res) < 0) {
+                io->status = NC_ERROR;
+            }
         }
 
-        log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
+        event_batch_run(ctx->evb);
+
+        for (i = 0; i < n; i++) {
+            io = &ctx->io[i];
+            conn = io->conn;
+
+            if (!conn->batched) {
+                /* closed while an earlier result was processed */
+                continue;
+            }
+            conn->batched = 0;
+
+            status = io->status;
+            if (status == NC_OK && io->size != 0) {
+                status = msg_recv_post(ctx, io);
+            }
+            if (status != NC_OK || conn->done || conn->err) {
+                core_close(ctx, conn);
+                continue;
+            }
+
+            if (io->size != 0 && conn->recv_ready) {
+                core_readable(ctx, conn);
+            }
+        }
+    }
+}
 
-        msg_tmo_delete(msg);
-        conn->err = ETIMEDOUT;
-		
-#if 1 //shenzheng 2015-7-30 replace server
-		if(conn->replace_server)
-		{
-			conn_close_for_replace_server(conn, conn->err);
-		}
-		else
-		{
-#endif //shenzheng 2015-7-30 replace server
-        core_close(ctx, conn);
-#if 1 //shenzheng 2015-7-30 replace server
-		}	
-#endif //shenzheng 2015-7-30 replace server
+/*
+ * Return true if usage is over budget. Once over, usage has to fall
+ * below the low-water mark before it is under budget again, so that
+ * paused reads are not resumed and paused again on every few bytes.
+ */
+static bool
+core_mem_over(size_t used, size_t budget, bool throttled)
+{
+    if (budget == 0) {
+        return false;
+    }
+
+    if (throttled) {
+        return used >= budget / 100 * CORE_MEM_LOWAT;
+    }
+
+    return used >= budget;
+}
+
+static void
+core_mem_update(struct context *ctx)
+{
+    size_t used;
+    bool over;
+
+    used = mbuf_used() + msg_used();
+    over = core_mem_over(used, ctx->mem_budget, ctx->mem_throttled);
+
+    if (over && !ctx->mem_throttled) {
+        log_warn("memory used %zu over budget %zu, pausing client reads",
+                 used, ctx->mem_budget);
+        nc_atomic_incr(core_mem_nthrottle);
+    } else if (!over && ctx->mem_throttled) {
+        log_warn("memory used %zu under budget %zu, resuming client reads",
+                 used, ctx->mem_budget);
+    }
+
+    ctx->mem_throttled = over ? 1 : 0;
+}
+
+static void
+core_mem_update_pool(struct context *ctx, struct server_pool *pool)
+{
+    bool over;
+    size_t used = pool->mem_usage->nbytes;
+
+    over = core_mem_over(used, pool->mem_budget, pool->mem_throttled);
+
+    if (over && !pool->mem_throttled) {
+        log_warn("pool '%.*s' memory used %zu over budget %zu, pausing "
+                 "client reads", pool->name.len, pool->name.data,
+                 used, pool->mem_budget);
+        stats_pool_incr(ctx, pool, client_throttled);
+    } else if (!over && pool->mem_throttled) {
+        log_warn("pool '%.*s' memory used %zu under budget %zu, resuming "
+                 "client reads", pool->name.len, pool->name.data,
+                 used, pool->mem_budget);
+    }
+
+    pool->mem_throttled = over ? 1 : 0;
+}
+
+/*
+ * Return true if reads on client conn must be paused because the worker
+ * or the pool of the conn is over its memory budget. The conn is parked
+ * on the stalled list and read again by core_mem_resume(); it cannot
+ * wait for another read event, as those are edge triggered.
+ *
+ * Only conns with requests in flight are paused. Their responses free
+ * memory once they go out, whereas pausing a conn with nothing in
+ * flight, say one in the middle of a request larger than the budget,
+ * could wait forever.
+ */
+bool
+core_mem_throttle(struct context *ctx, struct conn *conn)
+{
+    struct server_pool *pool = conn->owner;
+
+    ASSERT(conn->client && !conn->proxy);
+
+    if (ctx->mem_budget == 0 && pool->mem_budget == 0) {
+        return false;
+    }
+
+    if (TAILQ_EMPTY(&conn->omsg_q)) {
+        return false;
+    }
+
+    core_mem_update(ctx);
+    core_mem_update_pool(ctx, pool);
+
+    if (!ctx->mem_throttled && !pool->mem_throttled) {
+        return false;
+    }
+
+    if (!conn->stalled) {
+        conn->stalled = 1;
+        LIST_INSERT_HEAD(&ctx->stalled, conn, stall_le);
+    }
+
+    return true;
+}
+
+size_t
+core_mem_used(void)
+{
+    return nc_atomic_get(core_mem_total);
+}
+
+uint64_t
+core_mem_nthrottled(void)
+{
+    return nc_atomic_get(core_mem_nthrottle);
+}
 
+static void
+core_mem_report(struct context *ctx)
+{
+    struct array *pools;
+    size_t used;
+    uint32_t i, n;
+
+    used = mbuf_used() + msg_used();
+    if (used > ctx->mem_reported) {
+        nc_atomic_add(core_mem_total, used - ctx->mem_reported);
+    } else if (used < ctx->mem_reported) {
+        nc_atomic_sub(core_mem_total, ctx->mem_reported - used);
+    }
+    ctx->mem_reported = used;
+
+    if (ctx->stats->pause) {
+        return;
+    }
+
+    pools = ctx->which_pool ? &ctx->pool_swap : &ctx->pool;
+    for (i = 0, n = array_n(pools); i < n; i++) {
+        struct server_pool *pool = array_get(pools, i);
+
+        used = pool->mem_usage->nbytes;
+        if (used > pool->mem_reported) {
+            stats_pool_incr_by(ctx, pool, mem_used,
+                               (int64_t)(used - pool->mem_reported));
+        } else if (used < pool->mem_reported) {
+            stats_pool_decr_by(ctx, pool, mem_used,
+                               (int64_t)(pool->mem_reported - used));
+        }
+        pool->mem_reported = used;
     }
 }
 
+/*
+ * Read again on the client conns paused by the memory budget. Conns
+ * whose worker or pool is still over budget are parked again.
+ */
+static void
+core_mem_resume(struct context *ctx)
+{
+    struct conn_lh stalled;
+    struct conn *conn;
+    rstatus_t status;
+
+    core_mem_report(ctx);
+
+    if (LIST_EMPTY(&ctx->stalled)) {
+        return;
+    }
+
+    core_mem_update(ctx);
+    if (ctx->mem_throttled) {
+        return;
+    }
+
+    LIST_INIT(&stalled);
+    LIST_SWAP(&stalled, &ctx->stalled, conn, stall_le);
+
+    while ((conn = LIST_FIRST(&stalled)) != NULL) {
+        LIST_REMOVE(conn, stall_le);
+        conn->stalled = 0;
+
+        status = core_recv(ctx, conn);
+        if (status != NC_OK || conn->done || conn->err) {
+            core_close(ctx, conn);
+        }
+    }
+
+    /* write out what the resumed reads forwarded */
+    core_flush(ctx);
+}
+
+static void
+core_timeout(struct context *ctx)
+{
+    timer_wheel_expire(ctx, &ctx->timer);
+    ctx->timeout = timer_wheel_timeout(&ctx->timer, ctx->max_timeout);
+}
+
 rstatus_t
 core_core(void *arg, uint32_t events)
 {
@@ -712,10 +1405,15 @@ core_core(void *arg, uint32_t events)
 
     /* read takes precedence over write */
     if (events & EVENT_READ) {
-        status = core_recv(ctx, conn);
-        if (status != NC_OK || conn->done || conn->err) {
-            core_close(ctx, conn);
-            return NC_ERROR;
+        if (ctx->nio != 0 && conn->ops->recv == msg_recv) {
+            /* read with the other client and server conns; see core_loop() */
+            core_readable(ctx, conn);
+        } else {
+            status = core_recv(ctx, conn);
+            if (status != NC_OK || conn->done || conn->err) {
+                core_close(ctx, conn);
+                return NC_ERROR;
+            }
         }
     }
 
@@ -735,13 +1433,27 @@ core_loop(struct context *ctx)
 {
     int nsd;
 
+    /* time moves on while we wait; read the clock again on first use */
+    timer_wheel_stale(&ctx->timer);
+
     nsd = event_wait(ctx->evb, ctx->timeout);
     if (nsd < 0) {
         return nsd;
     }
 
+    if (ctx->worker == 0 && nc_atomic_get(core_nfail) != 0) {
+        log_error("%"PRIu32" workers failed, stopping", core_nfail);
+        return NC_ERROR;
+    }
+
+    core_recv_batch(ctx);
+
     core_timeout(ctx);
 
+    core_flush(ctx);
+
+    core_mem_resume(ctx);
+
     stats_swap(ctx->stats);
 
 #if 0 //shenzheng 2015-5-11 config-reload
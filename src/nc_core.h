@@ -42,6 +42,9 @@
 
 #ifdef HAVE_EPOLL
 # define NC_HAVE_EPOLL 1
+# ifdef HAVE_IO_URING
+#  define NC_HAVE_IO_URING 1
+# endif
 #elif HAVE_KQUEUE
 # define NC_HAVE_KQUEUE 1
 #elif HAVE_EVENT_PORTS
@@ -115,6 +118,7 @@ struct event_base;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <netinet/in.h>
@@ -122,13 +126,14 @@ struct event_base;
 #include <nc_array.h>
 #include <nc_string.h>
 #include <nc_queue.h>
-#include <nc_rbtree.h>
+#include <nc_timer.h>
 #include <nc_log.h>
 #include <nc_util.h>
 #include <event/nc_event.h>
 #include <nc_stats.h>
 #include <nc_mbuf.h>
 #include <nc_message.h>
+#include <nc_cache.h>
 #include <nc_connection.h>
 #include <nc_server.h>
 
@@ -156,6 +161,23 @@ struct context {
     uint32_t           max_ncconn;  /* max # client connections */
     uint32_t           max_nsconn;  /* max # server connections */
 
+    uint32_t           worker;      /* worker index, 0 runs on the main thread */
+    uint32_t           nworker;     /* # workers */
+    struct array       workers;     /* pthread_t[] of the other workers */
+
+    struct timer_wheel timer;       /* request and retry timers */
+    struct timer       trim;        /* free list trim timer */
+    uint32_t           max_nfree;   /* max # objects per free list, 0 if unlimited */
+    struct conn_lh     dirty;       /* conns with output to flush */
+    struct conn_lh     stalled;     /* client conns with reads paused */
+    struct conn_lh     readable;    /* conns with a read queued */
+    struct msg_io      *io;         /* io[] - reads or writes of a batch */
+    uint32_t           nio;         /* # io, 0 if not batching */
+
+    size_t             mem_budget;      /* memory budget in bytes, 0 if unlimited */
+    size_t             mem_reported;    /* memory in use last reported */
+    unsigned           mem_throttled:1; /* client reads paused? */
+
 #if 1 //shenzheng 2015-4-27 proxy administer
 	struct proxy_adm   *padm;
 #endif //shenzheng 2015-4-27 proxy administer
@@ -190,6 +212,11 @@ struct instance {
     char            *stats_addr;                 /* stats monitoring addr */
     char            hostname[NC_MAXHOSTNAMELEN]; /* hostname */
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
+    char            *mbuf_arena;                 /* mbuf arena type */
+    size_t          mem_budget;                  /* memory budget in bytes */
+    uint32_t        max_nfree;                   /* max # objects per free list */
+    uint32_t        workers;                     /* # worker threads */
+    char            *event_backend;              /* event backend */
     pid_t           pid;                         /* process id */
     char            *pid_filename;               /* pid filename */
     unsigned        pidfile:1;                   /* pid file created? */
@@ -212,5 +239,10 @@ struct context *core_start(struct instance *nci);
 void core_stop(struct context *ctx);
 rstatus_t core_core(void *arg, uint32_t events);
 rstatus_t core_loop(struct context *ctx);
+void core_timeout_req(struct context *ctx, struct timer *timer);
+void core_dirty(struct context *ctx, struct conn *conn);
+bool core_mem_throttle(struct context *ctx, struct conn *conn);
+size_t core_mem_used(void);
+uint64_t core_mem_nthrottled(void);
 
 #endif
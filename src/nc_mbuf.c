@@ -17,11 +17,38 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <nc_core.h>
 
-static uint32_t nfree_mbufq;   /* # free mbuf */
-static struct mhdr free_mbufq; /* free mbuf q */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * An arena region is carved into buffers front to back. Buffers are
+ * never returned to the region; free mbufs are recycled through the
+ * free mbuf q like heap ones, and regions are unmapped on deinit.
+ */
+struct mbuf_region {
+    struct mbuf_region *next;  /* next region */
+    size_t             size;   /* region size */
+};
+
+static __thread uint32_t nfree_mbufq[MBUF_NCLASS_MAX];   /* # free mbuf */
+static __thread struct mhdr free_mbufq[MBUF_NCLASS_MAX]; /* free mbuf q */
+static __thread uint32_t nfree_mbuf;    /* # free mbuf of all classes */
+static __thread uint32_t nfree_mbuf_peak;/* max # free mbuf of all classes */
+static __thread uint32_t nfree_sliceq;  /* # free slice header */
+static __thread size_t nused_bytes;     /* # bytes of buffers in use */
+static __thread struct mhdr free_sliceq;/* free slice header q */
+
+static __thread struct mbuf_region *arena_region; /* regions, latest first */
+static __thread uint8_t *arena_pos;     /* next free byte in latest region */
+static __thread uint8_t *arena_end;     /* end of latest region */
+static __thread size_t arena_size;      /* # bytes of regions mapped */
+static __thread size_t arena_used;      /* # bytes of regions carved */
+static __thread bool arena_nohugetlb;   /* hugetlb mapping failed? */
 
 #if 1 //shenzheng 2015-5-13 proxy administer
 static uint32_t nfree_mbufq_proxy_adm;   /* # free mbuf for proxy administer */
@@ -31,9 +58,23 @@ static struct mhdr free_mbufq_proxy_adm; /* free mbuf q for proxy administer */
 static size_t mbuf_chunk_size; /* mbuf chunk size - header + data (const) */
 static size_t mbuf_offset;     /* mbuf offset in chunk (const) */
 
+static uint32_t mbuf_nclass;                     /* # size class (const) */
+static uint32_t mbuf_default_cid;                /* class of mbuf_chunk_size (const) */
+static size_t mbuf_class_size[MBUF_NCLASS_MAX];  /* chunk size per class (const) */
+
+static mbuf_arena_t mbuf_arena;      /* arena type (const) */
+static size_t mbuf_region_size;      /* arena region size (const) */
+
+static char *mbuf_arena_strings[] = {
+    "off",
+    "thp",
+    "hugetlb",
+    NULL
+};
+
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-static uint64_t ntotal_mbuf;
+static __thread uint64_t ntotal_mbuf;
 #endif
 #endif //shenzheng 2015-3-23 common
 
@@ -43,24 +84,121 @@ static uint64_t ntotal_mbuf_proxy_adm;
 #endif
 #endif //shenzheng 2015-7-9 proxy administer
 
+/*
+ * Map an arena region of size bytes, aligned to MBUF_ARENA_REGION so
+ * that the kernel can back it with huge pages
+ */
+static uint8_t *
+mbuf_region_map(size_t size)
+{
+    uint8_t *p, *start;
+    size_t head, tail;
+
+#ifdef MAP_HUGETLB
+    if (mbuf_arena == MBUF_ARENA_HUGETLB && !arena_nohugetlb) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            return p;
+        }
+
+        log_warn("mmap of %zu bytes of huge pages failed, using regular "
+                 "pages instead: %s", size, strerror(errno));
+        arena_nohugetlb = true;
+    }
+#endif
+
+    p = mmap(NULL, size + MBUF_ARENA_REGION, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        log_error("mmap of %zu bytes failed: %s", size, strerror(errno));
+        return NULL;
+    }
+
+    start = NC_ALIGN_PTR(p, MBUF_ARENA_REGION);
+    head = (size_t)(start - p);
+    tail = MBUF_ARENA_REGION - head;
+    if (head > 0) {
+        munmap(p, head);
+    }
+    if (tail > 0) {
+        munmap(start + size, tail);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, size, MADV_HUGEPAGE) < 0) {
+        log_debug(LOG_INFO, "madvise huge pages on %zu bytes failed, "
+                  "ignored: %s", size, strerror(errno));
+    }
+#endif
+
+    return start;
+}
+
+/*
+ * Carve a buffer of size bytes out of the arena of the calling thread,
+ * mapping a new region when the latest one is used up
+ */
+static uint8_t *
+mbuf_arena_alloc(size_t size)
+{
+    struct mbuf_region *region;
+    uint8_t *buf;
+
+    buf = NC_ALIGN_PTR(arena_pos, MBUF_ARENA_ALIGN);
+    if (arena_region == NULL || buf + size > arena_end) {
+        region = (struct mbuf_region *)mbuf_region_map(mbuf_region_size);
+        if (region == NULL) {
+            return NULL;
+        }
+        region->next = arena_region;
+        region->size = mbuf_region_size;
+        arena_region = region;
+
+        arena_pos = (uint8_t *)region + sizeof(*region);
+        arena_end = (uint8_t *)region + region->size;
+        arena_size += region->size;
+
+        log_debug(LOG_VERB, "map mbuf region %p size %zu arena size %zu",
+                  region, region->size, arena_size);
+
+        buf = NC_ALIGN_PTR(arena_pos, MBUF_ARENA_ALIGN);
+    }
+
+    ASSERT(buf + size <= arena_end);
+
+    arena_pos = buf + size;
+    arena_used += size;
+
+    return buf;
+}
+
 static struct mbuf *
-_mbuf_get(void)
+_mbuf_get(uint32_t cid)
 {
     struct mbuf *mbuf;
     uint8_t *buf;
 
-    if (!STAILQ_EMPTY(&free_mbufq)) {
-        ASSERT(nfree_mbufq > 0);
+    ASSERT(cid < mbuf_nclass);
+
+    if (!STAILQ_EMPTY(&free_mbufq[cid])) {
+        ASSERT(nfree_mbufq[cid] > 0);
 
-        mbuf = STAILQ_FIRST(&free_mbufq);
-        nfree_mbufq--;
-        STAILQ_REMOVE_HEAD(&free_mbufq, next);
+        mbuf = STAILQ_FIRST(&free_mbufq[cid]);
+        nfree_mbufq[cid]--;
+        nfree_mbuf--;
+        STAILQ_REMOVE_HEAD(&free_mbufq[cid], next);
 
         ASSERT(mbuf->magic == MBUF_MAGIC);
+        ASSERT(mbuf->cid == cid);
         goto done;
     }
 
-    buf = nc_alloc(mbuf_chunk_size);
+    if (mbuf_arena != MBUF_ARENA_OFF) {
+        buf = mbuf_arena_alloc(mbuf_class_size[cid]);
+    } else {
+        buf = nc_alloc(mbuf_class_size[cid]);
+    }
     if (buf == NULL) {
         return NULL;
     }
@@ -90,40 +228,90 @@ _mbuf_get(void)
      *                        mbuf->last (one byte past valid byte)
      *
      */
-    mbuf = (struct mbuf *)(buf + mbuf_offset);
+    mbuf = (struct mbuf *)(buf + mbuf_class_size[cid] - MBUF_HSIZE);
     mbuf->magic = MBUF_MAGIC;
+    mbuf->cid = cid;
 
 done:
     STAILQ_NEXT(mbuf, next) = NULL;
     return mbuf;
 }
 
+/*
+ * Get an mbuf of size class cid
+ */
 struct mbuf *
-mbuf_get(void)
+mbuf_get_class(uint32_t cid)
 {
     struct mbuf *mbuf;
     uint8_t *buf;
+    size_t offset;
 
-    mbuf = _mbuf_get();
+    mbuf = _mbuf_get(cid);
     if (mbuf == NULL) {
         return NULL;
     }
 
-    buf = (uint8_t *)mbuf - mbuf_offset;
+    offset = mbuf_class_size[cid] - MBUF_HSIZE;
+    buf = (uint8_t *)mbuf - offset;
     mbuf->start = buf;
-    mbuf->end = buf + mbuf_offset;
+    mbuf->end = buf + offset;
 
-    ASSERT(mbuf->end - mbuf->start == (int)mbuf_offset);
     ASSERT(mbuf->start < mbuf->end);
 
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
 
-    log_debug(LOG_VVERB, "get mbuf %p", mbuf);
+    mbuf->base = mbuf;
+    mbuf->refcnt = 1;
+    mbuf->charge = NULL;
+
+    nused_bytes += mbuf_class_size[cid];
+
+    log_debug(LOG_VVERB, "get mbuf %p class %"PRIu32"", mbuf, cid);
 
     return mbuf;
 }
 
+/*
+ * Get an mbuf of the default size class, as set by the mbuf chunk size
+ */
+struct mbuf *
+mbuf_get(void)
+{
+    return mbuf_get_class(mbuf_default_cid);
+}
+
+/*
+ * A slice is a header-only mbuf that points into the buffer of another
+ * (base) mbuf. Slice headers live outside of any buffer and are recycled
+ * through their own free q.
+ */
+static struct mbuf *
+mbuf_slice_get(void)
+{
+    struct mbuf *mbuf;
+
+    if (!STAILQ_EMPTY(&free_sliceq)) {
+        ASSERT(nfree_sliceq > 0);
+
+        mbuf = STAILQ_FIRST(&free_sliceq);
+        nfree_sliceq--;
+        STAILQ_REMOVE_HEAD(&free_sliceq, next);
+
+        ASSERT(mbuf->magic == MBUF_MAGIC);
+    } else {
+        mbuf = nc_alloc(sizeof(*mbuf));
+        if (mbuf == NULL) {
+            return NULL;
+        }
+        mbuf->magic = MBUF_MAGIC;
+    }
+
+    STAILQ_NEXT(mbuf, next) = NULL;
+    return mbuf;
+}
+
 static void
 mbuf_free(struct mbuf *mbuf)
 {
@@ -134,20 +322,101 @@ mbuf_free(struct mbuf *mbuf)
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
-    buf = (uint8_t *)mbuf - mbuf_offset;
+    buf = (uint8_t *)mbuf - (mbuf_class_size[mbuf->cid] - MBUF_HSIZE);
     nc_free(buf);
 }
 
 void
 mbuf_put(struct mbuf *mbuf)
 {
+    struct mbuf *base;
+
     log_debug(LOG_VVERB, "put mbuf %p len %d", mbuf, mbuf->last - mbuf->pos);
 
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
-    nfree_mbufq++;
-    STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
+    base = mbuf->base;
+    ASSERT(base->refcnt > 0);
+
+    if (mbuf != base) {
+        nfree_sliceq++;
+        STAILQ_INSERT_HEAD(&free_sliceq, mbuf, next);
+    }
+
+    if (--base->refcnt > 0) {
+        /* buffer is still referenced by a slice */
+        return;
+    }
+
+    ASSERT(nused_bytes >= mbuf_class_size[base->cid]);
+    nused_bytes -= mbuf_class_size[base->cid];
+
+    if (base->charge != NULL) {
+        ASSERT(base->charge->nbytes >= mbuf_class_size[base->cid]);
+        base->charge->nbytes -= mbuf_class_size[base->cid];
+        mbuf_usage_put(base->charge);
+        base->charge = NULL;
+    }
+
+    nfree_mbufq[base->cid]++;
+    STAILQ_INSERT_HEAD(&free_mbufq[base->cid], base, next);
+
+    if (++nfree_mbuf > nfree_mbuf_peak) {
+        nfree_mbuf_peak = nfree_mbuf;
+    }
+}
+
+/*
+ * Release up to nbatch mbufs and slice headers from each free q of the
+ * calling thread that holds more than nmax of them. Return the # mbufs
+ * and slice headers released.
+ */
+uint32_t
+mbuf_trim(uint32_t nmax, uint32_t nbatch)
+{
+    struct mbuf *mbuf;
+    uint32_t cid, n, ntrim;
+
+    ntrim = 0;
+
+    /* arena buffers cannot be released one by one */
+    for (cid = 0; mbuf_arena == MBUF_ARENA_OFF && cid < mbuf_nclass; cid++) {
+        for (n = 0; n < nbatch && nfree_mbufq[cid] > nmax; n++) {
+            mbuf = STAILQ_FIRST(&free_mbufq[cid]);
+            mbuf_remove(&free_mbufq[cid], mbuf);
+            mbuf_free(mbuf);
+            nfree_mbufq[cid]--;
+            nfree_mbuf--;
+
+#ifdef NC_DEBUG_LOG
+            ntotal_mbuf--;
+#endif
+        }
+        ntrim += n;
+    }
+
+    for (n = 0; n < nbatch && nfree_sliceq > nmax; n++) {
+        mbuf = STAILQ_FIRST(&free_sliceq);
+        mbuf_remove(&free_sliceq, mbuf);
+        nc_free(mbuf);
+        nfree_sliceq--;
+    }
+    ntrim += n;
+
+    return ntrim;
+}
+
+uint32_t
+mbuf_nfree_mbuf(void)
+{
+    return nfree_mbuf;
+}
+
+uint32_t
+mbuf_nfree_mbuf_peak(void)
+{
+    return nfree_mbuf_peak;
 }
 
 /*
@@ -296,11 +565,279 @@ mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg)
     return nbuf;
 }
 
+/*
+ * Return a usage with no bytes charged and a reference for its owner
+ */
+struct mbuf_usage *
+mbuf_usage_create(void)
+{
+    struct mbuf_usage *usage;
+
+    usage = nc_alloc(sizeof(*usage));
+    if (usage == NULL) {
+        return NULL;
+    }
+
+    usage->nbytes = 0;
+    usage->nref = 1;
+
+    return usage;
+}
+
+/*
+ * Drop a reference to usage, and release it with the last one. The owner
+ * may drop its reference on another thread than the one its buffers are
+ * recycled on, e.g. in a config reload.
+ */
+void
+mbuf_usage_put(struct mbuf_usage *usage)
+{
+    ASSERT(usage->nref > 0);
+
+    if (nc_atomic_decr(usage->nref) == 0) {
+        ASSERT(usage->nbytes == 0);
+        nc_free(usage);
+    }
+}
+
+/*
+ * Charge the buffer of mbuf to usage until the buffer is recycled
+ */
+void
+mbuf_charge(struct mbuf *mbuf, struct mbuf_usage *usage)
+{
+    struct mbuf *base = mbuf->base;
+
+    ASSERT(base->charge == NULL);
+
+    nc_atomic_incr(usage->nref);
+    base->charge = usage;
+    usage->nbytes += mbuf_class_size[base->cid];
+}
+
+/*
+ * Return the # bytes of buffers in use by the calling thread
+ */
+size_t
+mbuf_used(void)
+{
+    return nused_bytes;
+}
+
+/*
+ * Split mbuf h into h and t without copying, by handing the data from pos
+ * onwards to a new slice t that shares the buffer of h. The unused space
+ * at the tail of the buffer moves over to t, so that t can keep on
+ * receiving data, while h is left full and never written again. The
+ * buffer is recycled when both h and t have been put.
+ *
+ * Return new mbuf t, if the split was successful.
+ */
+struct mbuf *
+mbuf_slice(struct mhdr *h, uint8_t *pos)
+{
+    struct mbuf *mbuf, *nbuf;
+
+    ASSERT(!STAILQ_EMPTY(h));
+
+    mbuf = STAILQ_LAST(h, mbuf, next);
+    ASSERT(pos >= mbuf->pos && pos <= mbuf->last);
+
+    nbuf = mbuf_slice_get();
+    if (nbuf == NULL) {
+        return NULL;
+    }
+
+    nbuf->base = mbuf->base;
+    nbuf->base->refcnt++;
+
+    nbuf->start = pos;
+    nbuf->pos = pos;
+    nbuf->last = mbuf->last;
+    nbuf->end = mbuf->end;
+
+    mbuf->last = pos;
+    mbuf->end = pos;
+
+    log_debug(LOG_VVERB, "slice mbuf %p len %"PRIu32" into nbuf %p len "
+              "%"PRIu32" refcnt %"PRIu32"", mbuf, mbuf_length(mbuf), nbuf,
+              mbuf_length(nbuf), nbuf->base->refcnt);
+
+    return nbuf;
+}
+
+/*
+ * Return a slice that references n bytes at pos of mbuf without copying
+ * them. The slice is full, so nothing is ever appended through it into
+ * the shared buffer, which is recycled once all of its mbufs are put.
+ */
+struct mbuf *
+mbuf_ref(struct mbuf *mbuf, uint8_t *pos, size_t n)
+{
+    struct mbuf *nbuf;
+
+    ASSERT(pos >= mbuf->pos && pos + n <= mbuf->last);
+
+    nbuf = mbuf_slice_get();
+    if (nbuf == NULL) {
+        return NULL;
+    }
+
+    nbuf->base = mbuf->base;
+    nbuf->base->refcnt++;
+
+    nbuf->start = pos;
+    nbuf->pos = pos;
+    nbuf->last = pos + n;
+    nbuf->end = pos + n;
+
+    log_debug(LOG_VVERB, "ref %zu bytes of mbuf %p into nbuf %p refcnt "
+              "%"PRIu32"", n, mbuf, nbuf, nbuf->base->refcnt);
+
+    return nbuf;
+}
+
+/*
+ * Set up the mbuf size classes: powers of two from MBUF_MIN_SIZE up to
+ * MBUF_LARGE_SIZE, with the configured chunk size as a class of its own.
+ * The chunk size class is the default one; it bounds the largest token
+ * (key) a message can have, as repair always moves a token into an mbuf
+ * of this class.
+ */
+static void
+mbuf_class_init(size_t chunk_size)
+{
+    size_t size;
+
+    mbuf_nclass = 0;
+
+    for (size = MBUF_MIN_SIZE; size < chunk_size; size <<= 1) {
+        mbuf_class_size[mbuf_nclass++] = size;
+    }
+
+    mbuf_default_cid = mbuf_nclass;
+    mbuf_class_size[mbuf_nclass++] = chunk_size;
+
+    for (size = MBUF_MIN_SIZE; size <= MBUF_LARGE_SIZE; size <<= 1) {
+        if (size > chunk_size) {
+            mbuf_class_size[mbuf_nclass++] = size;
+        }
+    }
+
+    ASSERT(mbuf_nclass <= MBUF_NCLASS_MAX);
+}
+
+uint32_t
+mbuf_class_default(void)
+{
+    return mbuf_default_cid;
+}
+
+uint32_t
+mbuf_class_large(void)
+{
+    return mbuf_nclass - 1;
+}
+
+/*
+ * Return the size class for the next receive mbuf of a connection, given
+ * that its last read returned n bytes into an mbuf of class cid with size
+ * bytes of free space. A read that fills the mbuf means that more data is
+ * pending, so we grow straight back to at least the default class to
+ * avoid extra reads on large values. A read that would have fit twice in
+ * the next smaller class shrinks the class by one step.
+ */
+uint32_t
+mbuf_class_adapt(uint32_t cid, size_t size, size_t n)
+{
+    ASSERT(cid < mbuf_nclass);
+
+    if (n >= size) {
+        if (cid < mbuf_default_cid) {
+            return mbuf_default_cid;
+        }
+        return cid < mbuf_nclass - 1 ? cid + 1 : cid;
+    }
+
+    if (cid > 0 && 2 * n <= mbuf_class_size[cid - 1] - MBUF_HSIZE) {
+        return cid - 1;
+    }
+
+    return cid;
+}
+
+/*
+ * Initialize the free mbuf q of the calling thread. Every worker thread
+ * recycles mbufs through its own q, so the request path never contends
+ * on a shared list.
+ */
+void
+mbuf_thread_init(void)
+{
+    uint32_t cid;
+
+    for (cid = 0; cid < MBUF_NCLASS_MAX; cid++) {
+        nfree_mbufq[cid] = 0;
+        STAILQ_INIT(&free_mbufq[cid]);
+    }
+
+    nfree_mbuf = 0;
+    nfree_mbuf_peak = 0;
+
+    nfree_sliceq = 0;
+    STAILQ_INIT(&free_sliceq);
+
+    nused_bytes = 0;
+
+    arena_region = NULL;
+    arena_pos = NULL;
+    arena_end = NULL;
+    arena_size = 0;
+    arena_used = 0;
+    arena_nohugetlb = false;
+
+#ifdef NC_DEBUG_LOG
+    ntotal_mbuf = 0;
+#endif
+}
+
+int
+mbuf_arena_type(char *name)
+{
+    int i;
+
+    for (i = 0; mbuf_arena_strings[i] != NULL; i++) {
+        if (strcmp(name, mbuf_arena_strings[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Return the # bytes of arena regions mapped by the calling thread
+ */
+size_t
+mbuf_arena_size(void)
+{
+    return arena_size;
+}
+
+/*
+ * Return the # bytes of arena regions carved into buffers by the
+ * calling thread
+ */
+size_t
+mbuf_arena_used(void)
+{
+    return arena_used;
+}
+
 void
 mbuf_init(struct instance *nci)
 {
-    nfree_mbufq = 0;
-    STAILQ_INIT(&free_mbufq);
+    mbuf_thread_init();
 
 #if 1 //shenzheng 2015-5-13 proxy administer
 	nfree_mbufq_proxy_adm = 0;
@@ -310,11 +847,15 @@ mbuf_init(struct instance *nci)
     mbuf_chunk_size = nci->mbuf_chunk_size;
     mbuf_offset = mbuf_chunk_size - MBUF_HSIZE;
 
-#if 1 //shenzheng 2015-3-23 common
-#ifdef NC_DEBUG_LOG
-	ntotal_mbuf = 0;
-#endif
-#endif //shenzheng 2015-3-23 common
+    mbuf_class_init(mbuf_chunk_size);
+
+    mbuf_arena = (mbuf_arena_t)mbuf_arena_type(nci->mbuf_arena);
+    ASSERT(mbuf_arena >= MBUF_ARENA_OFF && mbuf_arena < MBUF_ARENA_SENTINEL);
+
+    /* a region holds at least one buffer of the largest class */
+    mbuf_region_size = NC_ALIGN(mbuf_class_size[mbuf_nclass - 1] +
+                                sizeof(struct mbuf_region) + MBUF_ARENA_ALIGN,
+                                (size_t)MBUF_ARENA_REGION);
 
 #if 1 //shenzheng 2015-7-9 proxy administer
 #ifdef NC_DEBUG_LOG
@@ -324,25 +865,67 @@ mbuf_init(struct instance *nci)
 
     log_debug(LOG_DEBUG, "mbuf hsize %d chunk size %zu offset %zu length %zu",
               MBUF_HSIZE, mbuf_chunk_size, mbuf_offset, mbuf_offset);
+    log_debug(LOG_DEBUG, "mbuf arena %s region size %zu", nci->mbuf_arena,
+              mbuf_region_size);
 }
 
+/*
+ * Release the free buffers and arena regions of the calling thread; the
+ * counterpart of mbuf_thread_init()
+ */
 void
-mbuf_deinit(void)
+mbuf_thread_deinit(void)
 {
-    while (!STAILQ_EMPTY(&free_mbufq)) {
-        struct mbuf *mbuf = STAILQ_FIRST(&free_mbufq);
-        mbuf_remove(&free_mbufq, mbuf);
-        mbuf_free(mbuf);
-        nfree_mbufq--;
-		
-#if 1 //shenzheng 2015-3-23 common
+    uint32_t cid;
+
+    for (cid = 0; cid < mbuf_nclass; cid++) {
+        while (!STAILQ_EMPTY(&free_mbufq[cid])) {
+            struct mbuf *mbuf = STAILQ_FIRST(&free_mbufq[cid]);
+            mbuf_remove(&free_mbufq[cid], mbuf);
+            if (mbuf_arena == MBUF_ARENA_OFF) {
+                mbuf_free(mbuf);
+            }
+            nfree_mbufq[cid]--;
+            nfree_mbuf--;
+
 #ifdef NC_DEBUG_LOG
-		ntotal_mbuf--;
+            ntotal_mbuf--;
 #endif
-#endif //shenzheng 2015-3-23 common
+        }
 
+        ASSERT(nfree_mbufq[cid] == 0);
     }
 
+    while (arena_region != NULL) {
+        struct mbuf_region *region = arena_region;
+
+        arena_region = region->next;
+        arena_size -= region->size;
+        munmap(region, region->size);
+    }
+    arena_pos = NULL;
+    arena_end = NULL;
+    arena_used = 0;
+    ASSERT(arena_size == 0);
+
+    while (!STAILQ_EMPTY(&free_sliceq)) {
+        struct mbuf *mbuf = STAILQ_FIRST(&free_sliceq);
+        mbuf_remove(&free_sliceq, mbuf);
+        nc_free(mbuf);
+        nfree_sliceq--;
+    }
+    ASSERT(nfree_sliceq == 0);
+
+#ifdef NC_DEBUG_LOG
+    ASSERT(ntotal_mbuf == 0);
+#endif
+}
+
+void
+mbuf_deinit(void)
+{
+    mbuf_thread_deinit();
+
 #if 1 //shenzheng 2015-5-13 proxy administer
 	while (!STAILQ_EMPTY(&free_mbufq_proxy_adm)) {
         struct mbuf *mbuf = STAILQ_FIRST(&free_mbufq_proxy_adm);
@@ -355,26 +938,10 @@ mbuf_deinit(void)
 #endif
 	}
 #endif //shenzheng 2015-5-13 proxy administer
-
-    ASSERT(nfree_mbufq == 0);
-	
-#if 1 //shenzheng 2015-3-23 common
-#ifdef NC_DEBUG_LOG
-	ASSERT(ntotal_mbuf == 0);
-#endif
-#endif //shenzheng 2015-3-23 common
-
 }
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-uint32_t
-mbuf_nfree_mbuf()
-{
-	return nfree_mbufq;
-}
-
-
 uint64_t
 mbuf_ntotal_mbuf()
 {
@@ -430,6 +997,7 @@ _mbuf_get_proxy_adm(void)
 
     mbuf = (struct mbuf *)(buf + mbuf_offset);
     mbuf->magic = MBUF_MAGIC;
+    mbuf->cid = mbuf_default_cid;
 
 done:
     STAILQ_NEXT(mbuf, next) = NULL;
@@ -457,6 +1025,10 @@ mbuf_get_proxy_adm(void)
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
 
+    mbuf->base = mbuf;
+    mbuf->refcnt = 1;
+    mbuf->charge = NULL;
+
     log_debug(LOG_VVERB, "get mbuf %p", mbuf);
 
     return mbuf;
@@ -29,16 +29,42 @@ struct mbuf {
     uint8_t            *last;   /* write marker */
     uint8_t            *start;  /* start of buffer (const) */
     uint8_t            *end;    /* end of buffer (const) */
+    struct mbuf        *base;   /* mbuf owning the buffer */
+    uint32_t           refcnt;  /* # mbufs sharing the buffer (base only) */
+    uint32_t           cid;     /* size class of the buffer (const) */
+    struct mbuf_usage  *charge; /* usage charged with the buffer (base only) */
 };
 
 STAILQ_HEAD(mhdr, mbuf);
 
+/*
+ * Bytes of buffers charged to an owner such as a pool. Charged buffers
+ * hold a reference each, so the usage outlives an owner that goes away,
+ * e.g. in a config reload, while its buffers are still referenced.
+ */
+struct mbuf_usage {
+    size_t             nbytes;  /* # bytes of buffers charged */
+    uint32_t           nref;    /* # references: owner and charged buffers */
+};
+
 #define MBUF_MAGIC      0xdeadbeef
 #define MBUF_MIN_SIZE   512
 #define MBUF_MAX_SIZE   16777216
 #define MBUF_SIZE       16384
+#define MBUF_LARGE_SIZE 65536
+#define MBUF_NCLASS_MAX 16
 #define MBUF_HSIZE      sizeof(struct mbuf)
 
+#define MBUF_ARENA_REGION   (2 * 1024 * 1024) /* arena region size (huge page) */
+#define MBUF_ARENA_ALIGN    64                /* alignment of arena buffers */
+
+typedef enum mbuf_arena {
+    MBUF_ARENA_OFF,         /* buffers come from the heap */
+    MBUF_ARENA_THP,         /* regions backed by transparent huge pages */
+    MBUF_ARENA_HUGETLB,     /* regions backed by reserved huge pages */
+    MBUF_ARENA_SENTINEL
+} mbuf_arena_t;
+
 static inline bool
 mbuf_empty(struct mbuf *mbuf)
 {
@@ -51,9 +77,19 @@ mbuf_full(struct mbuf *mbuf)
     return mbuf->last == mbuf->end ? true : false;
 }
 
+void mbuf_thread_init(void);
+void mbuf_thread_deinit(void);
 void mbuf_init(struct instance *nci);
 void mbuf_deinit(void);
 struct mbuf *mbuf_get(void);
+struct mbuf *mbuf_get_class(uint32_t cid);
+uint32_t mbuf_class_default(void);
+uint32_t mbuf_class_large(void);
+uint32_t mbuf_class_adapt(uint32_t cid, size_t size, size_t n);
+struct mbuf_usage *mbuf_usage_create(void);
+void mbuf_usage_put(struct mbuf_usage *usage);
+void mbuf_charge(struct mbuf *mbuf, struct mbuf_usage *usage);
+size_t mbuf_used(void);
 void mbuf_put(struct mbuf *mbuf);
 void mbuf_rewind(struct mbuf *mbuf);
 #if 1 //shenzheng 2015-4-16 common
@@ -66,10 +102,18 @@ void mbuf_insert(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_remove(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_copy(struct mbuf *mbuf, uint8_t *pos, size_t n);
 struct mbuf *mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg);
+struct mbuf *mbuf_slice(struct mhdr *h, uint8_t *pos);
+struct mbuf *mbuf_ref(struct mbuf *mbuf, uint8_t *pos, size_t n);
+
+uint32_t mbuf_trim(uint32_t nmax, uint32_t nbatch);
+int mbuf_arena_type(char *name);
+size_t mbuf_arena_size(void);
+size_t mbuf_arena_used(void);
+uint32_t mbuf_nfree_mbuf(void);
+uint32_t mbuf_nfree_mbuf_peak(void);
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-uint32_t mbuf_nfree_mbuf(void);
 uint64_t mbuf_ntotal_mbuf(void);
 #endif
 #endif //shenzheng 2015-3-23 common
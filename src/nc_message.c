@@ -24,12 +24,6 @@
 #include <nc_server.h>
 #include <proto/nc_proto.h>
 
-#if (IOV_MAX > 128)
-#define NC_IOV_MAX 128
-#else
-#define NC_IOV_MAX IOV_MAX
-#endif
-
 /*
  *            nc_message.[ch]
  *         message (struct msg)
@@ -109,12 +103,16 @@
  * server.
  */
 
-static uint64_t msg_id;          /* message id counter */
-static uint64_t frag_id;         /* fragment id counter */
-static uint32_t nfree_msgq;      /* # free msg q */
-static struct msg_tqh free_msgq; /* free msg q */
-static struct rbtree tmo_rbt;    /* timeout rbtree */
-static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+/*
+ * Message ids and free msg q are owned by the worker thread that runs
+ * the event loop; see msg_thread_init()
+ */
+static __thread uint64_t msg_id;          /* message id counter */
+static __thread uint64_t frag_id;         /* fragment id counter */
+static __thread uint32_t nfree_msgq;      /* # free msg q */
+static __thread uint32_t nfree_msgq_peak; /* max # free msg q */
+static __thread uint32_t nlive_msg;       /* # msg in use */
+static __thread struct msg_tqh free_msgq; /* free msg q */
 
 #if 1 //shenzheng 2015-5-13 proxy administer
 static uint64_t msg_id_proxy_adm;          /* message id counter for proxy administer */
@@ -124,14 +122,14 @@ static struct msg_tqh free_msgq_proxy_adm; /* free msg q for proxy administer */
 
 #if 1 //shenzheng 2015-3-26 for debug
 #ifdef NC_DEBUG_LOG
-static uint32_t nused_msgq;      /* # used msg q */
-static struct msg_tqh used_msgq; /* used msg q */
+static __thread uint32_t nused_msgq;      /* # used msg q */
+static __thread struct msg_tqh used_msgq; /* used msg q */
 #endif
 #endif //shenzheng 2015-3-26 for debug
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-static uint64_t ntotal_msg;
+static __thread uint64_t ntotal_msg;
 #endif
 #endif //shenzheng 2015-3-23 common
 
@@ -148,35 +146,14 @@ static struct string msg_type_strings[] = {
 };
 #undef DEFINE_ACTION
 
-static struct msg *
-msg_from_rbe(struct rbnode *node)
-{
-    struct msg *msg;
-    int offset;
-
-    offset = offsetof(struct msg, tmo_rbe);
-    msg = (struct msg *)((char *)node - offset);
-
-    return msg;
-}
-
-struct msg *
-msg_tmo_min(void)
-{
-    struct rbnode *node;
-
-    node = rbtree_min(&tmo_rbt);
-    if (node == NULL) {
-        return NULL;
-    }
-
-    return msg_from_rbe(node);
-}
-
+/*
+ * Arm the timeout of a request forwarded on server connection conn. The
+ * timer lives on the timer wheel of the worker that owns the connection
+ * and expires relative to the cached time of the current loop iteration.
+ */
 void
-msg_tmo_insert(struct msg *msg, struct conn *conn)
+msg_tmo_insert(struct context *ctx, struct msg *msg, struct conn *conn)
 {
-    struct rbnode *node;
     int timeout;
 
     ASSERT(msg->request);
@@ -187,32 +164,25 @@ msg_tmo_insert(struct msg *msg, struct conn *conn)
         return;
     }
 
-    node = &msg->tmo_rbe;
-    node->key = nc_msec_now() + timeout;
-    node->data = conn;
+    msg->tmo.data = conn;
+    timer_add(&ctx->timer, &msg->tmo, timer_wheel_now(&ctx->timer) + timeout);
 
-    rbtree_insert(&tmo_rbt, node);
-
-    log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo rbt with expiry of "
-              "%d msec", msg->id, timeout);
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into timer wheel with expiry "
+              "of %d msec", msg->id, timeout);
 }
 
 void
 msg_tmo_delete(struct msg *msg)
 {
-    struct rbnode *node;
-
-    node = &msg->tmo_rbe;
-
     /* already deleted */
 
-    if (node->data == NULL) {
+    if (!timer_armed(&msg->tmo)) {
         return;
     }
 
-    rbtree_delete(&tmo_rbt, node);
+    timer_del(&msg->tmo);
 
-    log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from timer wheel", msg->id);
 }
 
 static struct msg *
@@ -233,6 +203,7 @@ _msg_get(void)
     if (msg == NULL) {
         return NULL;
     }
+    msg->cold = NULL;
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
@@ -241,12 +212,14 @@ _msg_get(void)
 #endif //shenzheng 2015-3-23 common
 
 done:
+    nlive_msg++;
+
     /* c_tqe, s_tqe, and m_tqe are left uninitialized */
     msg->id = ++msg_id;
     msg->peer = NULL;
     msg->owner = NULL;
 
-    rbtree_node_init(&msg->tmo_rbe);
+    timer_init(&msg->tmo, core_timeout_req, NULL);
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
@@ -267,19 +240,12 @@ done:
 
     msg->type = MSG_UNKNOWN;
 
-    msg->keys = array_create(1, sizeof(struct keypos));
-    if (msg->keys == NULL) {
-        nc_free(msg);
-        return NULL;
-    }
+    array_set(&msg->keys, msg->kpos, sizeof(struct keypos), MSG_NKEYPOS);
 
     msg->vlen = 0;
     msg->end = NULL;
 
     msg->frag_owner = NULL;
-    msg->frag_seq = NULL;
-    msg->nfrag = 0;
-    msg->nfrag_done = 0;
     msg->frag_id = 0;
 
     msg->narg_start = NULL;
@@ -292,21 +258,21 @@ done:
     msg->err = 0;
     msg->error = 0;
     msg->ferror = 0;
+    msg->partial = 0;
     msg->request = 0;
     msg->quit = 0;
     msg->noreply = 0;
     msg->noforward = 0;
     msg->done = 0;
     msg->fdone = 0;
+    msg->stream = 0;
+    msg->held = 0;
     msg->swallow = 0;
+    msg->cache = 0;
+    msg->collapse = 0;
     msg->redis = 0;
 
-#if 1 //shenzheng 2014-9-4 replace server
-	msg->replace_server = 0;
-	msg->mser_idx = 0;
-	msg->server = NULL;
-	msg->conf_version_curr = -1;
-#endif //shenzheng 2015-7-27 replace server
+    msg->replace_server = 0;
 
 #if 1 //shenzheng 2015-3-26 for debug
 #ifdef NC_DEBUG_LOG
@@ -598,12 +564,121 @@ msg_content_cmp(struct msg * msg1, struct msg * msg2)
 
 #endif //shenzheng 2015-4-16 common
 
+/*
+ * Release all allocations of the arena in one step. Only a default sized
+ * block is kept for the next request, unless all is set.
+ */
+static void
+msg_arena_reset(struct msg_cold *cold, bool all)
+{
+    struct msg_arena *block;
+
+    while ((block = cold->arena) != NULL) {
+        if (!all && block->next == NULL && block->size == MSG_ARENA_SIZE) {
+            block->used = 0;
+            break;
+        }
+        cold->arena = block->next;
+        nc_free(block);
+    }
+}
+
+/*
+ * Allocate memory that lives as long as the request msg, e.g. the fan-out
+ * tables of a fragmented request. It is released when the msg is put.
+ */
+void *
+msg_arena_alloc(struct msg *msg, size_t size)
+{
+    struct msg_cold *cold;
+    struct msg_arena *block;
+    uint8_t *p;
+
+    cold = msg_cold(msg);
+    if (cold == NULL) {
+        return NULL;
+    }
+
+    size = NC_ALIGN(size, NC_ALIGNMENT);
+
+    block = cold->arena;
+    if (block == NULL || block->size - block->used < size) {
+        size_t bsize = MAX(size, MSG_ARENA_SIZE);
+
+        block = nc_alloc(sizeof(*block) + bsize);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = cold->arena;
+        block->size = bsize;
+        block->used = 0;
+        cold->arena = block;
+    }
+
+    p = (uint8_t *)(block + 1) + block->used;
+    block->used += size;
+
+    return p;
+}
+
+static void
+msg_cold_reset(struct msg_cold *cold)
+{
+    msg_arena_reset(cold, false);
+
+    cold->frag_seq = NULL;
+    cold->nfrag = 0;
+    cold->nfrag_done = 0;
+    cold->nstream = 0;
+    cold->frag_next = NULL;
+
+    cold->mser_idx = 0;
+    cold->conf_version_curr = -1;
+    cold->server = NULL;
+
+    cold->cache_epoch = 0;
+
+    cold->collapse_next = NULL;
+    cold->followers = NULL;
+    cold->collapse_hash = 0;
+}
+
+/*
+ * Return the cold state of a msg, allocating it on first use. Only
+ * fragmented requests, replace_server commands and reads that fill the
+ * hot key cache or are collapsed ever pay for it.
+ */
+struct msg_cold *
+msg_cold(struct msg *msg)
+{
+    struct msg_cold *cold;
+
+    if (msg->cold != NULL) {
+        return msg->cold;
+    }
+
+    cold = nc_alloc(sizeof(*cold));
+    if (cold == NULL) {
+        return NULL;
+    }
+    cold->arena = NULL;
+    msg_cold_reset(cold);
+
+    msg->cold = cold;
+
+    return cold;
+}
+
 static void
 msg_free(struct msg *msg)
 {
     ASSERT(STAILQ_EMPTY(&msg->mhdr));
 
     log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
+    if (msg->cold != NULL) {
+        msg_arena_reset(msg->cold, true);
+        nc_free(msg->cold);
+    }
     nc_free(msg);
 }
 
@@ -618,28 +693,26 @@ msg_put(struct msg *msg)
         mbuf_put(mbuf);
     }
 
-    if (msg->frag_seq) {
-        nc_free(msg->frag_seq);
-        msg->frag_seq = NULL;
-    }
+    msg->keys.nelem = 0; /* a hack here */
+    array_deinit(&msg->keys);
 
-    if (msg->keys) {
-        msg->keys->nelem = 0; /* a hack here */
-        array_destroy(msg->keys);
-        msg->keys = NULL;
+    if (msg->cold != NULL) {
+        if (msg->replace_server && msg->cold->server != NULL) {
+            server_close_for_replace_server(msg->cold->server);
+        }
+        msg_cold_reset(msg->cold);
     }
 
-#if 1 //shenzheng 2015-6-26 replace server
-	if (msg->replace_server && msg->server)
-	{
-		server_close_for_replace_server(msg->server);
-		msg->server = NULL;
-	}
-#endif //shenzheng 2015-6-26 replace server
+    ASSERT(nlive_msg > 0);
+    nlive_msg--;
 
     nfree_msgq++;
     TAILQ_INSERT_HEAD(&free_msgq, msg, m_tqe);
 
+    if (nfree_msgq > nfree_msgq_peak) {
+        nfree_msgq_peak = nfree_msgq;
+    }
+
 #if 1 //shenzheng 2015-3-26 for debug
 #ifdef NC_DEBUG_LOG
 	nused_msgq --;
@@ -675,38 +748,88 @@ msg_dump(struct msg *msg, int level)
 }
 
 void
-msg_init(void)
+msg_thread_init(void)
 {
-    log_debug(LOG_DEBUG, "msg size %d", sizeof(struct msg));
     msg_id = 0;
     frag_id = 0;
     nfree_msgq = 0;
+    nfree_msgq_peak = 0;
+    nlive_msg = 0;
     TAILQ_INIT(&free_msgq);
-    rbtree_init(&tmo_rbt, &tmo_rbs);
-	
-#if 1 //shenzheng 2015-3-23 common
+
 #ifdef NC_DEBUG_LOG
-	ntotal_msg = 0;
+    ntotal_msg = 0;
+    nused_msgq = 0;
+    TAILQ_INIT(&used_msgq);
 #endif
-#endif //shenzheng 2015-3-23 common
+}
+
+/*
+ * Release up to nbatch msgs from the free msg q of the calling thread
+ * while it holds more than nmax of them, least recently used first.
+ * Return the # msgs released.
+ */
+uint32_t
+msg_trim(uint32_t nmax, uint32_t nbatch)
+{
+    struct msg *msg;
+    uint32_t n;
+
+    for (n = 0; n < nbatch && nfree_msgq > nmax; n++) {
+        msg = TAILQ_LAST(&free_msgq, msg_tqh);
+        TAILQ_REMOVE(&free_msgq, msg, m_tqe);
+        msg_free(msg);
+        nfree_msgq--;
 
-#if 1 //shenzheng 2015-7-9 proxy administer
 #ifdef NC_DEBUG_LOG
-	ntotal_msg_proxy_adm = 0;
+        ntotal_msg--;
 #endif
-#endif //shenzheng 2015-7-9 proxy administer
+    }
 
-#if 1 //shenzheng 2015-3-26 for debug
+    return n;
+}
+
+uint32_t
+msg_nfree_msg(void)
+{
+    return nfree_msgq;
+}
+
+uint32_t
+msg_nfree_msg_peak(void)
+{
+    return nfree_msgq_peak;
+}
+
+/*
+ * Return the memory held by the msgs in use by the calling thread
+ */
+size_t
+msg_used(void)
+{
+    return nlive_msg * sizeof(struct msg);
+}
+
+void
+msg_init(void)
+{
+    log_debug(LOG_DEBUG, "msg size %d", sizeof(struct msg));
+    msg_thread_init();
+    redis_init();
+
+#if 1 //shenzheng 2015-7-9 proxy administer
 #ifdef NC_DEBUG_LOG
-	nused_msgq = 0;
-	TAILQ_INIT(&used_msgq);
+	ntotal_msg_proxy_adm = 0;
 #endif
-#endif //shenzheng 2015-3-26 for debug
-
+#endif //shenzheng 2015-7-9 proxy administer
 }
 
+/*
+ * Release the free msgs of the calling thread; the counterpart of
+ * msg_thread_init()
+ */
 void
-msg_deinit(void)
+msg_thread_deinit(void)
 {
     struct msg *msg, *nmsg;
 
@@ -715,28 +838,25 @@ msg_deinit(void)
         ASSERT(nfree_msgq > 0);
         nmsg = TAILQ_NEXT(msg, m_tqe);
         msg_free(msg);
-		
-#if 1 //shenzheng 2015-3-23 common
+
 #ifdef NC_DEBUG_LOG
-		ntotal_msg --;
+        ntotal_msg--;
 #endif
-#endif //shenzheng 2015-3-23 common
-
     }
     ASSERT(nfree_msgq == 0);
 
-#if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-	ASSERT(ntotal_msg == 0);
+    ASSERT(ntotal_msg == 0);
+    ASSERT(nused_msgq == 0);
 #endif
-#endif //shenzheng 2015-3-23 common
+}
 
-#if 1 //shenzheng 2015-3-26 for debug
-#ifdef NC_DEBUG_LOG
-	ASSERT(nused_msgq == 0);
-	//TAILQ_INIT(&used_msgq);
-#endif
-#endif //shenzheng 2015-3-26 for debug
+void
+msg_deinit(void)
+{
+    struct msg *msg, *nmsg;
+
+    msg_thread_deinit();
 
 #if 1 //shenzheng 2015-7-9 proxy administer
 	for (msg = TAILQ_FIRST(&free_msgq_proxy_adm); msg != NULL;
@@ -819,6 +939,32 @@ msg_append(struct msg *msg, uint8_t *pos, size_t n)
     return NC_OK;
 }
 
+/*
+ * Append the first n bytes of mbuf to msg. Longer runs are not copied:
+ * msg gets a slice of the buffer, which is kept alive until the slice
+ * is put after msg has been sent.
+ */
+rstatus_t
+msg_append_ref(struct msg *msg, struct mbuf *mbuf, size_t n)
+{
+    struct mbuf *nbuf;
+
+    ASSERT(n <= mbuf_length(mbuf));
+
+    if (n < MSG_REF_MIN) {
+        return msg_append(msg, mbuf->pos, n);
+    }
+
+    nbuf = mbuf_ref(mbuf, mbuf->pos, n);
+    if (nbuf == NULL) {
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&msg->mhdr, nbuf);
+
+    msg->mlen += (uint32_t)n;
+    return NC_OK;
+}
+
 /*
  * prepend small(small than a mbuf) content into msg
  */
@@ -874,6 +1020,34 @@ msg_gen_frag_id(void)
     return ++frag_id;
 }
 
+/*
+ * msg_recv only ever serves client and server connections, so the recv
+ * handlers are called directly rather than through conn->ops
+ */
+static struct msg *
+msg_recv_next(struct context *ctx, struct conn *conn, bool alloc)
+{
+    ASSERT(conn->ops->recv_next == (conn->client ? req_recv_next : rsp_recv_next));
+
+    if (conn->client) {
+        return req_recv_next(ctx, conn, alloc);
+    }
+    return rsp_recv_next(ctx, conn, alloc);
+}
+
+static void
+msg_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
+              struct msg *nmsg)
+{
+    ASSERT(conn->ops->recv_done == (conn->client ? req_recv_done : rsp_recv_done));
+
+    if (conn->client) {
+        req_recv_done(ctx, conn, msg, nmsg);
+    } else {
+        rsp_recv_done(ctx, conn, msg, nmsg);
+    }
+}
+
 static rstatus_t
 msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -883,7 +1057,7 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (msg->pos == mbuf->last) {
         /* no more data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        msg_recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
@@ -891,9 +1065,20 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
      * Input mbuf has un-parsed data. Split mbuf of the current message msg
      * into (mbuf, nbuf), where mbuf is the portion of the message that has
      * been parsed and nbuf is the portion of the message that is un-parsed.
-     * Parse nbuf as a new message nmsg in the next iteration.
+     * Parse nbuf as a new message nmsg in the next iteration. Both share
+     * the same buffer, so pipelined messages are not copied.
+     *
+     * The fragment handlers expect the command name of a message to be
+     * contiguous in its first mbuf, so nbuf is copied instead when it has
+     * less than MBUF_MIN_SIZE bytes left to grow into, unless the
+     * un-parsed data would not fit in a fresh mbuf of the default class.
      */
-    nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
+    if (mbuf->end - msg->pos >= MBUF_MIN_SIZE ||
+        (size_t)(mbuf->last - msg->pos) > mbuf_data_size()) {
+        nbuf = mbuf_slice(&msg->mhdr, msg->pos);
+    } else {
+        nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
+    }
     if (nbuf == NULL) {
         return NC_ENOMEM;
     }
@@ -910,7 +1095,7 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
     nmsg->mlen = mbuf_length(nbuf);
     msg->mlen -= nmsg->mlen;
 
-    conn->recv_done(ctx, conn, msg, nmsg);
+    msg_recv_done(ctx, conn, msg, nmsg);
 
     return NC_OK;
 }
@@ -937,7 +1122,7 @@ msg_parse(struct context *ctx, struct conn *conn, struct msg *msg)
 
     if (msg_empty(msg)) {
         /* no data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        msg_recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
@@ -965,29 +1150,94 @@ msg_parse(struct context *ctx, struct conn *conn, struct msg *msg)
     return conn->err != 0 ? NC_ERROR : status;
 }
 
-static rstatus_t
-msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+/*
+ * Charge a newly read mbuf to the pool of conn, for its memory budget.
+ * The pool is charged until the last slice of the mbuf is released.
+ */
+static void
+msg_charge(struct conn *conn, struct mbuf *mbuf)
+{
+    struct server_pool *pool;
+
+    if (conn->client) {
+        pool = conn->owner;
+    } else if (!conn->replace_server) {
+        pool = ((struct server *)conn->owner)->owner;
+    } else {
+        /* the server of a replaced conn may go away before its mbufs */
+        return;
+    }
+
+    mbuf_charge(mbuf, pool->mem_usage);
+}
+
+/*
+ * Start the reads of the idle client or server conn at the initial size
+ * class again, so that a conn that went idle after a burst of large
+ * messages does not read its next small one into a large buffer. A read
+ * that exactly filled its buffer also leaves conn with an empty msg to
+ * read into next, whose buffer is released. Return the # mbufs released.
+ */
+uint32_t
+msg_shrink(struct conn *conn)
+{
+    struct msg *msg = conn->rmsg;
+    struct mbuf *mbuf;
+    uint32_t n;
+
+    ASSERT(!conn->proxy);
+
+    conn->mbuf_cid = conn->client ? 0 : mbuf_class_default();
+
+    if (msg == NULL || !msg_empty(msg)) {
+        return 0;
+    }
+
+    for (n = 0; !STAILQ_EMPTY(&msg->mhdr); n++) {
+        mbuf = STAILQ_FIRST(&msg->mhdr);
+        mbuf_remove(&msg->mhdr, mbuf);
+        mbuf_put(mbuf);
+    }
+    msg->pos = NULL;
+
+    return n;
+}
+
+/*
+ * Return the mbuf of msg to read into next: its last one if that has room
+ * left, or else a new one of the size class of conn
+ */
+static struct mbuf *
+msg_recv_mbuf(struct conn *conn, struct msg *msg)
 {
-    rstatus_t status;
-    struct msg *nmsg;
     struct mbuf *mbuf;
-    size_t msize;
-    ssize_t n;
 
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (mbuf == NULL || mbuf_full(mbuf)) {
-        mbuf = mbuf_get();
+        mbuf = mbuf_get_class(conn->mbuf_cid);
         if (mbuf == NULL) {
-            return NC_ENOMEM;
+            return NULL;
         }
+        msg_charge(conn, mbuf);
         mbuf_insert(&msg->mhdr, mbuf);
         msg->pos = mbuf->pos;
     }
     ASSERT(mbuf->end - mbuf->last > 0);
 
-    msize = mbuf_size(mbuf);
+    return mbuf;
+}
+
+/*
+ * Parse what a read of at most msize bytes into mbuf of msg returned, as
+ * accounted for by conn_recv_done()
+ */
+static rstatus_t
+msg_recv_parse(struct context *ctx, struct conn *conn, struct msg *msg,
+               struct mbuf *mbuf, size_t msize, ssize_t n)
+{
+    rstatus_t status;
+    struct msg *nmsg;
 
-    n = conn_recv(conn, mbuf->last, msize);
     if (n < 0) {
         if (n == NC_EAGAIN) {
             return NC_OK;
@@ -995,6 +1245,8 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
         return NC_ERROR;
     }
 
+    conn->mbuf_cid = mbuf_class_adapt(conn->mbuf_cid, msize, (size_t)n);
+
     ASSERT((mbuf->last + n) <= mbuf->end);
     mbuf->last += n;
     msg->mlen += (uint32_t)n;
@@ -1006,7 +1258,7 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
         }
 
         /* get next message to parse */
-        nmsg = conn->recv_next(ctx, conn, false);
+        nmsg = msg_recv_next(ctx, conn, false);
         if (nmsg == NULL || nmsg == msg) {
             /* no more data to parse */
             break;
@@ -1018,6 +1270,25 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
     return NC_OK;
 }
 
+static rstatus_t
+msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct mbuf *mbuf;
+    size_t msize;
+    ssize_t n;
+
+    mbuf = msg_recv_mbuf(conn, msg);
+    if (mbuf == NULL) {
+        return NC_ENOMEM;
+    }
+
+    msize = mbuf_size(mbuf);
+
+    n = conn_recv(conn, mbuf->last, msize);
+
+    return msg_recv_parse(ctx, conn, msg, mbuf, msize, n);
+}
+
 rstatus_t
 msg_recv(struct context *ctx, struct conn *conn)
 {
@@ -1032,7 +1303,12 @@ msg_recv(struct context *ctx, struct conn *conn)
 
     conn->recv_ready = 1;
     do {
-        msg = conn->recv_next(ctx, conn, true);
+        if (conn->client && core_mem_throttle(ctx, conn)) {
+            /* over the memory budget; see core_mem_resume() */
+            return NC_OK;
+        }
+
+        msg = msg_recv_next(ctx, conn, true);
         if (msg == NULL) {
             return NC_OK;
         }
@@ -1046,24 +1322,75 @@ msg_recv(struct context *ctx, struct conn *conn)
     return NC_OK;
 }
 
-static rstatus_t
-msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+/*
+ * Prepare the read that msg_recv() would make next on conn, to run it as
+ * part of a batch (see core_recv_batch). The size of io is left 0 if conn
+ * has nothing to read into now, say because it is paused by the memory
+ * budget.
+ */
+rstatus_t
+msg_recv_prep(struct context *ctx, struct conn *conn, struct msg_io *io)
 {
-    struct msg_tqh send_msgq;            /* send msg q */
-    struct msg *nmsg;                    /* next msg */
-    struct mbuf *mbuf, *nbuf;            /* current and next mbuf */
-    size_t mlen;                         /* current mbuf data length */
-    struct iovec *ciov, iov[NC_IOV_MAX]; /* current iovec */
-    struct array sendv;                  /* send iovec */
-    size_t nsend, nsent;                 /* bytes to send; bytes sent */
-    size_t limit;                        /* bytes to send limit */
-    ssize_t n;                           /* bytes sent by sendv */
+    struct msg *msg;
+    struct mbuf *mbuf;
 
-    TAILQ_INIT(&send_msgq);
+    ASSERT(conn->recv_active && conn->recv_ready);
 
-    array_set(&sendv, iov, sizeof(iov[0]), NC_IOV_MAX);
+    io->conn = conn;
+    io->msg = NULL;
+    io->size = 0;
+
+    if (conn->client && core_mem_throttle(ctx, conn)) {
+        /* over the memory budget; see core_mem_resume() */
+        return NC_OK;
+    }
+
+    msg = msg_recv_next(ctx, conn, true);
+    if (msg == NULL) {
+        return NC_OK;
+    }
 
-    /* preprocess - build iovec */
+    mbuf = msg_recv_mbuf(conn, msg);
+    if (mbuf == NULL) {
+        return NC_ENOMEM;
+    }
+
+    io->msg = msg;
+    io->mbuf = mbuf;
+    io->size = mbuf_size(mbuf);
+
+    return NC_OK;
+}
+
+/*
+ * Parse what the read prepared by msg_recv_prep() returned
+ */
+rstatus_t
+msg_recv_post(struct context *ctx, struct msg_io *io)
+{
+    struct conn *conn = io->conn;
+    ssize_t n;
+
+    ASSERT(io->size != 0);
+
+    n = conn_recv_done(conn, io->res, io->size);
+
+    return msg_recv_parse(ctx, conn, io->msg, io->mbuf, io->size, n);
+}
+
+/*
+ * Build the iovec of the next write on conn from msg and the msgs that
+ * follow it, which are queued on send_msgq. Return the # bytes to write.
+ */
+static size_t
+msg_send_build(struct context *ctx, struct conn *conn, struct msg *msg,
+               struct msg_tqh *send_msgq, struct array *sendv)
+{
+    struct mbuf *mbuf, *nbuf;            /* current and next mbuf */
+    size_t mlen;                         /* current mbuf data length */
+    struct iovec *ciov;                  /* current iovec */
+    size_t nsend;                        /* bytes to send */
+    size_t limit;                        /* bytes to send limit */
 
     nsend = 0;
     /*
@@ -1076,10 +1403,10 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
     for (;;) {
         ASSERT(conn->smsg == msg);
 
-        TAILQ_INSERT_TAIL(&send_msgq, msg, m_tqe);
+        TAILQ_INSERT_TAIL(send_msgq, msg, m_tqe);
 
         for (mbuf = STAILQ_FIRST(&msg->mhdr);
-             mbuf != NULL && array_n(&sendv) < NC_IOV_MAX && nsend < limit;
+             mbuf != NULL && array_n(sendv) < NC_IOV_MAX && nsend < limit;
              mbuf = nbuf) {
             nbuf = STAILQ_NEXT(mbuf, next);
 
@@ -1093,46 +1420,48 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
                 mlen = limit - nsend;
             }
 
-            ciov = array_push(&sendv);
+            ciov = array_push(sendv);
             ciov->iov_base = mbuf->pos;
             ciov->iov_len = mlen;
 
             nsend += mlen;
         }
 
-        if (array_n(&sendv) >= NC_IOV_MAX || nsend >= limit) {
+        if (array_n(sendv) >= NC_IOV_MAX || nsend >= limit) {
             break;
         }
 
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             break;
         }
     }
 
-    /*
-     * (nsend == 0) is possible in redis multi-del
-     * see PR: https://github.com/twitter/twemproxy/pull/225
-     */
     conn->smsg = NULL;
-    if (!TAILQ_EMPTY(&send_msgq) && nsend != 0) {
-        n = conn_sendv(conn, &sendv, nsend);
-    } else {
-        n = 0;
-    }
 
-    nsent = n > 0 ? (size_t)n : 0;
+    return nsend;
+}
 
-    /* postprocess - process sent messages in send_msgq */
+/*
+ * Move the msgs on send_msgq past the nsent bytes that a write on conn
+ * took, and finalize the ones that were sent completely
+ */
+static void
+msg_send_sent(struct context *ctx, struct conn *conn,
+              struct msg_tqh *send_msgq, size_t nsent)
+{
+    struct msg *msg, *nmsg;              /* current and next msg */
+    struct mbuf *mbuf, *nbuf;            /* current and next mbuf */
+    size_t mlen;                         /* current mbuf data length */
 
-    for (msg = TAILQ_FIRST(&send_msgq); msg != NULL; msg = nmsg) {
+    for (msg = TAILQ_FIRST(send_msgq); msg != NULL; msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, m_tqe);
 
-        TAILQ_REMOVE(&send_msgq, msg, m_tqe);
+        TAILQ_REMOVE(send_msgq, msg, m_tqe);
 
         if (nsent == 0) {
             if (msg->mlen == 0) {
-                conn->send_done(ctx, conn, msg);
+                conn->ops->send_done(ctx, conn, msg);
             }
             continue;
         }
@@ -1162,11 +1491,39 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
         /* message has been sent completely, finalize it */
         if (mbuf == NULL) {
-            conn->send_done(ctx, conn, msg);
+            conn->ops->send_done(ctx, conn, msg);
         }
     }
 
-    ASSERT(TAILQ_EMPTY(&send_msgq));
+    ASSERT(TAILQ_EMPTY(send_msgq));
+}
+
+static rstatus_t
+msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct msg_tqh send_msgq;            /* send msg q */
+    struct iovec iov[NC_IOV_MAX];        /* iovec */
+    struct array sendv;                  /* send iovec */
+    size_t nsend;                        /* bytes to send */
+    ssize_t n;                           /* bytes sent by sendv */
+
+    TAILQ_INIT(&send_msgq);
+
+    array_set(&sendv, iov, sizeof(iov[0]), NC_IOV_MAX);
+
+    nsend = msg_send_build(ctx, conn, msg, &send_msgq, &sendv);
+
+    /*
+     * (nsend == 0) is possible in redis multi-del
+     * see PR: https://github.com/twitter/twemproxy/pull/225
+     */
+    if (!TAILQ_EMPTY(&send_msgq) && nsend != 0) {
+        n = conn_sendv(conn, &sendv, nsend);
+    } else {
+        n = 0;
+    }
+
+    msg_send_sent(ctx, conn, &send_msgq, n > 0 ? (size_t)n : 0);
 
     if (n >= 0) {
         return NC_OK;
@@ -1185,11 +1542,11 @@ msg_send(struct context *ctx, struct conn *conn)
 	log_debug(LOG_DEBUG, "msg_send %s(%d)", conn->proxy?"p":(conn->client?"c":"s"), conn->sd);
 #endif //shenzheng 2015-7-28 for debug
 
-    ASSERT(conn->send_active);
+    /* write event need not be armed yet; see core_dirty() */
 
     conn->send_ready = 1;
     do {
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             /* nothing to send */
 
@@ -1207,6 +1564,67 @@ msg_send(struct context *ctx, struct conn *conn)
     return NC_OK;
 }
 
+/*
+ * Prepare the write that msg_send() would make next on conn, to run it as
+ * part of a batch (see core_flush_batch). The msg of io is left NULL if
+ * conn has nothing to send, and its size is 0 if there are only empty
+ * msgs to finalize.
+ */
+void
+msg_send_prep(struct context *ctx, struct conn *conn, struct msg_io *io)
+{
+    struct msg *msg;
+    struct array sendv;
+
+    io->conn = conn;
+    io->msg = NULL;
+    io->size = 0;
+    io->niov = 0;
+    TAILQ_INIT(&io->send_msgq);
+
+    conn->send_ready = 1;
+
+    msg = conn->ops->send_next(ctx, conn);
+    if (msg == NULL) {
+        /* nothing to send */
+        return;
+    }
+
+    array_set(&sendv, io->iov, sizeof(io->iov[0]), NC_IOV_MAX);
+
+    io->msg = msg;
+    io->size = msg_send_build(ctx, conn, msg, &io->send_msgq, &sendv);
+    io->niov = (int)array_n(&sendv);
+}
+
+/*
+ * Finalize the msgs sent by the write prepared by msg_send_prep()
+ */
+rstatus_t
+msg_send_post(struct context *ctx, struct msg_io *io)
+{
+    struct conn *conn = io->conn;
+    ssize_t n;
+
+    if (io->msg == NULL) {
+        return NC_OK;
+    }
+
+    if (io->size != 0) {
+        n = conn_sendv_done(conn, io->res, io->size);
+    } else {
+        n = 0;
+    }
+
+    msg_send_sent(ctx, conn, &io->send_msgq, n > 0 ? (size_t)n : 0);
+
+    if (n >= 0) {
+        return NC_OK;
+    }
+
+    return (n == NC_EAGAIN) ? NC_OK : NC_ERROR;
+}
+
 #if 1 //shenzheng 2015-2-3 common
 void _msg_print(const char *file, int line, struct msg *msg, bool real, int level)
 {
@@ -1267,7 +1685,7 @@ void _msg_print(const char *file, int line, struct msg *msg, bool real, int leve
 	}
 
 	uint32_t array_len;
-	array_len = array_n(msg->keys);
+	array_len = array_n(&msg->keys);
 	if(array_len > 0)
 	{
 		struct keypos *kpos_msg;
@@ -1275,14 +1693,14 @@ void _msg_print(const char *file, int line, struct msg *msg, bool real, int leve
 		uint32_t i;
 		for(i = 0; i < array_len; i ++)
 		{
-			kpos_msg = array_get(msg->keys, i);
+			kpos_msg = array_get(&msg->keys, i);
 			klen_msg = kpos_msg->end - kpos_msg->start;
 			_log(file, line, 0, "keys[%d](len:%lld) : %.*s", i, klen_msg, klen_msg, kpos_msg->start);
 		}
 	}
 	else
 	{
-		_log(file, line, 0, "array_n(msg->keys) is %d", array_len);
+		_log(file, line, 0, "array_n(&msg->keys) is %d", array_len);
 	}
 
 	
@@ -1383,12 +1801,6 @@ void _msg_print(const char *file, int line, struct msg *msg, bool real, int leve
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-uint32_t
-msg_nfree_msg()
-{
-	return nfree_msgq;
-}
-
 uint64_t
 msg_ntotal_msg()
 {
@@ -1485,6 +1897,7 @@ _msg_get_proxy_adm(void)
     if (msg == NULL) {
         return NULL;
     }
+    msg->cold = NULL;
 	
 #ifdef NC_DEBUG_LOG
 	ntotal_msg_proxy_adm ++;
@@ -1496,7 +1909,7 @@ done:
     msg->peer = NULL;
     msg->owner = NULL;
 
-    rbtree_node_init(&msg->tmo_rbe);
+    timer_init(&msg->tmo, core_timeout_req, NULL);
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
@@ -1517,19 +1930,12 @@ done:
 
     msg->type = MSG_UNKNOWN;
 
-    msg->keys = array_create(1, sizeof(struct keypos));
-    if (msg->keys == NULL) {
-        nc_free(msg);
-        return NULL;
-    }	
+    array_set(&msg->keys, msg->kpos, sizeof(struct keypos), MSG_NKEYPOS);
 
     msg->vlen = 0;
     msg->end = NULL;
 
     msg->frag_owner = NULL;
-    msg->frag_seq = NULL;
-    msg->nfrag = 0;
-    msg->nfrag_done = 0;
     msg->frag_id = 0;
 
     msg->narg_start = NULL;
@@ -1542,13 +1948,18 @@ done:
     msg->err = 0;
     msg->error = 0;
     msg->ferror = 0;
+    msg->partial = 0;
     msg->request = 0;
     msg->quit = 0;
     msg->noreply = 0;
     msg->noforward = 0;
     msg->done = 0;
     msg->fdone = 0;
+    msg->stream = 0;
+    msg->held = 0;
     msg->swallow = 0;
+    msg->cache = 0;
+    msg->collapse = 0;
     msg->redis = 0;
 
     return msg;
@@ -1595,16 +2006,12 @@ msg_put_proxy_adm(struct msg *msg)
         mbuf_put_proxy_adm(mbuf);
     }
 
-    if (msg->frag_seq) {
-        nc_free(msg->frag_seq);
-        msg->frag_seq = NULL;
+    if (msg->cold != NULL) {
+        msg_cold_reset(msg->cold);
     }
 
-    if (msg->keys) {
-        msg->keys->nelem = 0; /* a hack here */
-        array_destroy(msg->keys);
-        msg->keys = NULL;
-    }
+    msg->keys.nelem = 0; /* a hack here */
+    array_deinit(&msg->keys);
 
     nfree_msgq_proxy_adm ++;
     TAILQ_INSERT_HEAD(&free_msgq_proxy_adm, msg, m_tqe);
@@ -1730,7 +2137,7 @@ msg_parsed_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg)
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (msg->pos == mbuf->last) {
         /* no more data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
@@ -1757,7 +2164,7 @@ msg_parsed_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg)
     nmsg->mlen = mbuf_length(nbuf);
     msg->mlen -= nmsg->mlen;
 
-    conn->recv_done(ctx, conn, msg, nmsg);
+    conn->ops->recv_done(ctx, conn, msg, nmsg);
 
     return NC_OK;
 }
@@ -1784,7 +2191,7 @@ msg_parse_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg)
 
     if (msg_empty(msg)) {
         /* no data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
@@ -1853,7 +2260,7 @@ msg_recv_chain_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg
         }
 
         /* get next message to parse */
-        nmsg = conn->recv_next(ctx, conn, false);
+        nmsg = conn->ops->recv_next(ctx, conn, false);
         if (nmsg == NULL || nmsg == msg) {
             /* no more data to parse */
             break;
@@ -1875,7 +2282,7 @@ msg_recv_proxy_adm(struct context *ctx, struct conn *conn)
 
     conn->recv_ready = 1;
     do {
-        msg = conn->recv_next(ctx, conn, true);
+        msg = conn->ops->recv_next(ctx, conn, true);
         if (msg == NULL) {
             return NC_OK;
         }
@@ -1899,7 +2306,7 @@ msg_send_proxy_adm(struct context *ctx, struct conn *conn)
 
     conn->send_ready = 1;
     do {
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             /* nothing to send */
 
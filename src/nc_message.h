@@ -36,7 +36,7 @@
 
 typedef void (*msg_parse_t)(struct msg *);
 typedef rstatus_t (*msg_add_auth_t)(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
-typedef rstatus_t (*msg_fragment_t)(struct msg *, uint32_t, struct msg_tqh *);
+typedef rstatus_t (*msg_fragment_t)(struct msg *, uint32_t, uint32_t, struct msg_tqh *);
 typedef void (*msg_coalesce_t)(struct msg *r);
 typedef rstatus_t (*msg_reply_t)(struct msg *r);
 
@@ -81,8 +81,10 @@ typedef enum msg_parse_result {
     ACTION( REQ_REDIS_PERSIST )                                                /*30*/                     \
     ACTION( REQ_REDIS_PTTL )                                                                        \
     ACTION( REQ_REDIS_SORT )                                                                        \
+    ACTION( REQ_REDIS_TOUCH )                                                                       \
     ACTION( REQ_REDIS_TTL )                                                                         \
     ACTION( REQ_REDIS_TYPE )                                                                        \
+    ACTION( REQ_REDIS_UNLINK )                                                                      \
     ACTION( REQ_REDIS_APPEND )                 /* redis requests - string */                        \
     ACTION( REQ_REDIS_BITCOUNT )                                                                    \
     ACTION( REQ_REDIS_DECR )                                                                        \
@@ -209,47 +211,108 @@ struct keypos {
     uint8_t             *end;             /* key end pos */
 };
 
+/*
+ * Key positions kept inline in a msg; requests with more keys move them
+ * to the heap
+ */
+#define MSG_NKEYPOS 2
+
+/*
+ * Data moved between messages is referenced rather than copied from this
+ * many bytes on; a slice and an iovec cost more than copying less
+ */
+#define MSG_REF_MIN 256
+
+/* # key slots of the in-flight reads of a pool that others collapse into */
+#define MSG_COLLAPSE_NSLOT 1024
+
+/*
+ * The head of a fan-out response is sent ahead of its pending fragments
+ * once this many bytes of it are ready; smaller heads wait to save writes
+ */
+#define MSG_STREAM_MIN 4096
+
+/*
+ * Block of a request scoped arena. A msg keeps one block of the default
+ * size across reuse; larger or extra blocks are freed with the request.
+ */
+#define MSG_ARENA_SIZE 2048
+
+struct msg_arena {
+    struct msg_arena     *next;           /* next (older) block */
+    size_t               size;            /* # usable bytes */
+    size_t               used;            /* # used bytes */
+};
+
+/*
+ * Per msg state that only fragmented requests and the replace_server
+ * command need. It is allocated on first use by msg_cold() and stays
+ * with the msg across reuse from the free q.
+ */
+struct msg_cold {
+    struct msg_arena     *arena;          /* request scoped allocations */
+
+    struct msg           **frag_seq;      /* sequence of fragment message, map from keys to fragments*/
+    uint32_t             nfrag;           /* # fragment */
+    uint32_t             nfrag_done;      /* # fragment done */
+    uint32_t             nstream;         /* # leading keys coalesced into the response */
+    struct msg           *frag_next;      /* next fragment to the same server, held until this one is done */
+
+    uint32_t             mser_idx;        /* replace server index of pool->server */
+    long long            conf_version_curr; /* conf version when replace server was examined */
+    struct server        *server;         /* new server in the replace server command */
+
+    uint32_t             cache_epoch;     /* hot key cache epoch of the key when received */
+
+    struct msg           *collapse_next;  /* next in-flight read in key slot, or next collapsed read */
+    struct msg           *followers;      /* reads collapsed into this one */
+    uint32_t             collapse_hash;   /* key hash of the in-flight read */
+};
+
+/*
+ * Fields are ordered by how often they are touched: queue links, the
+ * parser state and the flags of every request and response come first,
+ * so that a plain get or set stays within the leading cache lines.
+ */
 struct msg {
     TAILQ_ENTRY(msg)     c_tqe;           /* link in client q */
     TAILQ_ENTRY(msg)     s_tqe;           /* link in server q */
     TAILQ_ENTRY(msg)     m_tqe;           /* link in send q / free q */
-#if 1 //shenzheng 2015-3-26 for debug
-#ifdef NC_DEBUG_LOG
-	TAILQ_ENTRY(msg)     u_tqe;           /* link in used q */
-#endif
-#endif //shenzheng 2015-3-26 for debug
-
 
     uint64_t             id;              /* message id */
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
 
-    struct rbnode        tmo_rbe;         /* entry in rbtree */
-
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
-    int64_t              start_ts;        /* request start timestamp in usec */
-
     int                  state;           /* current parser state */
     uint8_t              *pos;            /* parser position marker */
     uint8_t              *token;          /* token marker */
 
     msg_parse_t          parser;          /* message parser */
     msg_parse_result_t   result;          /* message parsing result */
-
-    msg_fragment_t       fragment;        /* message fragment */
-    msg_reply_t          reply;           /* gen message reply (example: ping) */
-    msg_add_auth_t       add_auth;        /* add auth message when we forward msg */
-
-    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
-    msg_coalesce_t       post_coalesce;   /* message post-coalesce */
-
     msg_type_t           type;            /* message type */
 
-    struct array         *keys;           /* array of keypos, for req */
+    err_t                err;             /* errno on error? */
+    unsigned             error:1;         /* error? */
+    unsigned             ferror:1;        /* one or more fragments are in error? */
+    unsigned             request:1;       /* request? or response? */
+    unsigned             quit:1;          /* quit request? */
+    unsigned             noreply:1;       /* noreply? */
+    unsigned             noforward:1;     /* not need forward (example: ping) */
+    unsigned             done:1;          /* done? */
+    unsigned             fdone:1;         /* all fragments are done? */
+    unsigned             stream:1;        /* response sent before all fragments are done? */
+    unsigned             held:1;          /* fragment not forwarded yet? */
+    unsigned             partial:1;       /* failed fragments coalesced as misses? */
+    unsigned             swallow:1;       /* swallow response? */
+    unsigned             cache:1;         /* response fills the hot key cache? */
+    unsigned             collapse:1;      /* identical reads collapse into this one? */
+    unsigned             redis:1;         /* redis? */
+    unsigned             replace_server:1;/* replace_server command? */
 
-    uint32_t             vlen;            /* value length (memcache) */
-    uint8_t              *end;            /* end marker (memcache) */
+    struct array         keys;            /* array of keypos, for req */
+    struct keypos        kpos[MSG_NKEYPOS]; /* inline storage of keys */
 
     uint8_t              *narg_start;     /* narg start (redis) */
     uint8_t              *narg_end;       /* narg end (redis) */
@@ -259,43 +322,69 @@ struct msg {
     uint32_t             integer;         /* integer reply value (redis) */
 
     struct msg           *frag_owner;     /* owner of fragment message */
-    uint32_t             nfrag;           /* # fragment */
-    uint32_t             nfrag_done;      /* # fragment done */
     uint64_t             frag_id;         /* id of fragmented message */
-    struct msg           **frag_seq;      /* sequence of fragment message, map from keys to fragments*/
 
-    err_t                err;             /* errno on error? */
-    unsigned             error:1;         /* error? */
-    unsigned             ferror:1;        /* one or more fragments are in error? */
-    unsigned             request:1;       /* request? or response? */
-    unsigned             quit:1;          /* quit request? */
-    unsigned             noreply:1;       /* noreply? */
-    unsigned             noforward:1;     /* not need forward (example: ping) */
-    unsigned             done:1;          /* done? */
-    unsigned             fdone:1;         /* all fragments are done? */
-    unsigned             swallow:1;       /* swallow response? */
-    unsigned             redis:1;         /* redis? */
+    msg_fragment_t       fragment;        /* message fragment */
+    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
+    msg_coalesce_t       post_coalesce;   /* message post-coalesce */
+    msg_reply_t          reply;           /* gen message reply (example: ping) */
+    msg_add_auth_t       add_auth;        /* add auth message when we forward msg */
+
+    struct timer         tmo;             /* request timeout */
+    int64_t              start_ts;        /* request start timestamp in usec */
+
+    uint32_t             vlen;            /* value length (memcache) */
+    uint8_t              *end;            /* end marker (memcache) */
 
-#if 1 //shenzheng 2014-9-2 replace server
-	unsigned			 replace_server:1;/* 1:this msg is for replace_server command, 0:other msgs */
-	long long			 conf_version_curr;
-	uint32_t			 mser_idx;		  /* replace server index of pool->server */
-	struct server        *server;		  /* new server in the replace server command */
-#endif //shenzheng 2015-7-27 replace server
+    struct msg_cold      *cold;           /* rarely used state, or NULL */
 
+#ifdef NC_DEBUG_LOG
+    TAILQ_ENTRY(msg)     u_tqe;           /* link in used q */
+#endif
 };
 
 TAILQ_HEAD(msg_tqh, msg);
 
-struct msg *msg_tmo_min(void);
-void msg_tmo_insert(struct msg *msg, struct conn *conn);
+/* IOV_MAX needs _GNU_SOURCE, which the subdirectories of src do not set */
+#if defined(IOV_MAX) && (IOV_MAX < 128)
+#define NC_IOV_MAX IOV_MAX
+#else
+#define NC_IOV_MAX 128
+#endif
+
+/*
+ * A read or write on a conn that runs as part of a batch (see
+ * event_batch_run), from its preparation until its result is processed
+ */
+struct msg_io {
+    struct conn          *conn;           /* connection */
+    rstatus_t            status;          /* status of the preparation */
+    ssize_t              res;             /* result, # bytes or -errno */
+    size_t               size;            /* # bytes to read or write */
+    struct msg           *msg;            /* msg read into or first msg sent */
+    struct mbuf          *mbuf;           /* mbuf read into */
+    struct msg_tqh       send_msgq;       /* msgs sent */
+    struct iovec         iov[NC_IOV_MAX]; /* iovec sent */
+    int                  niov;            /* # iov */
+};
+
+void msg_tmo_insert(struct context *ctx, struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
 
+void msg_thread_init(void);
+void msg_thread_deinit(void);
+size_t msg_used(void);
+uint32_t msg_trim(uint32_t nmax, uint32_t nbatch);
+uint32_t msg_shrink(struct conn *conn);
+uint32_t msg_nfree_msg(void);
+uint32_t msg_nfree_msg_peak(void);
 void msg_init(void);
 void msg_deinit(void);
 struct string *msg_type_string(msg_type_t type);
 struct msg *msg_get(struct conn *conn, bool request, bool redis);
 void msg_put(struct msg *msg);
+struct msg_cold *msg_cold(struct msg *msg);
+void *msg_arena_alloc(struct msg *msg, size_t size);
 struct msg *msg_get_error(bool redis, err_t err);
 #if 1 //shenzheng 2014-9-4 common
 struct msg *msg_get_error_other(bool redis, err_t err);
@@ -306,10 +395,15 @@ void msg_dump(struct msg *msg, int level);
 bool msg_empty(struct msg *msg);
 rstatus_t msg_recv(struct context *ctx, struct conn *conn);
 rstatus_t msg_send(struct context *ctx, struct conn *conn);
+rstatus_t msg_recv_prep(struct context *ctx, struct conn *conn, struct msg_io *io);
+rstatus_t msg_recv_post(struct context *ctx, struct msg_io *io);
+void msg_send_prep(struct context *ctx, struct conn *conn, struct msg_io *io);
+rstatus_t msg_send_post(struct context *ctx, struct msg_io *io);
 uint64_t msg_gen_frag_id(void);
 uint32_t msg_backend_idx(struct msg *msg, uint8_t *key, uint32_t keylen);
 struct mbuf *msg_ensure_mbuf(struct msg *msg, size_t len);
 rstatus_t msg_append(struct msg *msg, uint8_t *pos, size_t n);
+rstatus_t msg_append_ref(struct msg *msg, struct mbuf *mbuf, size_t n);
 rstatus_t msg_prepend(struct msg *msg, uint8_t *pos, size_t n);
 rstatus_t msg_prepend_format(struct msg *msg, const char *fmt, ...);
 
@@ -317,6 +411,7 @@ struct msg *req_get(struct conn *conn);
 void req_put(struct msg *msg);
 bool req_done(struct conn *conn, struct msg *msg);
 bool req_error(struct conn *conn, struct msg *msg);
+bool req_stream(struct conn *conn, struct msg *msg);
 void req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg);
 void req_server_dequeue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg);
 void req_client_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg);
@@ -325,6 +420,9 @@ void req_client_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg
 void req_server_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg);
 struct msg *req_recv_next(struct context *ctx, struct conn *conn, bool alloc);
 void req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
+void req_forward_frag(struct context *ctx, struct msg *msg);
+void req_cache_invalidate(struct context *ctx, struct server_pool *pool, struct msg *msg);
+void req_collapse_done(struct context *ctx, struct server_pool *pool, struct msg *msg, struct msg *rsp, err_t err);
 struct msg *req_send_next(struct context *ctx, struct conn *conn);
 void req_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
 
@@ -341,7 +439,6 @@ void _msg_print(const char *file, int line, struct msg *msg, bool real, int leve
 
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
-uint32_t msg_nfree_msg(void);
 uint64_t msg_ntotal_msg(void);
 #endif
 #endif //shenzheng 2015-3-23 common
@@ -72,7 +72,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && conn->proxy);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -82,7 +82,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -138,6 +138,24 @@ proxy_listen(struct context *ctx, struct conn *p)
         return NC_ERROR;
     }
 
+    /* every worker binds its own listener on the same address */
+    if (ctx->nworker > 1) {
+        if (p->family == AF_UNIX) {
+            log_error("listen on unix socket '%.*s' is not supported with "
+                      "%"PRIu32" workers", pool->addrstr.len,
+                      pool->addrstr.data, ctx->nworker);
+            return NC_ERROR;
+        }
+
+        status = nc_set_reuseport(p->sd);
+        if (status < 0) {
+            log_error("reuse of port '%.*s' for listening on p %d failed: %s",
+                      pool->addrstr.len, pool->addrstr.data, p->sd,
+                      strerror(errno));
+            return NC_ERROR;
+        }
+    }
+
     status = proxy_reuse(p);
     if (status < 0) {
         log_error("reuse of addr '%.*s' for listening on p %d failed: %s",
@@ -200,7 +218,7 @@ proxy_each_init(void *elem, void *data)
 
     status = proxy_listen(pool->ctx, p);
     if (status != NC_OK) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
         return status;
     }
 
@@ -240,7 +258,7 @@ proxy_each_deinit(void *elem, void *data)
 
     p = pool->p_conn;
     if (p != NULL) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
     }
 
     return NC_OK;
@@ -351,7 +369,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("set nonblock on c %d from p %d failed: %s", c->sd, p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -389,7 +407,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("event add conn from p %d failed: %s", p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -576,7 +594,7 @@ proxy_adm_destroy(struct proxy_adm *padm)
 	{
 		ASSERT(padm->p_conn->proxy);
 
-		padm->p_conn->close(padm->p_conn->owner, padm->p_conn);
+		padm->p_conn->ops->close(padm->p_conn->owner, padm->p_conn);
 	}
 
 	if(padm->evb != NULL)
@@ -610,13 +628,13 @@ proxy_adm_loop(void *arg, uint32_t events)
         nc_get_soerror(conn->sd);
 		conn->err = errno;
 		event_del_conn(padm->evb, conn);
-		conn->close(ctx, conn);
+		conn->ops->close(ctx, conn);
         return NC_ERROR;
     }
 
     /* read takes precedence over write */
     if (events & EVENT_READ) {
-        status = conn->recv(ctx, conn);
+        status = conn->ops->recv(ctx, conn);
         if (status != NC_OK || conn->done || conn->err) {
 			if(!conn->done && conn->err == EINVAL)
 			{
@@ -624,29 +642,29 @@ proxy_adm_loop(void *arg, uint32_t events)
 
 				ASSERT(conn->rmsg != NULL);
 				conn->rmsg->done = 1;
-			    conn->enqueue_outq(ctx, conn, conn->rmsg);
+			    conn->ops->enqueue_outq(ctx, conn, conn->rmsg);
 				conn->rmsg = NULL;
 				status = event_add_out(padm->evb, conn);
     			if (status != NC_OK) {
         			event_del_conn(padm->evb, conn);
-					conn->close(ctx, conn);
+					conn->ops->close(ctx, conn);
 		       		return NC_ERROR;
     			}
 			}
 			else
 			{
 				event_del_conn(padm->evb, conn);
-				conn->close(ctx, conn);
+				conn->ops->close(ctx, conn);
 		        return NC_ERROR;
 			}
         }
     }
 
     if (events & EVENT_WRITE) {
-        status = conn->send(ctx, conn);
+        status = conn->ops->send(ctx, conn);
         if (status != NC_OK || conn->done || conn->err) {
             event_del_conn(padm->evb, conn);
-			conn->close(ctx, conn);
+			conn->ops->close(ctx, conn);
             return NC_ERROR;
         }
     }
@@ -743,7 +761,7 @@ proxy_adm_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("set nonblock on c %d from p %d failed: %s", c->sd, p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -759,7 +777,7 @@ proxy_adm_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("event add conn from p %d failed: %s", p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -797,7 +815,7 @@ proxy_adm_close(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && conn->proxy);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put_proxy_adm(conn);
         return;
     }
@@ -807,7 +825,7 @@ proxy_adm_close(struct context *ctx, struct conn *conn)
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -902,7 +920,7 @@ proxy_adm_client_close(struct context *ctx, struct conn *conn)
     //client_close_stats(ctx, conn->owner, conn->err, conn->eof);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put_proxy_adm(conn);
         return;
     }
@@ -928,7 +946,7 @@ proxy_adm_client_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, c_tqe);
 
         /* dequeue the message (request) from client outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
 
         if (msg->done) {
             log_debug(LOG_INFO, "close c %d discarding %s req %"PRIu64" len "
@@ -950,7 +968,7 @@ proxy_adm_client_close(struct context *ctx, struct conn *conn)
     }
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -1327,7 +1345,7 @@ proxy_adm_parse_req(struct msg *r)
                     goto error;
                 }
 
-                kpos = array_push(r->keys);
+                kpos = array_push(&r->keys);
                 if (kpos == NULL) {
                     goto enomem;
                 }
@@ -1345,8 +1363,8 @@ proxy_adm_parse_req(struct msg *r)
                 if (proxy_adm_arg1(r)) {
                     state = SW_CRLF;
                 }else if (proxy_adm_arg2(r)) {
-                	ASSERT(array_n(r->keys) > 0);
-                	if(array_n(r->keys) == 1)
+                	ASSERT(array_n(&r->keys) > 0);
+                	if(array_n(&r->keys) == 1)
                 	{
                 		if(ch == CR)
                 		{
@@ -1357,7 +1375,7 @@ proxy_adm_parse_req(struct msg *r)
 							state = SW_SPACES_BEFORE_KEY;
 						}
                 	}
-					else if(array_n(r->keys) == 2)
+					else if(array_n(&r->keys) == 2)
 					{
 						state = SW_CRLF;
 					}
@@ -1367,8 +1385,8 @@ proxy_adm_parse_req(struct msg *r)
 					}
                 } 
 				else if (proxy_adm_arg2or3(r)) {
-                	ASSERT(array_n(r->keys) > 0);
-                	if(array_n(r->keys) == 1)
+                	ASSERT(array_n(&r->keys) > 0);
+                	if(array_n(&r->keys) == 1)
                 	{
                 		if(ch == CR)
                 		{
@@ -1379,7 +1397,7 @@ proxy_adm_parse_req(struct msg *r)
 							state = SW_SPACES_BEFORE_KEY;
 						}
                 	}
-					else if(array_n(r->keys) == 2){
+					else if(array_n(&r->keys) == 2){
 						if(ch == CR)
                 		{
 							state = SW_CRLF;
@@ -1389,7 +1407,7 @@ proxy_adm_parse_req(struct msg *r)
 							state = SW_SPACES_BEFORE_KEYS;
 						}			
 					}
-					else if(array_n(r->keys) == 3)
+					else if(array_n(&r->keys) == 3)
 					{
 						state = SW_CRLF;
 					}
@@ -1400,8 +1418,8 @@ proxy_adm_parse_req(struct msg *r)
                 }
 				else if (proxy_adm_arg2ormore(r)) {
 
-					ASSERT(array_n(r->keys) > 0);
-                	if(array_n(r->keys) == 1)
+					ASSERT(array_n(&r->keys) > 0);
+                	if(array_n(&r->keys) == 1)
                 	{
                 		if(ch == CR)
                 		{
@@ -2082,7 +2100,7 @@ proxy_adm_command_help(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 0);
 
 
@@ -2259,7 +2277,7 @@ proxy_adm_command_show_conf(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 0);
 
 	pools = get_server_pools(ctx, old);
@@ -2321,7 +2339,7 @@ proxy_adm_command_show_pools(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 0);
 
 	pools = get_server_pools(ctx, false);
@@ -2363,12 +2381,12 @@ proxy_adm_command_show_pool(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 1);
 
 	pools = get_server_pools(ctx, false);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 
 	sp = proxy_adm_find_server_pool(pools, kp, pmsg, conn);
 	if(sp == NULL)
@@ -2408,12 +2426,12 @@ proxy_adm_command_show_servers(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 1);
 
 	pools = get_server_pools(ctx, false);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 
 	sp = proxy_adm_find_server_pool(pools, kp, pmsg, conn);
 	if(sp == NULL)
@@ -2455,12 +2473,12 @@ proxy_adm_command_find_key(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 2);
 
 	pools = get_server_pools(ctx, false);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 
 	sp = proxy_adm_find_server_pool(pools, kp, pmsg, conn);
 	if(sp == NULL)
@@ -2475,7 +2493,7 @@ proxy_adm_command_find_key(struct context *ctx,
 		}
 	}
 
-	kp = array_get(msg->keys, 1);
+	kp = array_get(&msg->keys, 1);
 
 	idx = server_pool_idx(sp, kp->start, (uint32_t)(kp->end - kp->start));
     server = array_get(&sp->server, idx);
@@ -2523,12 +2541,12 @@ proxy_adm_command_find_keys(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys >= 2);
 
 	pools = get_server_pools(ctx, false);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	
 	sp = proxy_adm_find_server_pool(pools, kp, pmsg, conn);
 	if(sp == NULL)
@@ -2545,7 +2563,7 @@ proxy_adm_command_find_keys(struct context *ctx,
 
 	for(i = 1; i < nkeys; i ++)
 	{
-		kp = array_get(msg->keys, i);
+		kp = array_get(&msg->keys, i);
 
 		idx = server_pool_idx(sp, kp->start, (uint32_t)(kp->end - kp->start));
 		server = array_get(&sp->server, idx);
@@ -2590,7 +2608,7 @@ proxy_adm_command_reload_conf(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 	
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 0);
 	
 	msg_len1 = pmsg->mlen;
@@ -2631,14 +2649,14 @@ proxy_adm_command_set_watch(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 2 || nkeys == 3);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	watch_name.data = kp->start;
 	watch_name.len = (uint32_t)(kp->end - kp->start);
 
-	kp = array_get(msg->keys, 1);
+	kp = array_get(&msg->keys, 1);
 	string_init(&watch_path);
 	status = string_copy(&watch_path, kp->start, (uint32_t)(kp->end - kp->start));
 	if(status != NC_OK)
@@ -2649,7 +2667,7 @@ proxy_adm_command_set_watch(struct context *ctx,
 	string_init(&zk_servers);
 	if(nkeys > 2)
 	{
-		kp = array_get(msg->keys, 2);
+		kp = array_get(&msg->keys, 2);
 		status = string_copy(&zk_servers, kp->start, (uint32_t)(kp->end - kp->start));
 		if(status != NC_OK)
 		{
@@ -2783,10 +2801,10 @@ proxy_adm_command_del_watch(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 1);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	watch_name.data = kp->start;
 	watch_name.len = (uint32_t)(kp->end - kp->start);
 
@@ -2851,21 +2869,21 @@ proxy_adm_command_reset_watch(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 2 || nkeys == 3);
 	log_debug(LOG_DEBUG, "nkeys : %d", nkeys);
 	if(nkeys > 2)
 	{
-		kp = array_get(msg->keys, 2);
+		kp = array_get(&msg->keys, 2);
 		log_debug(LOG_DEBUG, "last kp : %s", kp->start);
 	}
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	watch_name.data = kp->start;
 	watch_name.len = (uint32_t)(kp->end - kp->start);
 	log_debug(LOG_DEBUG, "first kp : %s", kp->start);
 
-	kp = array_get(msg->keys, 1);
+	kp = array_get(&msg->keys, 1);
 	log_debug(LOG_DEBUG, "second kp : %s", kp->start);
 	string_init(&watch_path);
 	status = string_copy(&watch_path, kp->start, (uint32_t)(kp->end - kp->start));
@@ -2877,7 +2895,7 @@ proxy_adm_command_reset_watch(struct context *ctx,
 	string_init(&zk_servers);
 	if(nkeys > 2)
 	{
-		kp = array_get(msg->keys, 2);
+		kp = array_get(&msg->keys, 2);
 		status = string_copy(&zk_servers, kp->start, (uint32_t)(kp->end - kp->start));
 		if(status != NC_OK)
 		{
@@ -2990,10 +3008,10 @@ proxy_adm_command_show_watch(struct context *ctx,
     ASSERT(msg->owner == conn);
 	ASSERT(conn->owner == ctx);
 
-	nkeys = array_n(msg->keys);
+	nkeys = array_n(&msg->keys);
 	ASSERT(nkeys == 1);
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	watch_name.data = kp->start;
 	watch_name.len = (uint32_t)(kp->end - kp->start);
 
@@ -3213,7 +3231,7 @@ proxy_close_for_reload(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && conn->proxy);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
 	    conn_put_for_reload(conn);
         return;
     }
@@ -3223,7 +3241,7 @@ proxy_close_for_reload(struct context *ctx, struct conn *conn)
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -17,6 +17,7 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <proto/nc_proto.h>
 
 struct msg *
 req_get(struct conn *conn)
@@ -70,11 +71,11 @@ req_log(struct msg *req)
     req_len = req->mlen;
     rsp_len = (rsp != NULL) ? rsp->mlen : 0;
 
-    if (array_n(req->keys) < 1) {
+    if (array_n(&req->keys) < 1) {
         return;
     }
 
-    kpos = array_get(req->keys, 0);
+    kpos = array_get(&req->keys, 0);
     if (kpos->end != NULL) {
         *(kpos->end) = '\0';
     }
@@ -109,6 +110,8 @@ req_put(struct msg *msg)
 
 	req_log(msg);
 
+    ASSERT(!msg->collapse || msg->cold == NULL || msg->cold->followers == NULL);
+
     pmsg = msg->peer;
     if (pmsg != NULL) {
         ASSERT(!pmsg->request && pmsg->peer == msg);
@@ -153,7 +156,7 @@ req_done(struct conn *conn, struct msg *msg)
         return true;
     }
 
-    if (msg->nfrag_done < msg->nfrag) {
+    if (msg->cold != NULL && msg->cold->nfrag_done < msg->cold->nfrag) {
         return false;
     }
 
@@ -202,7 +205,7 @@ req_done(struct conn *conn, struct msg *msg)
         nfragment++;
     }
 
-    ASSERT(msg->frag_owner->nfrag == nfragment);
+    ASSERT(msg->frag_owner->cold->nfrag == nfragment);
 
     msg->post_coalesce(msg->frag_owner);
 
@@ -271,6 +274,11 @@ req_error(struct conn *conn, struct msg *msg)
 
 ferror:
 
+    if (msg->partial) {
+        /* keys of the fragments in error were coalesced as misses */
+        return false;
+    }
+
     /*
      * Mark all fragments of the given request to be in error to speed up
      * future req_error calls for any of fragments of this request
@@ -299,6 +307,57 @@ ferror:
     return true;
 }
 
+/*
+ * Return true if the response to a request vector can be sent in part,
+ * false otherwise
+ *
+ * The values of the leading keys of a fragmented request are coalesced
+ * into its response as soon as their fragments are done (see nstream in
+ * msg_cold), so that the head of a large reply can go out while the
+ * fragments of the remaining keys are still outstanding.
+ *
+ * This is only done for pools with partial_mget, where a fragment that
+ * fails later is answered in-band as a miss. Otherwise the failure would
+ * have to replace a response whose head is already on the wire.
+ */
+bool
+req_stream(struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool = conn->owner;
+    struct msg *pmsg; /* peer message (response) */
+    struct mbuf *mbuf;
+    size_t len, min;
+
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    if (!pool->partial_mget) {
+        return false;
+    }
+
+    if (msg->frag_id == 0 || msg->frag_owner != msg || msg->ferror) {
+        return false;
+    }
+
+    pmsg = msg->peer;
+    if (pmsg == NULL || msg->cold == NULL || msg->cold->nstream == 0) {
+        return false;
+    }
+
+    /* once the head is out, whatever has been coalesced since follows it */
+    min = msg->stream ? 1 : MSG_STREAM_MIN;
+
+    len = 0;
+    STAILQ_FOREACH(mbuf, &pmsg->mhdr, next) {
+        len += mbuf_length(mbuf);
+        if (len >= min) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void
 req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -314,7 +373,7 @@ req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
      * in the reponse anyway!
      */
     if (!msg->noreply) {
-        msg_tmo_insert(msg, conn);
+        msg_tmo_insert(ctx, msg, conn);
     }
 
     TAILQ_INSERT_TAIL(&conn->imsg_q, msg, s_tqe);
@@ -409,7 +468,7 @@ req_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * half (by sending the second FIN) when the client has no
          * outstanding requests
          */
-        if (!conn->active(conn)) {
+        if (!conn->ops->active(conn)) {
             conn->done = 1;
             log_debug(LOG_INFO, "c %d is done", conn->sd);
         }
@@ -450,7 +509,7 @@ req_make_reply(struct context *ctx, struct conn *conn, struct msg *req)
     msg->request = 0;
 
     req->done = 1;
-    conn->enqueue_outq(ctx, conn, req);
+    conn->ops->enqueue_outq(ctx, conn, req);
     return NC_OK;
 }
 
@@ -498,17 +557,24 @@ req_examine_replace_server(struct context *ctx, struct conn *conn, struct msg *m
 	struct server_pool *pool;
 	struct server *ser;
 	struct keypos *kp;
+	struct msg_cold *cold;
 	struct string old_ser_addr, new_ser_addr;
 	struct string old_ser_host, new_ser_host;
 	struct string old_ser_port_str, new_ser_port_str;
 	int old_ser_port, new_ser_port;
 	uint8_t *p, *q, *last;
 
-	log_debug(LOG_DEBUG, "array_n(msg->keys) : %d", array_n(msg->keys));
+	log_debug(LOG_DEBUG, "array_n(&msg->keys) : %d", array_n(&msg->keys));
+
+	cold = msg_cold(msg);
+	if (cold == NULL) {
+		content = "-out of memory\r\n";
+		goto error;
+	}
 
-	msg->conf_version_curr = ctx->conf_version;
+	cold->conf_version_curr = ctx->conf_version;
 
-	if(array_n(msg->keys) != 2)
+	if(array_n(&msg->keys) != 2)
 	{
 		content = "-command args error!(example : "
 			"replace_server old_ip:old_port new_ip:new_port) \r\n";
@@ -517,13 +583,13 @@ req_examine_replace_server(struct context *ctx, struct conn *conn, struct msg *m
 	
 	pool = conn->owner;
 
-	kp = array_get(msg->keys, 0);
+	kp = array_get(&msg->keys, 0);
 	old_ser_addr.data = kp->start;
 	old_ser_addr.len = (uint32_t)(kp->end - kp->start);
 	log_debug(LOG_DEBUG, "old_ser_addr.len : %d", old_ser_addr.len);
 	log_debug(LOG_DEBUG, "old_ser_addr.data : %.*s", old_ser_addr.len, old_ser_addr.data);
 
-	kp = array_get(msg->keys, 1);
+	kp = array_get(&msg->keys, 1);
 	new_ser_addr.data = kp->start;
 	new_ser_addr.len = (uint32_t)(kp->end - kp->start);
 	log_debug(LOG_DEBUG, "new_ser_addr.len : %d", new_ser_addr.len);
@@ -609,7 +675,7 @@ req_examine_replace_server(struct context *ctx, struct conn *conn, struct msg *m
 		if(0 == server_pname_compare(&ser->pname, &old_ser_addr))
 		{
 			log_debug(LOG_DEBUG, "target server idx is %d", ser->idx);
-			msg->mser_idx = ser->idx;
+			cold->mser_idx = ser->idx;
 			find_flag = true;
 			break;
 		}
@@ -638,11 +704,7 @@ error:
 		return status;
 	}
 
-	status = event_add_out(ctx->evb, conn);
-	if (status != NC_OK) {
-		conn->err = errno;
-		return status;
-	}
+	core_dirty(ctx, conn);
 
 	return NC_ERROR;
 }
@@ -698,11 +760,389 @@ req_filter(struct context *ctx, struct conn *conn, struct msg *msg)
     return false;
 }
 
+/*
+ * Return true if msg is a read of a single key whose response may be
+ * served from the hot key cache or shared with identical reads: a redis
+ * get, or a memcache get or gets
+ */
+static bool
+req_single_read(struct msg *msg)
+{
+    if (msg->redis) {
+        return msg->type == MSG_REQ_REDIS_GET;
+    }
+
+    return (msg->type == MSG_REQ_MC_GET || msg->type == MSG_REQ_MC_GETS) &&
+           array_n(&msg->keys) == 1;
+}
+
+/*
+ * Return true if msg may change the values of its keys
+ */
+static bool
+req_write(struct msg *msg)
+{
+    if (msg->redis) {
+        return (redis_command(msg->type)->flags & REDIS_CMD_WRITE) != 0;
+    }
+
+    return msg->type != MSG_REQ_MC_GET && msg->type != MSG_REQ_MC_GETS &&
+           msg->type != MSG_REQ_MC_QUIT;
+}
+
+/*
+ * Invalidate the hot key cache entries of the keys of msg, if it is a
+ * write. It is done both when a write is received and when its response
+ * is, so that a read that overtook the write on the way to the server
+ * does not leave the old value behind.
+ */
+void
+req_cache_invalidate(struct context *ctx, struct server_pool *pool,
+                     struct msg *msg)
+{
+    struct keypos *kpos;
+    uint32_t i, nkey;
+
+    if (!req_write(msg)) {
+        return;
+    }
+
+    for (i = 0, nkey = array_n(&msg->keys); i < nkey; i++) {
+        kpos = array_get(&msg->keys, i);
+        cache_invalidate(pool->cache, cache_hash(kpos->start,
+                                                 (uint32_t)(kpos->end - kpos->start)));
+    }
+
+    cache_report(ctx, pool);
+}
+
+/*
+ * Answer the read msg with the response held by the cache entry
+ */
+static rstatus_t
+req_cache_reply(struct context *ctx, struct conn *conn, struct msg *msg,
+                struct cache_entry *entry)
+{
+    rstatus_t status;
+    uint8_t *p;
+    size_t n, len;
+
+    status = req_make_reply(ctx, conn, msg);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    p = entry->data + entry->keylen;
+    for (len = entry->len; len > 0; len -= n, p += n) {
+        n = MIN(len, mbuf_data_size());
+
+        status = msg_append(msg->peer, p, n);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Look the read msg up in the hot key cache of pool. Return true if it
+ * was answered from the cache; otherwise msg is marked to fill the cache
+ * with its response when its key is hot. Writes invalidate the entries
+ * of their keys.
+ */
+static bool
+req_cache(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool = conn->owner;
+    struct cache *cache = pool->cache;
+    struct cache_entry *entry;
+    struct msg_cold *cold;
+    struct keypos *kpos;
+    uint32_t hash, keylen;
+    int64_t now;
+    bool hot;
+
+    if (!req_single_read(msg)) {
+        req_cache_invalidate(ctx, pool, msg);
+        return false;
+    }
+
+    kpos = array_get(&msg->keys, 0);
+    keylen = (uint32_t)(kpos->end - kpos->start);
+    hash = cache_hash(kpos->start, keylen);
+    now = timer_wheel_now(&ctx->timer);
+
+    hot = cache_hot(cache, hash, now);
+
+    entry = cache_get(cache, msg->type, kpos->start, keylen, hash, now);
+    cache_report(ctx, pool);
+
+    if (entry == NULL) {
+        stats_pool_incr(ctx, pool, hot_cache_misses);
+
+        if (hot) {
+            cold = msg_cold(msg);
+            if (cold != NULL) {
+                msg->cache = 1;
+                cold->cache_epoch = cache_epoch(cache, hash);
+            }
+        }
+        return false;
+    }
+
+    stats_pool_incr(ctx, pool, hot_cache_hits);
+
+    status = req_cache_reply(ctx, conn, msg, entry);
+    if (status != NC_OK) {
+        conn->err = errno;
+        return true;
+    }
+
+    core_dirty(ctx, conn);
+
+    return true;
+}
+
+/*
+ * Return the in-flight read of pool for the key with the given hash that
+ * is identical to msg, or NULL
+ */
+static struct msg *
+req_collapse_leader(struct server_pool *pool, struct msg *msg, uint32_t hash)
+{
+    struct msg *leader;
+    struct keypos *kpos, *lkpos;
+
+    kpos = array_get(&msg->keys, 0);
+
+    for (leader = pool->collapse[hash % MSG_COLLAPSE_NSLOT]; leader != NULL;
+         leader = leader->cold->collapse_next) {
+        lkpos = array_get(&leader->keys, 0);
+
+        if (leader->type == msg->type && leader->cold->collapse_hash == hash &&
+            lkpos->end - lkpos->start == kpos->end - kpos->start &&
+            memcmp(lkpos->start, kpos->start,
+                   (size_t)(kpos->end - kpos->start)) == 0) {
+            return leader;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Make the read msg, about to be forwarded to a server, one that
+ * identical reads received before its response collapse into
+ */
 static void
-req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
+req_collapse_add(struct server_pool *pool, struct msg *msg)
+{
+    struct msg_cold *cold;
+    struct keypos *kpos;
+    struct msg **slot;
+
+    cold = msg_cold(msg);
+    if (cold == NULL) {
+        msg->collapse = 0;
+        return;
+    }
+
+    kpos = array_get(&msg->keys, 0);
+    cold->collapse_hash = cache_hash(kpos->start,
+                                     (uint32_t)(kpos->end - kpos->start));
+
+    slot = &pool->collapse[cold->collapse_hash % MSG_COLLAPSE_NSLOT];
+    cold->collapse_next = *slot;
+    *slot = msg;
+}
+
+/*
+ * Stop reads from collapsing into the in-flight read msg; it still
+ * answers the reads that already did
+ */
+static void
+req_collapse_remove(struct server_pool *pool, struct msg *msg)
+{
+    struct msg **pp;
+
+    for (pp = &pool->collapse[msg->cold->collapse_hash % MSG_COLLAPSE_NSLOT];
+         *pp != NULL; pp = &(*pp)->cold->collapse_next) {
+        if (*pp == msg) {
+            *pp = msg->cold->collapse_next;
+            msg->cold->collapse_next = NULL;
+            return;
+        }
+    }
+}
+
+/*
+ * Stop reads from collapsing into the in-flight reads of the keys of the
+ * write msg, so that a read received after a write never shares the
+ * response of a read sent before it
+ */
+static void
+req_collapse_forget(struct server_pool *pool, struct msg *msg)
+{
+    struct msg **pp;
+    struct keypos *kpos;
+    uint32_t i, nkey, hash;
+
+    for (i = 0, nkey = array_n(&msg->keys); i < nkey; i++) {
+        kpos = array_get(&msg->keys, i);
+        hash = cache_hash(kpos->start, (uint32_t)(kpos->end - kpos->start));
+
+        for (pp = &pool->collapse[hash % MSG_COLLAPSE_NSLOT]; *pp != NULL;) {
+            if ((*pp)->cold->collapse_hash == hash) {
+                struct msg *leader = *pp;
+
+                *pp = leader->cold->collapse_next;
+                leader->cold->collapse_next = NULL;
+            } else {
+                pp = &(*pp)->cold->collapse_next;
+            }
+        }
+    }
+}
+
+/*
+ * Collapse the read msg into an identical read of the pool in flight to
+ * the server, and return true if it did: msg waits in the client outq to
+ * be answered with a copy of the response to that read. Otherwise msg is
+ * marked to be the read that identical ones collapse into. Writes stop
+ * reads from collapsing into the reads of their keys.
+ */
+static bool
+req_collapse(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool = conn->owner;
+    struct msg *leader;
+    struct msg_cold *cold;
+    struct keypos *kpos;
+    uint32_t hash;
+
+    if (!req_single_read(msg)) {
+        if (req_write(msg)) {
+            req_collapse_forget(pool, msg);
+        }
+        return false;
+    }
+
+    cold = msg_cold(msg);
+    if (cold == NULL) {
+        return false;
+    }
+
+    kpos = array_get(&msg->keys, 0);
+    hash = cache_hash(kpos->start, (uint32_t)(kpos->end - kpos->start));
+
+    leader = req_collapse_leader(pool, msg, hash);
+    if (leader == NULL) {
+        msg->collapse = 1;
+        return false;
+    }
+
+    cold->collapse_next = leader->cold->followers;
+    leader->cold->followers = msg;
+
+    conn->ops->enqueue_outq(ctx, conn, msg);
+
+    stats_pool_incr(ctx, pool, collapse_hits);
+
+    log_debug(LOG_VERB, "collapse req %"PRIu64" into req %"PRIu64"", msg->id,
+              leader->id);
+
+    return true;
+}
+
+/*
+ * Answer the collapsed read msg with a copy of rsp, which references the
+ * larger buffers of rsp rather than copying them
+ */
+static rstatus_t
+req_collapse_reply(struct msg *msg, struct msg *rsp)
 {
     rstatus_t status;
+    struct msg *pmsg;
+    struct mbuf *mbuf;
+
+    pmsg = msg_get(msg->owner, false, msg->redis);
+    if (pmsg == NULL) {
+        return NC_ENOMEM;
+    }
+
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        if (mbuf_empty(mbuf)) {
+            continue;
+        }
+
+        status = msg_append_ref(pmsg, mbuf, mbuf_length(mbuf));
+        if (status != NC_OK) {
+            rsp_put(pmsg);
+            return status;
+        }
+    }
+
+    msg->peer = pmsg;
+    pmsg->peer = msg;
+
+    return NC_OK;
+}
+
+/*
+ * Answer the reads collapsed into the read msg of pool, which is done,
+ * with copies of its response rsp, or with the error err when it has
+ * none. Reads whose client went away meanwhile are released.
+ */
+void
+req_collapse_done(struct context *ctx, struct server_pool *pool,
+                  struct msg *msg, struct msg *rsp, err_t err)
+{
+    rstatus_t status;
+    struct msg *follower, *next;
+    struct conn *c_conn;
+
+    ASSERT(msg->request && msg->collapse);
+
+    msg->collapse = 0;
+
+    if (msg->cold == NULL) {
+        /* failed before req_collapse_add(); no read collapsed into msg */
+        return;
+    }
+
+    req_collapse_remove(pool, msg);
+
+    for (follower = msg->cold->followers; follower != NULL; follower = next) {
+        next = follower->cold->collapse_next;
+        follower->cold->collapse_next = NULL;
+
+        ASSERT(follower->request && !follower->done);
+
+        if (follower->swallow) {
+            req_put(follower);
+            continue;
+        }
+
+        status = (rsp != NULL) ? req_collapse_reply(follower, rsp) : NC_ERROR;
+        if (status != NC_OK) {
+            follower->error = 1;
+            follower->err = (rsp != NULL) ? errno : err;
+        }
+        follower->done = 1;
 
+        c_conn = follower->owner;
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            core_dirty(ctx, c_conn);
+        }
+    }
+    msg->cold->followers = NULL;
+}
+
+static void
+req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
+{
     ASSERT(conn->client && !conn->proxy);
 
     log_debug(LOG_INFO, "forward req %"PRIu64" len %"PRIu32" type %d from "
@@ -713,17 +1153,23 @@ req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
     msg->error = 1;
     msg->err = errno;
 
+    if (msg->collapse) {
+        req_collapse_done(ctx, conn->owner, msg, NULL, msg->err);
+    }
+
     /* noreply request don't expect any response */
     if (msg->noreply) {
         req_put(msg);
         return;
     }
 
+    if (msg->frag_owner != NULL && msg->frag_owner != msg) {
+        msg->frag_owner->cold->nfrag_done++;
+        req_forward_frag(ctx, msg);
+    }
+
     if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
-        status = event_add_out(ctx->evb, conn);
-        if (status != NC_OK) {
-            conn->err = errno;
-        }
+        core_dirty(ctx, conn);
     }
 }
 
@@ -749,24 +1195,32 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
     ASSERT(c_conn->client && !c_conn->proxy);
 
     /* enqueue message (request) into client outq, if response is expected */
-    if (!msg->noreply) {
-        c_conn->enqueue_outq(ctx, c_conn, msg);
+    if (msg->held) {
+        /* held fragments were queued along with the rest of their request */
+        msg->held = 0;
+    } else if (!msg->noreply) {
+        c_conn->ops->enqueue_outq(ctx, c_conn, msg);
     }
 
     pool = c_conn->owner;
-    ASSERT(array_n(msg->keys) > 0);
-    kpos = array_get(msg->keys, 0);
+
+    if (msg->collapse) {
+        req_collapse_add(pool, msg);
+    }
+
+    ASSERT(array_n(&msg->keys) > 0);
+    kpos = array_get(&msg->keys, 0);
     key = kpos->start;
     keylen = (uint32_t)(kpos->end - kpos->start);
 
 #if 1 //shenzheng 2015-6-24 replace server
 	if(1 == msg->replace_server)
 	{
-		ASSERT(msg->conf_version_curr == ctx->conf_version);
+		ASSERT(msg->cold->conf_version_curr == ctx->conf_version);
 	
-		log_debug(LOG_DEBUG, "msg->mser_idx : %d", msg->mser_idx);
+		log_debug(LOG_DEBUG, "msg->mser_idx : %d", msg->cold->mser_idx);
 		log_debug(LOG_DEBUG, "array_n(&pool->server) : %d", array_n(&pool->server));
-		if(array_n(&pool->server) <= msg->mser_idx)
+		if(array_n(&pool->server) <= msg->cold->mser_idx)
 		{
 			s_conn = NULL; 
 		}
@@ -814,12 +1268,7 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
 
     /* enqueue the message (request) into server inq */
     if (TAILQ_EMPTY(&s_conn->imsg_q)) {
-        status = event_add_out(ctx->evb, s_conn);
-        if (status != NC_OK) {
-            req_forward_error(ctx, c_conn, msg);
-            s_conn->err = errno;
-            return;
-        }
+        core_dirty(ctx, s_conn);
     }
 
     if (s_conn->need_auth) {
@@ -831,7 +1280,7 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
         }
     }
 
-    s_conn->enqueue_inq(ctx, s_conn, msg);
+    s_conn->ops->enqueue_inq(ctx, s_conn, msg);
 
     req_forward_stats(ctx, s_conn->owner, msg);
 
@@ -840,6 +1289,52 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
               msg->mlen, msg->type, keylen, key);
 }
 
+/*
+ * Forward the fragment held behind msg, which is a fragment that is done
+ * (see max_keys_per_fragment). If msg is in error, the request is bound to
+ * fail, so the fragments held behind it are failed along rather than sent.
+ */
+void
+req_forward_frag(struct context *ctx, struct msg *msg)
+{
+    struct msg *cmsg, *nmsg; /* current and next held fragment */
+    struct conn *c_conn;
+
+    if (msg->cold == NULL || msg->cold->frag_next == NULL) {
+        return;
+    }
+
+    cmsg = msg->cold->frag_next;
+    msg->cold->frag_next = NULL;
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (!msg->error) {
+        req_forward(ctx, c_conn, cmsg);
+        return;
+    }
+
+    for (; cmsg != NULL; cmsg = nmsg) {
+        ASSERT(cmsg->held && !cmsg->done);
+
+        nmsg = NULL;
+        if (cmsg->cold != NULL) {
+            nmsg = cmsg->cold->frag_next;
+            cmsg->cold->frag_next = NULL;
+        }
+
+        cmsg->done = 1;
+        cmsg->error = 1;
+        cmsg->err = msg->err;
+        cmsg->frag_owner->cold->nfrag_done++;
+    }
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        core_dirty(ctx, c_conn);
+    }
+}
+
 void
 req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
               struct msg *nmsg)
@@ -876,22 +1371,29 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
             return;
         }
 
-        status = event_add_out(ctx->evb, conn);
-        if (status != NC_OK) {
-            conn->err = errno;
-        }
+        core_dirty(ctx, conn);
 
         return;
     }
 
-    /* do fragment */
     pool = conn->owner;
+
+    if (pool->cache != NULL && req_cache(ctx, conn, msg)) {
+        return;
+    }
+
+    if (pool->collapse != NULL && req_collapse(ctx, conn, msg)) {
+        return;
+    }
+
+    /* do fragment */
 	
     TAILQ_INIT(&frag_msgq);
-    status = msg->fragment(msg, pool->ncontinuum, &frag_msgq);
+    status = msg->fragment(msg, array_n(&pool->server),
+                           pool->max_keys_per_fragment, &frag_msgq);
     if (status != NC_OK) {
         if (!msg->noreply) {
-            conn->enqueue_outq(ctx, conn, msg);
+            conn->ops->enqueue_outq(ctx, conn, msg);
         }
 #if 1 //shenzheng 2015-3-2 common
 		log_debug(LOG_DEBUG, "fragment error");
@@ -909,7 +1411,7 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
     status = req_make_reply(ctx, conn, msg);
     if (status != NC_OK) {
         if (!msg->noreply) {
-            conn->enqueue_outq(ctx, conn, msg);
+            conn->ops->enqueue_outq(ctx, conn, msg);
         }
         req_forward_error(ctx, conn, msg);
     }
@@ -918,8 +1420,19 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
         tmsg = TAILQ_NEXT(sub_msg, m_tqe);
 
         TAILQ_REMOVE(&frag_msgq, sub_msg, m_tqe);
+
+        if (sub_msg->held) {
+            /* keep its place in client outq; see req_forward_frag */
+            conn->ops->enqueue_outq(ctx, conn, sub_msg);
+            continue;
+        }
+
+        /* a single key read is forwarded as its only fragment */
+        sub_msg->collapse = msg->collapse;
+
         req_forward(ctx, conn, sub_msg);
     }
+    msg->collapse = 0;
 
     ASSERT(TAILQ_EMPTY(&frag_msgq));
     return;
@@ -984,7 +1497,7 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
               "s %d", msg->id, msg->mlen, msg->type, conn->sd);
 
     /* dequeue the message (request) from server inq */
-    conn->dequeue_inq(ctx, conn, msg);
+    conn->ops->dequeue_inq(ctx, conn, msg);
 
     /*
      * noreply request instructs the server not to send any response. So,
@@ -992,7 +1505,7 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
      * Otherwise, free the noreply request
      */
     if (!msg->noreply) {
-        conn->enqueue_outq(ctx, conn, msg);
+        conn->ops->enqueue_outq(ctx, conn, msg);
     } else {
         req_put(msg);
     }
@@ -1080,7 +1593,7 @@ req_recv_next_proxy_adm(struct context *ctx, struct conn *conn, bool alloc)
          * half (by sending the second FIN) when the client has no
          * outstanding requests
          */
-        if (!conn->active(conn)) {
+        if (!conn->ops->active(conn)) {
             conn->done = 1;
             log_debug(LOG_INFO, "c %d is done", conn->sd);
         }
@@ -1147,7 +1660,7 @@ req_recv_done_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg,
     msg->peer = res_msg;
 
     msg->done = 1;
-    conn->enqueue_outq(ctx, conn, msg);
+    conn->ops->enqueue_outq(ctx, conn, msg);
 
     status = event_add_out(padm->evb, conn);
     if (status != NC_OK) {
@@ -65,7 +65,7 @@ rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
             nmsg = TAILQ_NEXT(cmsg, c_tqe);
 
             /* dequeue request (error fragment) from client outq */
-            conn->dequeue_outq(ctx, conn, cmsg);
+            conn->ops->dequeue_outq(ctx, conn, cmsg);
             if (err == 0 && cmsg->err != 0) {
                 err = cmsg->err;
             }
@@ -98,6 +98,39 @@ rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
 #endif
 }
 
+/*
+ * Release the fragments in error of request msg, whose response has misses
+ * for their keys (see partial_mget), so that they are not answered on
+ * their own
+ */
+static void
+rsp_put_partial(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct msg *cmsg, *nmsg; /* current and next message (request) */
+    uint64_t id;
+
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(msg->request && msg->partial && !req_error(conn, msg));
+
+    id = msg->frag_id;
+    for (cmsg = TAILQ_NEXT(msg, c_tqe);
+         cmsg != NULL && cmsg->frag_id == id;
+         cmsg = nmsg) {
+        nmsg = TAILQ_NEXT(cmsg, c_tqe);
+
+        if (!cmsg->error) {
+            continue;
+        }
+
+        /* dequeue request (error fragment) from client outq */
+        conn->ops->dequeue_outq(ctx, conn, cmsg);
+        req_put(cmsg);
+    }
+
+    msg->partial = 0;
+    stats_pool_incr(ctx, conn->owner, partial_responses);
+}
+
 struct msg *
 rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc)
 {
@@ -130,7 +163,7 @@ rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * it crashes
          */
         conn->done = 1;
-        log_error("s %d active %d is done", conn->sd, conn->active(conn));
+        log_error("s %d active %d is done", conn->sd, conn->ops->active(conn));
 
         return NULL;
     }
@@ -201,9 +234,15 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(pmsg->request && !pmsg->done);
 
     if (pmsg->swallow) {
-        conn->dequeue_outq(ctx, conn, pmsg);
+        conn->ops->dequeue_outq(ctx, conn, pmsg);
         pmsg->done = 1;
 
+        if (pmsg->collapse) {
+            /* the reads collapsed into pmsg still want its response */
+            req_collapse_done(ctx, ((struct server *)conn->owner)->owner, pmsg,
+                              msg, 0);
+        }
+
         log_debug(LOG_INFO, "swallow rsp %"PRIu64" len %"PRIu32" of req "
                   "%"PRIu64" on s %d", msg->id, msg->mlen, pmsg->id,
                   conn->sd);
@@ -225,12 +264,59 @@ rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
     stats_server_incr_by(ctx, server, response_bytes, msg->mlen);
 }
 
+/*
+ * Fill the hot key cache of pool with the response msg to the hot read
+ * pmsg, or invalidate the keys of the write pmsg now that the server has
+ * applied it. Only values are cached: a miss or nil of a key of another
+ * type would not be invalidated by the writes to it.
+ */
+static void
+rsp_cache(struct context *ctx, struct server_pool *pool, struct msg *pmsg,
+          struct msg *msg)
+{
+    struct msg *req;
+    struct mbuf *mbuf;
+    struct keypos *kpos;
+    uint32_t nevict;
+
+    req = pmsg->frag_id != 0 ? pmsg->frag_owner : pmsg;
+    if (!req->cache) {
+        req_cache_invalidate(ctx, pool, pmsg);
+        return;
+    }
+
+    ASSERT(array_n(&pmsg->keys) == 1);
+
+    mbuf = STAILQ_FIRST(&msg->mhdr);
+    if (msg->error || mbuf == NULL || mbuf_length(mbuf) < 2) {
+        return;
+    }
+
+    if (msg->redis ? (mbuf->pos[0] != '$' || mbuf->pos[1] == '-') :
+                     mbuf->pos[0] != 'V') {
+        return;
+    }
+
+    kpos = array_get(&pmsg->keys, 0);
+    nevict = cache_put(pool->cache, req->type, kpos->start,
+                       (uint32_t)(kpos->end - kpos->start),
+                       cache_hash(kpos->start, (uint32_t)(kpos->end - kpos->start)),
+                       req->cold->cache_epoch, msg,
+                       timer_wheel_now(&ctx->timer));
+    if (nevict > 0) {
+        stats_pool_incr_by(ctx, pool, hot_cache_evictions, nevict);
+    }
+
+    cache_report(ctx, pool);
+}
+
 static void
 rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 {
     rstatus_t status;
     struct msg *pmsg;
     struct conn *c_conn;
+    struct server_pool *pool;
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
@@ -242,7 +328,7 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     ASSERT(pmsg != NULL && pmsg->peer == NULL);
     ASSERT(pmsg->request && !pmsg->done);
 
-    s_conn->dequeue_outq(ctx, s_conn, pmsg);
+    s_conn->ops->dequeue_outq(ctx, s_conn, pmsg);
 	
     pmsg->done = 1;
 
@@ -267,9 +353,9 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 
 		ser_new = s_conn->owner;
 
-		ASSERT(pmsg->server == ser_new);
+		ASSERT(pmsg->cold->server == ser_new);
 
-		ASSERT(pmsg->conf_version_curr == ctx->conf_version);
+		ASSERT(pmsg->cold->conf_version_curr == ctx->conf_version);
 		
 		while(msg->error == 0 && k < 1)
 		{			
@@ -323,7 +409,7 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 				         conn->sd, strerror(errno));
 				}
 
-				conn->close(ctx, conn);
+				conn->ops->close(ctx, conn);
 			}
 			
 			log_debug(LOG_DEBUG, "ser_curr->pname : %.*s", ser_curr->pname.len, ser_curr->pname.data);
@@ -383,8 +469,8 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 				conn->conf_version_curr = -1;
 				conn->ctx = NULL;
 				
-				conn->unref(conn);
-				conn->ref(conn, ser_curr);
+				conn->ops->unref(conn);
+				conn->ops->ref(conn, ser_curr);
 			}
 		}
 		
@@ -392,16 +478,24 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 	}
 #endif //shenzheng 2015-6-25 replace server
 
+    pool = pmsg->owner->owner;
+    if (pool->cache != NULL) {
+        rsp_cache(ctx, pool, pmsg, msg);
+    }
+
+    if (pmsg->collapse) {
+        req_collapse_done(ctx, pool, pmsg, msg, 0);
+    }
+
     msg->pre_coalesce(msg);
+    req_forward_frag(ctx, pmsg);
 
     c_conn = pmsg->owner;
     ASSERT(c_conn->client && !c_conn->proxy);
 
-    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-        status = event_add_out(ctx->evb, c_conn);
-        if (status != NC_OK) {
-            c_conn->err = errno;
-        }
+    pmsg = TAILQ_FIRST(&c_conn->omsg_q);
+    if (req_done(c_conn, pmsg) || req_stream(c_conn, pmsg)) {
+        core_dirty(ctx, c_conn);
     }
 
     rsp_forward_stats(ctx, s_conn->owner, msg);
@@ -441,7 +535,7 @@ rsp_send_next(struct context *ctx, struct conn *conn)
 
     pmsg = TAILQ_FIRST(&conn->omsg_q);
 
-    if (pmsg == NULL || !req_done(conn, pmsg)) {
+    if (pmsg == NULL || !(req_done(conn, pmsg) || req_stream(conn, pmsg))) {
         /* nothing is outstanding, initiate close? */
         if (pmsg == NULL && conn->eof) {
             conn->done = 1;
@@ -459,17 +553,53 @@ rsp_send_next(struct context *ctx, struct conn *conn)
     msg = conn->smsg;
     if (msg != NULL) {
         ASSERT(!msg->request && msg->peer != NULL);
-        ASSERT(req_done(conn, msg->peer));
+        if (!req_done(conn, msg->peer)) {
+            /* rest of a streamed response is still outstanding */
+            ASSERT(msg->peer->stream);
+            conn->smsg = NULL;
+            return NULL;
+        }
         pmsg = TAILQ_NEXT(msg->peer, c_tqe);
     }
 
-    if (pmsg == NULL || !req_done(conn, pmsg)) {
+    if (pmsg == NULL) {
 		conn->smsg = NULL;     
         return NULL;
     }
+
+    if (!req_done(conn, pmsg)) {
+        if (!req_stream(conn, pmsg)) {
+            conn->smsg = NULL;
+            return NULL;
+        }
+
+        /* send the head of the response ahead of its pending fragments */
+        pmsg->stream = 1;
+        msg = pmsg->peer;
+        conn->smsg = msg;
+
+        log_debug(LOG_VVERB, "send head of rsp %"PRIu64" on c %d", msg->id,
+                  conn->sd);
+
+        return msg;
+    }
     ASSERT(pmsg->request && !pmsg->swallow);
 
     if (req_error(conn, pmsg)) {
+        if (pmsg->stream) {
+            /*
+             * Head of the response is already on the wire, so the error
+             * can no longer be sent in its place; close the connection.
+             * With partial_mget failed fragments are misses, so only an
+             * error such as running out of memory gets here.
+             */
+            log_warn("req %"PRIu64" on c %d failed after its response was "
+                     "partially sent", pmsg->id, conn->sd);
+            conn->smsg = NULL;
+            conn->err = EIO;
+            return NULL;
+        }
+
         msg = rsp_make_error(ctx, conn, pmsg);
         if (msg == NULL) {
             conn->err = errno;
@@ -479,6 +609,9 @@ rsp_send_next(struct context *ctx, struct conn *conn)
         pmsg->peer = msg;
         stats_pool_incr(ctx, conn->owner, forward_error);
     } else {
+        if (pmsg->partial) {
+            rsp_put_partial(ctx, conn, pmsg);
+        }
         msg = pmsg->peer;
     }
     ASSERT(!msg->request);
@@ -494,6 +627,7 @@ void
 rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
 {
     struct msg *pmsg; /* peer message (request) */
+    struct mbuf *mbuf;
 
     ASSERT(conn->client && !conn->proxy);
     ASSERT(conn->smsg == NULL);
@@ -506,8 +640,21 @@ rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(pmsg->peer == msg);
     ASSERT(pmsg->done && !pmsg->swallow);
 
+    if (pmsg->stream) {
+        /* release the head of a streamed response once it is on the wire */
+        while ((mbuf = STAILQ_FIRST(&msg->mhdr)) != NULL && mbuf_empty(mbuf)) {
+            mbuf_remove(&msg->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+
+        if (!req_done(conn, pmsg) || !STAILQ_EMPTY(&msg->mhdr)) {
+            /* rest of the response is yet to be coalesced or sent */
+            return;
+        }
+    }
+
     /* dequeue request from client outq */
-    conn->dequeue_outq(ctx, conn, pmsg);
+    conn->ops->dequeue_outq(ctx, conn, pmsg);
   	req_put(pmsg);
 
 }
@@ -586,7 +733,7 @@ rsp_send_done_proxy_adm(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(pmsg->done && !pmsg->swallow);
 
     /* dequeue request from client outq */
-    conn->dequeue_outq(ctx, conn, pmsg);
+    conn->ops->dequeue_outq(ctx, conn, pmsg);
   	req_put_proxy_adm(pmsg);
 }
 
@@ -241,12 +241,28 @@ server_each_disconnect(void *elem, void *data)
         ASSERT(server->ns_conn_q > 0);
 
         conn = TAILQ_FIRST(&server->s_conn_q);
-        conn->close(pool->ctx, conn);
+        conn->ops->close(pool->ctx, conn);
     }
 
     return NC_OK;
 }
 
+/*
+ * Arm the rebuild timer of the pool for the time when the first ejected
+ * server is due for a retry, or disarm it when no server is ejected
+ */
+static void
+server_pool_retry_arm(struct server_pool *pool)
+{
+    if (pool->next_rebuild == 0LL) {
+        timer_del(&pool->retry_timer);
+        return;
+    }
+
+    timer_add(&pool->ctx->timer, &pool->retry_timer,
+              pool->next_rebuild / 1000LL + 1);
+}
+
 static void
 server_failure(struct context *ctx, struct server *server)
 {
@@ -291,7 +307,11 @@ server_failure(struct context *ctx, struct server *server)
     if (status != NC_OK) {
         log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
                   pool->name.len, pool->name.data, strerror(errno));
+        /* try again at the next retry timeout */
+        pool->next_rebuild = now + pool->server_retry_timeout;
     }
+
+    server_pool_retry_arm(pool);
 }
 
 static void
@@ -330,6 +350,7 @@ void
 server_close(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
+    struct server *server = conn->owner;
     struct msg *msg, *nmsg; /* current and next message */
     struct conn *c_conn;    /* peer client connection */
 
@@ -340,7 +361,7 @@ server_close(struct context *ctx, struct conn *conn)
 
     if (conn->sd < 0) {		
         server_failure(ctx, conn->owner);
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -349,7 +370,11 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server inq */
-        conn->dequeue_inq(ctx, conn, msg);
+        conn->ops->dequeue_inq(ctx, conn, msg);
+
+        if (msg->collapse) {
+            req_collapse_done(ctx, server->owner, msg, NULL, conn->err);
+        }
 
         /*
          * Don't send any error response, if
@@ -371,12 +396,12 @@ server_close(struct context *ctx, struct conn *conn)
             msg->done = 1;
 
             if (msg->frag_owner != NULL) {
-                msg->frag_owner->nfrag_done++;
+                msg->frag_owner->cold->nfrag_done++;
+                req_forward_frag(ctx, msg);
             }
 
             if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-
-                event_add_out(ctx->evb, msg->owner);
+                core_dirty(ctx, c_conn);
             }
 
             log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
@@ -391,7 +416,11 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
+
+        if (msg->collapse) {
+            req_collapse_done(ctx, server->owner, msg, NULL, conn->err);
+        }
 
         if (msg->swallow) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
@@ -406,12 +435,12 @@ server_close(struct context *ctx, struct conn *conn)
 			msg->done = 1;
 			
             if (msg->frag_owner != NULL) {
-                msg->frag_owner->nfrag_done++;
+                msg->frag_owner->cold->nfrag_done++;
+                req_forward_frag(ctx, msg);
             }
 
             if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-
-                event_add_out(ctx->evb, msg->owner);
+                core_dirty(ctx, c_conn);
             }
 
             log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
@@ -440,7 +469,7 @@ server_close(struct context *ctx, struct conn *conn)
 
     server_failure(ctx, conn->owner);
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -562,33 +591,18 @@ server_ok(struct context *ctx, struct conn *conn)
     }
 }
 
-static rstatus_t
-server_pool_update(struct server_pool *pool)
+/*
+ * Rebuild the distribution once the retry timeout of an ejected server
+ * expires, so that the server is added back to the pool
+ */
+void
+server_pool_retry(struct context *ctx, struct timer *timer)
 {
+    struct server_pool *pool = timer->data;
     rstatus_t status;
-    int64_t now;
     uint32_t pnlive_server; /* prev # live server */
 
-    if (!pool->auto_eject_hosts) {
-        return NC_OK;
-    }
-
-    if (pool->next_rebuild == 0LL) {
-        return NC_OK;
-    }
-
-    now = nc_usec_now();
-    if (now < 0) {
-        return NC_ERROR;
-    }
-
-    if (now <= pool->next_rebuild) {
-        if (pool->nlive_server == 0) {
-            errno = ECONNREFUSED;
-            return NC_ERROR;
-        }
-        return NC_OK;
-    }
+    ASSERT(pool->ctx == ctx);
 
     pnlive_server = pool->nlive_server;
 
@@ -596,13 +610,34 @@ server_pool_update(struct server_pool *pool)
     if (status != NC_OK) {
         log_error("updating pool %"PRIu32" with dist %d failed: %s", pool->idx,
                   pool->dist_type, strerror(errno));
-        return status;
+        /* try again at the next retry timeout */
+        pool->next_rebuild = nc_usec_now() + pool->server_retry_timeout;
+    } else {
+        log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to add %"PRIu32
+                  " servers", pool->idx, pool->name.len, pool->name.data,
+                  pool->nlive_server - pnlive_server);
     }
 
-    log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to add %"PRIu32" servers",
-              pool->idx, pool->name.len, pool->name.data,
-              pool->nlive_server - pnlive_server);
+    server_pool_retry_arm(pool);
+}
+
+static rstatus_t
+server_pool_update(struct server_pool *pool)
+{
+    if (!pool->auto_eject_hosts) {
+        return NC_OK;
+    }
+
+    if (pool->next_rebuild == 0LL) {
+        return NC_OK;
+    }
+
+    /* ejected servers are added back by server_pool_retry() */
 
+    if (pool->nlive_server == 0) {
+        errno = ECONNREFUSED;
+        return NC_ERROR;
+    }
 
     return NC_OK;
 }
@@ -624,6 +659,31 @@ server_pool_hash(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     return pool->key_hash((char *)key, keylen);
 }
 
+/*
+ * If hash_tag: is configured for this server pool, narrow key to the part
+ * of it within the hash tag, which is the input to the distributor.
+ * Otherwise the full key is used
+ */
+void
+server_pool_hash_tag(struct server_pool *pool, uint8_t **key, uint32_t *keylen)
+{
+    struct string *tag = &pool->hash_tag;
+    uint8_t *tag_start, *tag_end;
+
+    if (string_empty(tag)) {
+        return;
+    }
+
+    tag_start = nc_strchr(*key, *key + *keylen, tag->data[0]);
+    if (tag_start != NULL) {
+        tag_end = nc_strchr(tag_start + 1, *key + *keylen, tag->data[1]);
+        if ((tag_end != NULL) && (tag_end - tag_start > 1)) {
+            *key = tag_start + 1;
+            *keylen = (uint32_t)(tag_end - *key);
+        }
+    }
+}
+
 uint32_t
 server_pool_idx(struct server_pool *pool, uint8_t *key, uint32_t keylen)
 {
@@ -632,24 +692,7 @@ server_pool_idx(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     ASSERT(array_n(&pool->server) != 0);
     ASSERT(key != NULL);
 
-    /*
-     * If hash_tag: is configured for this server pool, we use the part of
-     * the key within the hash tag as an input to the distributor. Otherwise
-     * we use the full key
-     */
-    if (!string_empty(&pool->hash_tag)) {
-        struct string *tag = &pool->hash_tag;
-        uint8_t *tag_start, *tag_end;
-
-        tag_start = nc_strchr(key, key + keylen, tag->data[0]);
-        if (tag_start != NULL) {
-            tag_end = nc_strchr(tag_start + 1, key + keylen, tag->data[1]);
-            if ((tag_end != NULL) && (tag_end - tag_start > 1)) {
-                key = tag_start + 1;
-                keylen = (uint32_t)(tag_end - key);
-            }
-        }
-    }
+    server_pool_hash_tag(pool, &key, &keylen);
 
     switch (pool->dist_type) {
     case DIST_KETAMA:
@@ -741,7 +784,7 @@ server_pool_conn_for_replace(struct context *ctx, struct server_pool *pool, stru
 	uint8_t *p, *q, *last;
 	uint32_t i;
 
-	curr_ser = array_get(&pool->server, msg->mser_idx);
+	curr_ser = array_get(&pool->server, msg->cold->mser_idx);
 
 	log_debug(LOG_DEBUG, "curr_ser->name : %s", curr_ser->name.data);
 	
@@ -756,7 +799,7 @@ server_pool_conn_for_replace(struct context *ctx, struct server_pool *pool, stru
 	string_init(&weight_str);
 	string_init(&new_ser_host);
 
-	kp = array_get(msg->keys, 1);
+	kp = array_get(&msg->keys, 1);
 	new_ser_addr.data = kp->start;
 	new_ser_addr.len = (uint32_t)(kp->end - kp->start);
 	log_debug(LOG_DEBUG, "new_ser_addr.len : %d", new_ser_addr.len);
@@ -865,7 +908,7 @@ server_pool_conn_for_replace(struct context *ctx, struct server_pool *pool, stru
 		string_deinit(&new_ser_host);
 	}
 
-	msg->server = new_ser;
+	msg->cold->server = new_ser;
 
 	conn->replace_server = 1;
 	conn->conf_version_curr = ctx->conf_version;
@@ -1095,6 +1138,24 @@ server_pool_deinit(struct array *server_pool)
         }
 
         server_deinit(&sp->server);
+
+        if (sp->cache != NULL) {
+            cache_destroy(sp->cache);
+            sp->cache = NULL;
+        }
+
+        if (sp->collapse != NULL) {
+            nc_free(sp->collapse);
+            sp->collapse = NULL;
+        }
+
+        if (sp->mem_usage != NULL) {
+            /* mbufs still charged to the pool keep the usage alive */
+            mbuf_usage_put(sp->mem_usage);
+            sp->mem_usage = NULL;
+        }
+
+        timer_del(&sp->retry_timer);
 		
         log_debug(LOG_DEBUG, "deinit pool %"PRIu32" '%.*s'", sp->idx,
                   sp->name.len, sp->name.data);
@@ -1209,6 +1270,8 @@ server_pool_each_conn_old_close(void *elem, void *data)
 
 	ctx = sp_old->ctx;
 	ASSERT(ctx != NULL);
+
+    timer_del(&sp_old->retry_timer);
 	
 	for (i = 0, nelem = array_n(sps); i < nelem; i++) 
 	{
@@ -1245,7 +1308,7 @@ server_pool_each_conn_old_close(void *elem, void *data)
 	                 c_conn->sd, strerror(errno));
 	    }
 
-		c_conn->close(ctx, c_conn);
+		c_conn->ops->close(ctx, c_conn);
 
 		log_debug(LOG_INFO, "c_conn(%d) removed", c_conn->sd);
 	}
@@ -1271,7 +1334,7 @@ server_close:
 		                 s_conn->sd, strerror(errno));
 		    }
 
-	        s_conn->close(ctx, s_conn);
+	        s_conn->ops->close(ctx, s_conn);
 			
 			log_debug(LOG_INFO, "s_conn(%d) removed", s_conn->sd);
 	    }
@@ -1385,7 +1448,7 @@ server_pool_old_deinit(struct array *sps, struct context *ctx)
 		        log_warn("event del conn client %d failed, ignored: %s",
 		                 pconn->sd, strerror(errno));
 		    }
-			pconn->close(ctx, pconn);
+			pconn->ops->close(ctx, pconn);
 		}		
 
 		for (i = 0, nelem = array_n(&sp->server); i < nelem; i++) 
@@ -1396,7 +1459,7 @@ server_pool_old_deinit(struct array *sps, struct context *ctx)
 			conn = pconn) {
 				pconn = TAILQ_PREV(conn, conn_tqh, conn_tqe);
 
-				if(!conn->active(conn))
+				if(!conn->ops->active(conn))
 				{
 					status = event_del_conn(ctx->evb, conn);
 				    if (status < 0) {
@@ -1405,7 +1468,7 @@ server_pool_old_deinit(struct array *sps, struct context *ctx)
 				    }
 				
 					log_debug(LOG_INFO, "s_conn(%d) closed in old pool", conn->sd);
-					conn->close(ctx, conn);
+					conn->ops->close(ctx, conn);
 				}
 				else
 				{
@@ -103,6 +103,7 @@ struct server_pool {
     struct continuum   *continuum;           /* continuum */
     uint32_t           nlive_server;         /* # live server */
     int64_t            next_rebuild;         /* next distribution rebuild time in usec */
+    struct timer       retry_timer;          /* distribution rebuild timer */
 
     struct string      name;                 /* pool name (ref in conf_pool) */
     struct string      addrstr;              /* pool address (ref in conf_pool) */
@@ -125,6 +126,17 @@ struct server_pool {
     unsigned           preconnect:1;         /* preconnect? */
     unsigned           redis:1;              /* redis? */
 
+    size_t             mem_budget;           /* memory budget in bytes, 0 if unlimited */
+    struct mbuf_usage  *mem_usage;           /* bytes of mbufs charged to the pool */
+    size_t             mem_reported;         /* mem_usage last reported to stats */
+    unsigned           mem_throttled:1;      /* client reads paused? */
+
+    uint32_t           max_keys_per_fragment; /* max # keys in a fragment, 0 if unbounded */
+    unsigned           partial_mget:1;       /* failed fragments of mget / get are misses? */
+
+    struct cache       *cache;               /* hot key response cache, NULL if disabled */
+    struct msg         **collapse;           /* in-flight reads others collapse into, by key slot, NULL if disabled */
+
 #if 1 //shenzheng 2015-6-5 tcpkeepalive
 	unsigned           tcpkeepalive:1;       /* tcp keepalive? */
 	int				   tcpkeepidle;			 /* tcpkeep idle */
@@ -146,6 +158,7 @@ void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
 
+void server_pool_hash_tag(struct server_pool *pool, uint8_t **key, uint32_t *keylen);
 uint32_t server_pool_idx(struct server_pool *pool, uint8_t *key, uint32_t keylen);
 struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen);
 
@@ -155,6 +168,7 @@ void server_close_for_replace_server(struct server *server);
 #endif //shenzheng 2015-6-25 replace server
 
 rstatus_t server_pool_run(struct server_pool *pool);
+void server_pool_retry(struct context *ctx, struct timer *timer);
 rstatus_t server_pool_preconnect(struct context *ctx);
 void server_pool_disconnect(struct context *ctx);
 rstatus_t server_pool_init(struct array *server_pool, struct array *conf_pool, struct context *ctx);
@@ -369,6 +369,46 @@ stats_create_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    size += st->nmem_used_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nmem_throttled_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_msg_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_mbuf_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_conn_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_msg_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_mbuf_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_conn_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->arena_size_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->arena_used_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
 #if 1 //shenzheng 2015-7-9 proxy administer
 	size += st->ncurr_conn_str_a.len;
     size += int64_max_digits;
@@ -379,18 +419,10 @@ stats_create_buf(struct stats *st)
 #ifdef NC_DEBUG_LOG
 	size += st->ntotal_msg_str.len;
     size += int64_max_digits;
-    size += key_value_extra;
-
-	size += st->nfree_msg_str.len;
-    size += int64_max_digits;
     size += key_value_extra;
 
 	size += st->ntotal_mbuf_str.len;
     size += int64_max_digits;
-    size += key_value_extra;
-
-	size += st->nfree_mbuf_str.len;
-    size += int64_max_digits;
     size += key_value_extra;
 #endif
 #endif //shenzheng 2015-3-23 common
@@ -523,12 +555,50 @@ stats_add_num(struct stats *st, struct string *key, int64_t val)
     return NC_OK;
 }
 
+/*
+ * Sum up the thread local free list counters of all workers, as sampled
+ * by each worker thread in stats_swap()
+ */
+static void
+stats_alloc_sum(struct stats *st, struct stats_alloc *sum)
+{
+    uint32_t i;
+
+    *sum = st->alloc;
+
+    pthread_mutex_lock(&st->worker_lock);
+
+    for (i = 0; i < array_n(&st->worker); i++) {
+        struct stats *wst = *(struct stats **)array_get(&st->worker, i);
+
+        if (wst == NULL) {
+            continue;
+        }
+
+        sum->nfree_msg += wst->alloc.nfree_msg;
+        sum->nfree_mbuf += wst->alloc.nfree_mbuf;
+        sum->nfree_conn += wst->alloc.nfree_conn;
+        sum->npeak_msg += wst->alloc.npeak_msg;
+        sum->npeak_mbuf += wst->alloc.npeak_mbuf;
+        sum->npeak_conn += wst->alloc.npeak_conn;
+        sum->arena_size += wst->alloc.arena_size;
+        sum->arena_used += wst->alloc.arena_used;
+#ifdef NC_DEBUG_LOG
+        sum->ntotal_msg += wst->alloc.ntotal_msg;
+        sum->ntotal_mbuf += wst->alloc.ntotal_mbuf;
+#endif
+    }
+
+    pthread_mutex_unlock(&st->worker_lock);
+}
+
 static rstatus_t
 stats_add_header(struct stats *st)
 {
     rstatus_t status;
     struct stats_buffer *buf;
     int64_t cur_ts, uptime;
+    struct stats_alloc alloc;
 
     buf = &st->buf;
     buf->data[0] = '{';
@@ -537,6 +607,8 @@ stats_add_header(struct stats *st)
     cur_ts = (int64_t)time(NULL);
     uptime = cur_ts - st->start_ts;
 
+    stats_alloc_sum(st, &alloc);
+
     status = stats_add_string(st, &st->service_str, &st->service);
     if (status != NC_OK) {
         return status;
@@ -572,31 +644,72 @@ stats_add_header(struct stats *st)
         return status;
     }
 
-#if 1 //shenzheng 2015-7-9 proxy administer
-	status = stats_add_num(st, &st->ncurr_conn_str_a, conn_ncurr_conn_proxy_adm());
+    status = stats_add_num(st, &st->nmem_used_str, (int64_t)core_mem_used());
     if (status != NC_OK) {
         return status;
     }
-#endif //shenzheng 2015-7-9 proxy administer
 
-#if 1 //shenzheng 2015-3-23 common
-#ifdef NC_DEBUG_LOG
-	status = stats_add_num(st, &st->ntotal_msg_str, msg_ntotal_msg());
+    status = stats_add_num(st, &st->nmem_throttled_str,
+                           (int64_t)core_mem_nthrottled());
     if (status != NC_OK) {
         return status;
     }
 
-	status = stats_add_num(st, &st->nfree_msg_str, msg_nfree_msg());
+    status = stats_add_num(st, &st->nfree_msg_str, (int64_t)alloc.nfree_msg);
     if (status != NC_OK) {
         return status;
     }
 
-	status = stats_add_num(st, &st->ntotal_mbuf_str, mbuf_ntotal_mbuf());
+    status = stats_add_num(st, &st->nfree_mbuf_str, (int64_t)alloc.nfree_mbuf);
     if (status != NC_OK) {
         return status;
     }
 
-	status = stats_add_num(st, &st->nfree_mbuf_str, mbuf_nfree_mbuf());
+    status = stats_add_num(st, &st->nfree_conn_str, (int64_t)alloc.nfree_conn);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->npeak_msg_str, (int64_t)alloc.npeak_msg);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->npeak_mbuf_str, (int64_t)alloc.npeak_mbuf);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->npeak_conn_str, (int64_t)alloc.npeak_conn);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->arena_size_str, (int64_t)alloc.arena_size);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->arena_used_str, (int64_t)alloc.arena_used);
+    if (status != NC_OK) {
+        return status;
+    }
+
+#if 1 //shenzheng 2015-7-9 proxy administer
+	status = stats_add_num(st, &st->ncurr_conn_str_a, conn_ncurr_conn_proxy_adm());
+    if (status != NC_OK) {
+        return status;
+    }
+#endif //shenzheng 2015-7-9 proxy administer
+
+#if 1 //shenzheng 2015-3-23 common
+#ifdef NC_DEBUG_LOG
+	status = stats_add_num(st, &st->ntotal_msg_str, (int64_t)alloc.ntotal_msg);
+    if (status != NC_OK) {
+        return status;
+    }
+
+	status = stats_add_num(st, &st->ntotal_mbuf_str, (int64_t)alloc.ntotal_mbuf);
     if (status != NC_OK) {
         return status;
     }
@@ -769,24 +882,18 @@ stats_aggregate_metric(struct array *dst, struct array *src)
 }
 
 static void
-stats_aggregate(struct stats *st)
+stats_aggregate_shadow(struct stats *st, struct stats *src)
 {
     uint32_t i;
 
-    if (st->aggregate == 0) {
-        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
-        return;
-    }
-
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
+    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", src->shadow.elem,
               st->sum.elem);
 
-    for (i = 0; i < array_n(&st->shadow); i++) {
+    for (i = 0; i < array_n(&src->shadow); i++) {
         struct stats_pool *stp1, *stp2;
         uint32_t j;
 
-        stp1 = array_get(&st->shadow, i);
+        stp1 = array_get(&src->shadow, i);
         stp2 = array_get(&st->sum, i);
         stats_aggregate_metric(&stp2->metric, &stp1->metric);
 
@@ -799,7 +906,38 @@ stats_aggregate(struct stats *st)
         }
     }
 
-    st->aggregate = 0;
+    src->aggregate = 0;
+}
+
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i;
+
+    if (st->aggregate == 0) {
+        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
+                  "generator is slow", st->shadow.elem, st->sum.elem);
+    } else {
+        stats_aggregate_shadow(st, st);
+    }
+
+    /*
+     * Fold the shadow (b) of every other worker into our sum (c). The lock
+     * keeps a worker from unmapping its shadow while we fold it.
+     */
+    pthread_mutex_lock(&st->worker_lock);
+
+    for (i = 0; i < array_n(&st->worker); i++) {
+        struct stats *wst = *(struct stats **)array_get(&st->worker, i);
+
+        if (wst == NULL || wst->aggregate == 0) {
+            continue;
+        }
+
+        stats_aggregate_shadow(st, wst);
+    }
+
+    pthread_mutex_unlock(&st->worker_lock);
 }
 
 static rstatus_t
@@ -1055,28 +1193,43 @@ stats_start_aggregator(struct stats *st)
     status = pthread_create(&st->tid, NULL, stats_loop, st);
     if (status < 0) {
         log_error("stats aggregator create failed: %s", strerror(status));
+        st->tid = (pthread_t) -1;
         return NC_ERROR;
     }
 
     return NC_OK;
 }
 
-static void
+/*
+ * Stop the aggregator thread of the first worker and wait for it to exit,
+ * so that it no longer reads the stats of the other workers. Shutting the
+ * monitoring descriptor down wakes the thread up from its wait.
+ */
+void
 stats_stop_aggregator(struct stats *st)
 {
-    if (!stats_enabled) {
+    if (!stats_enabled || st->leader != NULL || st->sd < 0) {
         return;
     }
 
+    if (st->tid != (pthread_t) -1) {
+        st->quit = 1;
+        shutdown(st->sd, SHUT_RDWR);
+        pthread_join(st->tid, NULL);
+        st->tid = (pthread_t) -1;
+    }
+
     close(st->sd);
+    st->sd = -1;
 }
 
 struct stats *
 stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
-             char *source, struct array *server_pool)
+             char *source, uint32_t nworker, struct array *server_pool)
 {
     rstatus_t status;
     struct stats *st;
+    uint32_t i;
 
     st = nc_alloc(sizeof(*st));
     if (st == NULL) {
@@ -1099,6 +1252,9 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
 
     st->tid = (pthread_t) -1;
     st->sd = -1;
+    st->quit = 0;
+
+    pthread_mutex_init(&st->worker_lock, NULL);
 
     string_set_text(&st->service_str, "service");
     string_set_text(&st->service, "nutcracker");
@@ -1114,6 +1270,16 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
 
     string_set_text(&st->ntotal_conn_str, "total_connections");
     string_set_text(&st->ncurr_conn_str, "curr_connections");
+    string_set_text(&st->nmem_used_str, "mem_used");
+    string_set_text(&st->nmem_throttled_str, "mem_throttled");
+    string_set_text(&st->nfree_msg_str, "free_msgs");
+    string_set_text(&st->nfree_mbuf_str, "free_mbufs");
+    string_set_text(&st->nfree_conn_str, "free_conns");
+    string_set_text(&st->npeak_msg_str, "peak_free_msgs");
+    string_set_text(&st->npeak_mbuf_str, "peak_free_mbufs");
+    string_set_text(&st->npeak_conn_str, "peak_free_conns");
+    string_set_text(&st->arena_size_str, "mbuf_arena_size");
+    string_set_text(&st->arena_used_str, "mbuf_arena_used");
 
 #if 1 //shenzheng 2015-7-9 proxy administer
 	string_set_text(&st->ncurr_conn_str_a, "curr_connections_a");
@@ -1122,9 +1288,7 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
 	string_set_text(&st->ntotal_msg_str, "total_msgs");
-    string_set_text(&st->nfree_msg_str, "free_msgs");
 	string_set_text(&st->ntotal_mbuf_str, "total_mbufs");
-    string_set_text(&st->nfree_mbuf_str, "free_mbufs");
 #endif
 #endif //shenzheng 2015-3-23 common
 
@@ -1140,6 +1304,29 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
     st->updated = 0;
     st->aggregate = 0;
 
+    st->leader = NULL;
+    st->widx = 0;
+
+    memset(&st->alloc, 0, sizeof(st->alloc));
+
+    /*
+     * Reserve a slot for the stats of every other worker before the
+     * aggregator starts, so that registering a worker never reallocates
+     * the array under the aggregator thread
+     */
+    array_null(&st->worker);
+    if (nworker > 1) {
+        status = array_init(&st->worker, nworker - 1, sizeof(struct stats *));
+        if (status != NC_OK) {
+            goto error;
+        }
+
+        for (i = 1; i < nworker; i++) {
+            struct stats **wst = array_push(&st->worker);
+            *wst = NULL;
+        }
+    }
+
     /* map server pool to current (a), shadow (b) and sum (c) */
 
     status = stats_pool_map(&st->current, server_pool);
@@ -1180,10 +1367,85 @@ error:
     return NULL;
 }
 
+/*
+ * Create stats for a worker other than the first one. The worker only
+ * swaps its current (a) into shadow (b); the aggregator thread of the
+ * leader folds that shadow into the sum (c) it reports.
+ */
+struct stats *
+stats_create_worker(struct stats *leader, uint32_t widx,
+                    struct array *server_pool)
+{
+    rstatus_t status;
+    struct stats *st;
+
+    ASSERT(widx > 0 && widx <= array_n(&leader->worker));
+
+    st = nc_zalloc(sizeof(*st));
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->port = leader->port;
+    st->interval = leader->interval;
+    st->addr = leader->addr;
+    st->start_ts = leader->start_ts;
+    st->tid = (pthread_t) -1;
+    st->sd = -1;
+    st->leader = leader;
+
+    array_null(&st->current);
+    array_null(&st->shadow);
+    array_null(&st->sum);
+    array_null(&st->worker);
+
+    st->updated = 0;
+    st->aggregate = 0;
+
+    status = stats_pool_map(&st->current, server_pool);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    status = stats_pool_map(&st->shadow, server_pool);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    st->widx = widx;
+
+    pthread_mutex_lock(&leader->worker_lock);
+    *(struct stats **)array_get(&leader->worker, widx - 1) = st;
+    pthread_mutex_unlock(&leader->worker_lock);
+
+    return st;
+
+error:
+    stats_destroy(st);
+    return NULL;
+}
+
 void
 stats_destroy(struct stats *st)
 {
-    stats_stop_aggregator(st);
+    uint32_t i, n;
+
+    if (st->leader != NULL) {
+        if (st->widx != 0) {
+            pthread_mutex_lock(&st->leader->worker_lock);
+            *(struct stats **)array_get(&st->leader->worker, st->widx - 1) = NULL;
+            pthread_mutex_unlock(&st->leader->worker_lock);
+        }
+    } else {
+        stats_stop_aggregator(st);
+        pthread_mutex_destroy(&st->worker_lock);
+    }
+
+    for (i = 0, n = array_n(&st->worker); i < n; i++) {
+        array_pop(&st->worker);
+    }
+    array_deinit(&st->worker);
+
     stats_pool_unmap(&st->sum);
     stats_pool_unmap(&st->shadow);
     stats_pool_unmap(&st->current);
@@ -1198,6 +1460,20 @@ stats_swap(struct stats *st)
         return;
     }
 
+    /* sample the thread local counters for the aggregator thread */
+    st->alloc.nfree_msg = msg_nfree_msg();
+    st->alloc.nfree_mbuf = mbuf_nfree_mbuf();
+    st->alloc.nfree_conn = conn_nfree_conn();
+    st->alloc.npeak_msg = msg_nfree_msg_peak();
+    st->alloc.npeak_mbuf = mbuf_nfree_mbuf_peak();
+    st->alloc.npeak_conn = conn_nfree_conn_peak();
+    st->alloc.arena_size = mbuf_arena_size();
+    st->alloc.arena_used = mbuf_arena_used();
+#ifdef NC_DEBUG_LOG
+    st->alloc.ntotal_msg = msg_ntotal_msg();
+    st->alloc.ntotal_mbuf = mbuf_ntotal_mbuf();
+#endif
+
 #if 1 //shenzheng 2015-5-15 config-reload
 	if(st->pause)
 	{
@@ -1600,6 +1876,16 @@ stats_recreate_old(struct context *ctx, struct array *server_pool)
 
     string_set_text(&st->ntotal_conn_str, "total_connections");
     string_set_text(&st->ncurr_conn_str, "curr_connections");
+    string_set_text(&st->nmem_used_str, "mem_used");
+    string_set_text(&st->nmem_throttled_str, "mem_throttled");
+    string_set_text(&st->nfree_msg_str, "free_msgs");
+    string_set_text(&st->nfree_mbuf_str, "free_mbufs");
+    string_set_text(&st->nfree_conn_str, "free_conns");
+    string_set_text(&st->npeak_msg_str, "peak_free_msgs");
+    string_set_text(&st->npeak_mbuf_str, "peak_free_mbufs");
+    string_set_text(&st->npeak_conn_str, "peak_free_conns");
+    string_set_text(&st->arena_size_str, "mbuf_arena_size");
+    string_set_text(&st->arena_used_str, "mbuf_arena_used");
 	
 #if 1 //shenzheng 2015-7-9 proxy administer
 	string_set_text(&st->ncurr_conn_str_a, "curr_connections_a");
@@ -1608,9 +1894,7 @@ stats_recreate_old(struct context *ctx, struct array *server_pool)
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
 	string_set_text(&st->ntotal_msg_str, "total_msgs");
-    string_set_text(&st->nfree_msg_str, "free_msgs");
 	string_set_text(&st->ntotal_mbuf_str, "total_mbufs");
-    string_set_text(&st->nfree_mbuf_str, "free_mbufs");
 #endif
 #endif //shenzheng 2015-3-23 common
 
@@ -1706,6 +1990,46 @@ stats_recreate_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    size += st->nmem_used_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nmem_throttled_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_msg_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_mbuf_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nfree_conn_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_msg_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_mbuf_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->npeak_conn_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->arena_size_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->arena_used_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
 #if 1 //shenzheng 2015-7-9 proxy administer
 	size += st->ncurr_conn_str_a.len;
     size += int64_max_digits;
@@ -1716,18 +2040,10 @@ stats_recreate_buf(struct stats *st)
 #ifdef NC_DEBUG_LOG
 	size += st->ntotal_msg_str.len;
     size += int64_max_digits;
-    size += key_value_extra;
-
-	size += st->nfree_msg_str.len;
-    size += int64_max_digits;
     size += key_value_extra;
 
 	size += st->ntotal_mbuf_str.len;
     size += int64_max_digits;
-    size += key_value_extra;
-
-	size += st->nfree_mbuf_str.len;
-    size += int64_max_digits;
     size += key_value_extra;
 #endif
 #endif //shenzheng 2015-3-23 common
@@ -25,11 +25,21 @@
     ACTION( client_eof,             STATS_COUNTER,      "# eof on client connections")                              \
     ACTION( client_err,             STATS_COUNTER,      "# errors on client connections")                           \
     ACTION( client_connections,     STATS_GAUGE,        "# active client connections")                              \
+    ACTION( client_throttled,       STATS_COUNTER,      "# times client reads were paused by the memory budget")    \
+    /* memory behavior */                                                                                           \
+    ACTION( mem_used,               STATS_GAUGE,        "current bytes of mbufs held by the pool")                  \
     /* pool behavior */                                                                                             \
     ACTION( server_ejects,          STATS_COUNTER,      "# times backend server was ejected")                       \
     /* forwarder behavior */                                                                                        \
     ACTION( forward_error,          STATS_COUNTER,      "# times we encountered a forwarding error")                \
     ACTION( fragments,              STATS_COUNTER,      "# fragments created from a multi-vector request")          \
+    ACTION( partial_responses,      STATS_COUNTER,      "# mget / get responses with misses for failed fragments")  \
+    /* hot key cache behavior */                                                                                    \
+    ACTION( hot_cache_hits,         STATS_COUNTER,      "# reads answered from the hot key cache")                  \
+    ACTION( hot_cache_misses,       STATS_COUNTER,      "# cacheable reads not found in the hot key cache")         \
+    ACTION( hot_cache_evictions,    STATS_COUNTER,      "# live entries evicted from the hot key cache")            \
+    ACTION( hot_cache_bytes,        STATS_GAUGE,        "current bytes held by the hot key cache")                  \
+    ACTION( collapse_hits,          STATS_COUNTER,      "# reads answered with the response of an identical read")  \
 
 #define STATS_SERVER_CODEC(ACTION)                                                                                  \
     /* server behavior */                                                                                           \
@@ -60,6 +70,25 @@ typedef enum stats_type {
     STATS_SENTINEL
 } stats_type_t;
 
+/*
+ * Allocator counters of a worker thread, sampled by the worker itself in
+ * stats_swap() for the aggregator thread
+ */
+struct stats_alloc {
+    uint32_t nfree_msg;       /* # free msgs */
+    uint32_t nfree_mbuf;      /* # free mbufs */
+    uint32_t nfree_conn;      /* # free conns */
+    uint32_t npeak_msg;       /* max # free msgs */
+    uint32_t npeak_mbuf;      /* max # free mbufs */
+    uint32_t npeak_conn;      /* max # free conns */
+    uint64_t arena_size;      /* # bytes of mbuf arena regions */
+    uint64_t arena_used;      /* # bytes of mbuf arena regions in use */
+#ifdef NC_DEBUG_LOG
+    uint64_t ntotal_msg;      /* # total msgs */
+    uint64_t ntotal_mbuf;     /* # total mbufs */
+#endif
+};
+
 struct stats_metric {
     stats_type_t  type;         /* type */
     struct string name;         /* name (ref) */
@@ -111,6 +140,16 @@ struct stats {
     struct string       timestamp_str;   /* timestamp string */
     struct string       ntotal_conn_str; /* total connections string */
     struct string       ncurr_conn_str;  /* curr connections string */
+    struct string       nmem_used_str;   /* memory used string */
+    struct string       nmem_throttled_str; /* memory throttled string */
+    struct string       nfree_msg_str;   /* free msgs string */
+    struct string       nfree_mbuf_str;  /* free mbufs string */
+    struct string       nfree_conn_str;  /* free conns string */
+    struct string       npeak_msg_str;   /* peak free msgs string */
+    struct string       npeak_mbuf_str;  /* peak free mbufs string */
+    struct string       npeak_conn_str;  /* peak free conns string */
+    struct string       arena_size_str;  /* mbuf arena size string */
+    struct string       arena_used_str;  /* mbuf arena used string */
 
 #if 1 //shenzheng 2015-7-9 proxy administer
 	struct string       ncurr_conn_str_a;  /* curr connections string for proxy administer */
@@ -119,9 +158,7 @@ struct stats {
 #if 1 //shenzheng 2015-3-23 common
 #ifdef NC_DEBUG_LOG
 	struct string		ntotal_msg_str;	 /* total msgs string */
-	struct string		nfree_msg_str;	 /* free msgs string */
 	struct string		ntotal_mbuf_str; /* total mbufs string */
-	struct string		nfree_mbuf_str;	 /* free mbufs string */	
 #endif
 #endif //shenzheng 2015-3-23 common
 
@@ -137,6 +174,15 @@ struct stats {
     volatile int        aggregate;       /* shadow (b) aggregate? */
     volatile int        updated;         /* current (a) updated? */
 
+    volatile int        quit;            /* aggregator asked to quit? */
+
+    pthread_mutex_t     worker_lock;     /* guards worker[] and its stats */
+    struct array        worker;          /* stats *[] of the other workers */
+    struct stats        *leader;         /* stats of the first worker */
+    uint32_t            widx;            /* worker index */
+
+    struct stats_alloc  alloc;           /* free lists of the owner thread */
+
 #if 1 //shenzheng 2015-5-14 config-reload
 	volatile uint8_t    reload_thread:1; /* 0: proxy_adm thread's right to handle reload; 
 										    * 1: stats thread's right to handle reload */
@@ -263,8 +309,10 @@ void _stats_pool_incr_by_anyway(struct context *ctx, struct server_pool *pool, s
 void _stats_server_incr_by_anyway(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 #endif //shenzheng 2015-6-11 config-reload
 
-struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *source, struct array *server_pool);
+struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *source, uint32_t nworker, struct array *server_pool);
+struct stats *stats_create_worker(struct stats *leader, uint32_t widx, struct array *server_pool);
 void stats_destroy(struct stats *stats);
+void stats_stop_aggregator(struct stats *st);
 void stats_swap(struct stats *stats);
 
 #if 1 //shenzheng 2015-5-14 config-reload
@@ -0,0 +1,299 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+#define timer_level_shift(_l)   ((_l) * TIMER_LEVEL_BITS)
+#define timer_level_span(_l)    (1LL << timer_level_shift(_l))
+#define timer_slot_idx(_t, _l)  \
+    ((uint32_t)(((_t) >> timer_level_shift(_l)) & TIMER_LEVEL_MASK))
+
+void
+timer_init(struct timer *timer, timer_handler_t handler, void *data)
+{
+    timer->tle.le_next = NULL;
+    timer->tle.le_prev = NULL;
+    timer->expire = 0LL;
+    timer->handler = handler;
+    timer->data = data;
+}
+
+void
+timer_wheel_init(struct timer_wheel *tw)
+{
+    uint32_t level, idx;
+
+    tw->now = nc_msec_now();
+    tw->stale = 0;
+    tw->tick = tw->now;
+
+    for (level = 0; level < TIMER_NLEVEL; level++) {
+        tw->bitmap[level] = 0ULL;
+        for (idx = 0; idx < TIMER_LEVEL_SIZE; idx++) {
+            LIST_INIT(&tw->slot[level][idx]);
+        }
+    }
+}
+
+/*
+ * Return the cached time in msec. The clock is read at most once per
+ * event loop iteration, on first use after timer_wheel_stale(), so that
+ * arming a timer for every request does not cost a clock read.
+ */
+int64_t
+timer_wheel_now(struct timer_wheel *tw)
+{
+    int64_t now;
+
+    if (tw->stale) {
+        now = nc_msec_now();
+        /* never let the clock go backwards */
+        if (now > tw->now) {
+            tw->now = now;
+        }
+        tw->stale = 0;
+    }
+
+    return tw->now;
+}
+
+void
+timer_wheel_stale(struct timer_wheel *tw)
+{
+    tw->stale = 1;
+}
+
+static void
+timer_link(struct timer_wheel *tw, struct timer *timer)
+{
+    int64_t delta, expire;
+    uint32_t level, idx;
+
+    expire = timer->expire;
+    delta = expire - tw->tick;
+
+    if (delta < 0) {
+        /* already expired; fire on the next tick */
+        expire = tw->tick;
+        delta = 0;
+    } else if (delta >= TIMER_MAX_TICKS) {
+        /* park in the last level; re-queued with its real expiry later */
+        expire = tw->tick + TIMER_MAX_TICKS - 1;
+        delta = TIMER_MAX_TICKS - 1;
+    }
+
+    for (level = 0; level < TIMER_NLEVEL - 1; level++) {
+        if (delta < timer_level_span(level + 1)) {
+            break;
+        }
+    }
+
+    idx = timer_slot_idx(expire, level);
+
+    LIST_INSERT_HEAD(&tw->slot[level][idx], timer, tle);
+    tw->bitmap[level] |= (1ULL << idx);
+}
+
+void
+timer_add(struct timer_wheel *tw, struct timer *timer, int64_t expire)
+{
+    ASSERT(timer->handler != NULL);
+
+    if (timer_armed(timer)) {
+        timer_del(timer);
+    }
+
+    timer->expire = expire;
+    timer_link(tw, timer);
+}
+
+/*
+ * Unlink a timer in O(1). The busy bit of the slot is left behind and
+ * cleared lazily when the wheel visits the slot.
+ */
+void
+timer_del(struct timer *timer)
+{
+    if (!timer_armed(timer)) {
+        return;
+    }
+
+    LIST_REMOVE(timer, tle);
+    timer->tle.le_next = NULL;
+    timer->tle.le_prev = NULL;
+}
+
+static void
+timer_slot_take(struct timer_wheel *tw, uint32_t level, uint32_t idx,
+                struct timer_lh *head)
+{
+    struct timer_lh *slot = &tw->slot[level][idx];
+
+    LIST_INIT(head);
+    LIST_SWAP(head, slot, timer, tle);
+    tw->bitmap[level] &= ~(1ULL << idx);
+}
+
+static void
+timer_cascade(struct timer_wheel *tw, uint32_t level, uint32_t idx)
+{
+    struct timer_lh head;
+    struct timer *timer;
+
+    timer_slot_take(tw, level, idx, &head);
+
+    while ((timer = LIST_FIRST(&head)) != NULL) {
+        LIST_REMOVE(timer, tle);
+        timer_link(tw, timer);
+    }
+}
+
+/*
+ * Fire all timers that expired up to the cached time. Handlers run with
+ * their timer unlinked and may freely add or delete any timer, including
+ * ones that expire in the same tick.
+ */
+void
+timer_wheel_expire(struct context *ctx, struct timer_wheel *tw)
+{
+    int64_t now;
+    uint32_t level;
+
+    now = timer_wheel_now(tw);
+
+    while (tw->tick <= now) {
+        struct timer_lh head;
+        struct timer *timer;
+        uint32_t idx;
+
+        idx = timer_slot_idx(tw->tick, 0);
+
+        if (idx == 0) {
+            for (level = 1; level < TIMER_NLEVEL; level++) {
+                uint32_t lidx = timer_slot_idx(tw->tick, level);
+
+                timer_cascade(tw, level, lidx);
+                if (lidx != 0) {
+                    break;
+                }
+            }
+        }
+
+        if ((tw->bitmap[0] & (1ULL << idx)) != 0) {
+            timer_slot_take(tw, 0, idx, &head);
+        } else {
+            LIST_INIT(&head);
+        }
+
+        /*
+         * Advance before running handlers, so that a timer armed by a
+         * handler is never linked into the slot that was just taken
+         */
+        for (level = 0; level < TIMER_NLEVEL; level++) {
+            if (tw->bitmap[level] != 0) {
+                break;
+            }
+        }
+        if (level == TIMER_NLEVEL) {
+            tw->tick = now + 1;
+        } else if (tw->bitmap[0] != 0) {
+            tw->tick++;
+        } else {
+            /* nothing on level 0; skip ahead to the next cascade */
+            tw->tick = MIN(now + 1, (tw->tick | TIMER_LEVEL_MASK) + 1);
+        }
+
+        while ((timer = LIST_FIRST(&head)) != NULL) {
+            LIST_REMOVE(timer, tle);
+            timer->tle.le_next = NULL;
+            timer->tle.le_prev = NULL;
+
+            if (timer->expire > now) {
+                timer_link(tw, timer);
+                continue;
+            }
+
+            timer->handler(ctx, timer);
+        }
+    }
+}
+
+/*
+ * Return the distance to the first busy slot of a level at or after the
+ * slot at distance 'from' from the current slot 'cur'
+ */
+static uint32_t
+timer_bitmap_next(uint64_t bitmap, uint32_t cur, uint32_t from)
+{
+    uint64_t rot;
+
+    ASSERT(bitmap != 0);
+
+    rot = (cur == 0) ? bitmap :
+          (bitmap >> cur) | (bitmap << (TIMER_LEVEL_SIZE - cur));
+    rot &= ~((1ULL << from) - 1);
+    if (rot == 0) {
+        return TIMER_LEVEL_SIZE;
+    }
+
+    return (uint32_t)__builtin_ctzll(rot);
+}
+
+/*
+ * Return the time in msec until the wheel next needs to be serviced,
+ * capped at max_timeout
+ */
+int
+timer_wheel_timeout(struct timer_wheel *tw, int max_timeout)
+{
+    int64_t next, delta;
+    uint32_t level;
+
+    next = tw->tick + max_timeout;
+
+    for (level = 0; level < TIMER_NLEVEL; level++) {
+        uint32_t cur, from, d;
+        int64_t when, mask;
+
+        if (tw->bitmap[level] == 0) {
+            continue;
+        }
+
+        cur = timer_slot_idx(tw->tick, level);
+
+        /*
+         * On level 0 the current slot is still due. On upper levels the
+         * current slot has already been cascaded, unless the next tick
+         * is exactly where the cascade happens.
+         */
+        mask = timer_level_span(level) - 1;
+        from = (level == 0 || (tw->tick & mask) == 0) ? 0 : 1;
+
+        d = timer_bitmap_next(tw->bitmap[level], cur, from);
+        when = ((tw->tick >> timer_level_shift(level)) + d) <<
+               timer_level_shift(level);
+
+        next = MIN(next, when);
+    }
+
+    delta = next - timer_wheel_now(tw);
+    if (delta < 0) {
+        return 0;
+    }
+
+    return (int)MIN(delta, max_timeout);
+}
@@ -0,0 +1,67 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_TIMER_H_
+#define _NC_TIMER_H_
+
+/*
+ * Hierarchical timer wheel with a resolution of one msec tick. Level 0
+ * holds timers expiring within the next 64 ticks, and every next level
+ * covers 64 times the span of the previous one; timers are moved down
+ * a level (cascaded) when the level below wraps around. Timers further
+ * out than the last level are parked in it and re-queued on cascade.
+ */
+#define TIMER_LEVEL_BITS    6
+#define TIMER_LEVEL_SIZE    (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK    (TIMER_LEVEL_SIZE - 1)
+#define TIMER_NLEVEL        4
+#define TIMER_MAX_TICKS     (1LL << (TIMER_LEVEL_BITS * TIMER_NLEVEL))
+
+struct timer;
+struct context;
+
+typedef void (*timer_handler_t)(struct context *, struct timer *);
+
+struct timer {
+    LIST_ENTRY(timer) tle;     /* link in wheel slot */
+    int64_t           expire;  /* expiry time in msec */
+    timer_handler_t   handler; /* expiry handler */
+    void              *data;   /* opaque data */
+};
+
+LIST_HEAD(timer_lh, timer);
+
+struct timer_wheel {
+    int64_t         now;                               /* cached time in msec */
+    unsigned        stale:1;                           /* cached time stale? */
+    int64_t         tick;                              /* next tick to expire */
+    uint64_t        bitmap[TIMER_NLEVEL];              /* busy slots per level */
+    struct timer_lh slot[TIMER_NLEVEL][TIMER_LEVEL_SIZE]; /* timer lists */
+};
+
+#define timer_armed(_t) ((_t)->tle.le_prev != NULL)
+
+void timer_init(struct timer *timer, timer_handler_t handler, void *data);
+void timer_wheel_init(struct timer_wheel *tw);
+int64_t timer_wheel_now(struct timer_wheel *tw);
+void timer_wheel_stale(struct timer_wheel *tw);
+void timer_add(struct timer_wheel *tw, struct timer *timer, int64_t expire);
+void timer_del(struct timer *timer);
+void timer_wheel_expire(struct context *ctx, struct timer_wheel *tw);
+int timer_wheel_timeout(struct timer_wheel *tw, int max_timeout);
+
+#endif
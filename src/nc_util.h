@@ -91,6 +91,7 @@
 int nc_set_blocking(int sd);
 int nc_set_nonblocking(int sd);
 int nc_set_reuseaddr(int sd);
+int nc_set_reuseport(int sd);
 int nc_set_tcpnodelay(int sd);
 int nc_set_linger(int sd, int timeout);
 int nc_set_sndbuf(int sd, int size);
@@ -142,6 +143,25 @@ void *_nc_calloc(size_t nmemb, size_t size, const char *name, int line);
 void *_nc_realloc(void *ptr, size_t size, const char *name, int line);
 void _nc_free(void *ptr, const char *name, int line);
 
+/*
+ * Wrappers for counters that are shared by all worker threads. Free
+ * lists and everything else on the request path stay thread local.
+ */
+#define nc_atomic_incr(_n)          \
+    __sync_add_and_fetch(&(_n), 1)
+
+#define nc_atomic_decr(_n)          \
+    __sync_sub_and_fetch(&(_n), 1)
+
+#define nc_atomic_get(_n)           \
+    __sync_add_and_fetch(&(_n), 0)
+
+#define nc_atomic_add(_n, _v)       \
+    __sync_add_and_fetch(&(_n), (_v))
+
+#define nc_atomic_sub(_n, _v)       \
+    __sync_sub_and_fetch(&(_n), (_v))
+
 /*
  * Wrappers to send or receive n byte message on a blocking
  * socket descriptor.
@@ -32,6 +32,40 @@
  */
 #define MEMCACHE_MAX_KEY_LENGTH 250
 
+static void memcache_stream_get(struct msg *request);
+
+/* nonzero iff some byte of the 64-bit word v is zero */
+#define MEMCACHE_HASZERO(v)                                                 \
+    (((v) - 0x0101010101010101ULL) & ~(v) & 0x8080808080808080ULL)
+
+/*
+ * Return the first space or CR in [p, last), or last when there is none.
+ * Keys are scanned a word at a time; only the word holding the end of the
+ * key is looked at a byte at a time.
+ */
+static uint8_t *
+memcache_key_end(uint8_t *p, uint8_t *last)
+{
+    uint64_t w;
+
+    while (last - p >= (ssize_t)sizeof(w)) {
+        nc_memcpy(&w, p, sizeof(w));
+        if (MEMCACHE_HASZERO(w ^ 0x2020202020202020ULL) ||
+            MEMCACHE_HASZERO(w ^ 0x0d0d0d0d0d0d0d0dULL)) {
+            break;
+        }
+        p += sizeof(w);
+    }
+
+    for (; p < last; p++) {
+        if (*p == ' ' || *p == CR) {
+            break;
+        }
+    }
+
+    return p;
+}
+
 /*
  * Return true, if the memcache command is a storage command, otherwise
  * return false
@@ -318,6 +352,15 @@ memcache_parse_req(struct msg *r)
             if (r->token == NULL) {
                 r->token = p;
             }
+
+            m = memcache_key_end(p, b->last);
+            if (m == b->last) {
+                p = m - 1; /* key continues in the next mbuf */
+                break;
+            }
+            p = m; /* move forward to the end of the key */
+            ch = *p;
+
             if (ch == ' ' || ch == CR) {
                 struct keypos *kpos;
 
@@ -329,7 +372,7 @@ memcache_parse_req(struct msg *r)
                     goto error;
                 }
 
-                kpos = array_push(r->keys);
+                kpos = array_push(&r->keys);
                 if (kpos == NULL) {
                     goto enomem;
                 }
@@ -948,11 +991,16 @@ memcache_parse_rsp(struct msg *r)
             break;
 
         case SW_KEY:
-            if (ch == ' ') {
-                /* r->token = NULL; */
-                state = SW_SPACES_BEFORE_FLAGS;
+            m = memchr(p, ' ', (size_t)(b->last - p));
+            if (m == NULL) {
+                p = b->last - 1;
+                break;
             }
 
+            p = m; /* move forward to the end of the key */
+            /* r->token = NULL; */
+            state = SW_SPACES_BEFORE_FLAGS;
+
             break;
 
         case SW_SPACES_BEFORE_FLAGS:
@@ -1088,18 +1136,17 @@ memcache_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
-            switch (ch) {
-            case CR:
-                if (r->type == MSG_RSP_MC_VALUE) {
-                    state = SW_RUNTO_VAL;
-                } else {
-                    state = SW_ALMOST_DONE;
-                }
-
+            m = memchr(p, CR, (size_t)(b->last - p));
+            if (m == NULL) {
+                p = b->last - 1;
                 break;
+            }
 
-            default:
-                break;
+            p = m; /* move forward to the CR */
+            if (r->type == MSG_RSP_MC_VALUE) {
+                state = SW_RUNTO_VAL;
+            } else {
+                state = SW_ALMOST_DONE;
             }
 
             break;
@@ -1195,7 +1242,7 @@ memcache_append_key(struct msg *r, uint8_t *key, uint32_t keylen)
         return NC_ENOMEM;
     }
 
-    kpos = array_push(r->keys);
+    kpos = array_push(&r->keys);
     if (kpos == NULL) {
         return NC_ENOMEM;
     }
@@ -1210,28 +1257,69 @@ memcache_append_key(struct msg *r, uint8_t *key, uint32_t keylen)
     return NC_OK;
 }
 
+/*
+ * Complete fragment sub_msg of r with the get/gets command and the
+ * trailing \r\n, and queue it in frag_msgq
+ */
+static rstatus_t
+memcache_fragment_add(struct msg *r, struct msg *sub_msg, struct msg_tqh *frag_msgq)
+{
+    rstatus_t status;
+
+    /* prepend get/gets */
+    if (r->type == MSG_REQ_MC_GET) {
+        status = msg_prepend(sub_msg, (uint8_t *)"get ", 4);
+    } else if (r->type == MSG_REQ_MC_GETS) {
+        status = msg_prepend(sub_msg, (uint8_t *)"gets ", 5);
+    } else {
+        NOT_REACHED();
+        status = NC_ERROR;
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    /* append \r\n */
+    status = msg_append(sub_msg, (uint8_t *)CRLF, CRLF_LEN);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    sub_msg->type = r->type;
+    sub_msg->frag_id = r->frag_id;
+    sub_msg->frag_owner = r->frag_owner;
+
+    TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
+    r->cold->nfrag++;
+
+    return NC_OK;
+}
+
 /*
  * read the comment in proto/nc_redis.c
  */
 static rstatus_t
-memcache_fragment_retrieval(struct msg *r, uint32_t ncontinuum,
+memcache_fragment_retrieval(struct msg *r, uint32_t nserver, uint32_t max_keys,
                             struct msg_tqh *frag_msgq,
                             uint32_t key_step)
 {
     struct mbuf *mbuf;
+    struct msg_cold *cold;
     struct msg **sub_msgs;
     uint32_t i;
     rstatus_t status;
 
-    sub_msgs = nc_zalloc(ncontinuum * sizeof(*sub_msgs));
+    /* fan-out tables live in the arena of r, and are released with it */
+    sub_msgs = msg_arena_alloc(r, nserver * sizeof(*sub_msgs));
     if (sub_msgs == NULL) {
         return NC_ENOMEM;
     }
+    memset(sub_msgs, 0, nserver * sizeof(*sub_msgs));
 
-    ASSERT(r->frag_seq == NULL);
-    r->frag_seq = nc_alloc(array_n(r->keys) * sizeof(*r->frag_seq));
-    if (r->frag_seq == NULL) {
-        nc_free(sub_msgs);
+    cold = r->cold;
+    ASSERT(cold->frag_seq == NULL);
+    cold->frag_seq = msg_arena_alloc(r, array_n(&r->keys) * sizeof(*cold->frag_seq));
+    if (cold->frag_seq == NULL) {
         return NC_ENOMEM;
     }
 
@@ -1242,7 +1330,8 @@ memcache_fragment_retrieval(struct msg *r, uint32_t ncontinuum,
      * This code is based on the assumption that 'gets ' is located
      * in a contiguous location.
      * This is always true because we have capped our MBUF_MIN_SIZE at 512 and
-     * whenever we have multiple messages, we copy the tail message into a new mbuf
+     * whenever we have multiple messages, the tail message starts in an mbuf
+     * with at least MBUF_MIN_SIZE bytes of room (see msg_parsed)
      */
     for (; *(mbuf->pos) != ' ';) {          /* eat get/gets  */
         mbuf->pos++;
@@ -1250,72 +1339,70 @@ memcache_fragment_retrieval(struct msg *r, uint32_t ncontinuum,
     mbuf->pos++;
 
     r->frag_id = msg_gen_frag_id();
-    r->nfrag = 0;
+    cold->nfrag = 0;
     r->frag_owner = r;
 
-    for (i = 0; i < array_n(r->keys); i++) {        /* for each  key */
+    for (i = 0; i < array_n(&r->keys); i++) {        /* for each  key */
         struct msg *sub_msg;
-        struct keypos *kpos = array_get(r->keys, i);
+        struct keypos *kpos = array_get(&r->keys, i);
         uint32_t idx = msg_backend_idx(r, kpos->start, kpos->end - kpos->start);
 
-        if (sub_msgs[idx] == NULL) {
+        sub_msg = sub_msgs[idx];
+        if (sub_msg == NULL || sub_msg->frag_id != 0) {
             sub_msgs[idx] = msg_get(r->owner, r->request, r->redis);
             if (sub_msgs[idx] == NULL) {
-                nc_free(sub_msgs);
                 return NC_ENOMEM;
             }
         }
-        r->frag_seq[i] = sub_msg = sub_msgs[idx];
+
+        if (sub_msg != NULL && sub_msg->frag_id != 0) {
+            /*
+             * fragment to this server is full and already in frag_msgq;
+             * the next one is held until it is done
+             */
+            if (msg_cold(sub_msg) == NULL) {
+                return NC_ENOMEM;
+            }
+            sub_msg->cold->frag_next = sub_msgs[idx];
+            sub_msgs[idx]->held = 1;
+        }
+        cold->frag_seq[i] = sub_msg = sub_msgs[idx];
 
         sub_msg->narg++;
         status = memcache_append_key(sub_msg, kpos->start, kpos->end - kpos->start);
         if (status != NC_OK) {
-            nc_free(sub_msgs);
             return status;
         }
+
+        if (max_keys != 0 && sub_msg->narg == max_keys) {
+            status = memcache_fragment_add(r, sub_msg, frag_msgq);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
     }
 
-    for (i = 0; i < ncontinuum; i++) {     /* prepend mget header, and forward it */
+    for (i = 0; i < nserver; i++) {     /* prepend mget header, and forward it */
         struct msg *sub_msg = sub_msgs[i];
-        if (sub_msg == NULL) {
+        if (sub_msg == NULL || sub_msg->frag_id != 0) {
             continue;
         }
 
-        /* prepend get/gets */
-        if (r->type == MSG_REQ_MC_GET) {
-            status = msg_prepend(sub_msg, (uint8_t *)"get ", 4);
-        } else if (r->type == MSG_REQ_MC_GETS) {
-            status = msg_prepend(sub_msg, (uint8_t *)"gets ", 5);
-        }
-        if (status != NC_OK) {
-            nc_free(sub_msgs);
-            return status;
-        }
-
-        /* append \r\n */
-        status = msg_append(sub_msg, (uint8_t *)CRLF, CRLF_LEN);
+        status = memcache_fragment_add(r, sub_msg, frag_msgq);
         if (status != NC_OK) {
-            nc_free(sub_msgs);
             return status;
         }
-
-        sub_msg->type = r->type;
-        sub_msg->frag_id = r->frag_id;
-        sub_msg->frag_owner = r->frag_owner;
-
-        TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
-        r->nfrag++;
     }
 
-    nc_free(sub_msgs);
     return NC_OK;
 }
 
 rstatus_t
-memcache_fragment(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msgq)
+memcache_fragment(struct msg *r, uint32_t nserver, uint32_t max_keys,
+                  struct msg_tqh *frag_msgq)
 {
     if (memcache_retrieval(r)) {
-        return memcache_fragment_retrieval(r, ncontinuum, frag_msgq, 1);
+        return memcache_fragment_retrieval(r, nserver, max_keys, frag_msgq, 1);
     }
     return NC_OK;
 }
@@ -1339,7 +1426,7 @@ memcache_pre_coalesce(struct msg *r)
         return;
     }
 
-    pr->frag_owner->nfrag_done++;
+    pr->frag_owner->cold->nfrag_done++;
     switch (r->type) {
 
     case MSG_RSP_MC_VALUE:
@@ -1376,6 +1463,7 @@ memcache_pre_coalesce(struct msg *r)
             mbuf_put(mbuf);
         }
 
+        memcache_stream_get(pr->frag_owner);
         break;
 
     default:
@@ -1405,6 +1493,7 @@ memcache_copy_bulk(struct msg *dst, struct msg *src)
     uint32_t len = 0;
     uint32_t bytes = 0;
     uint32_t i = 0;
+    rstatus_t status;
 
     for (mbuf = STAILQ_FIRST(&src->mhdr);
          mbuf && mbuf_empty(mbuf);
@@ -1445,32 +1534,74 @@ memcache_copy_bulk(struct msg *dst, struct msg *src)
 
     bytes = len;
 
-    /* copy len bytes to dst */
+    /* move len bytes to dst, without copying */
     for (; mbuf;) {
-        if (mbuf_length(mbuf) <= len) {   /* steal this mbuf from src to dst */
+        uint32_t n = mbuf_length(mbuf);
+
+        if (n <= len) {                 /* steal this mbuf from src to dst */
             nbuf = STAILQ_NEXT(mbuf, next);
             mbuf_remove(&src->mhdr, mbuf);
             mbuf_insert(&dst->mhdr, mbuf);
-            len -= mbuf_length(mbuf);
+            dst->mlen += n;
+            len -= n;
             mbuf = nbuf;
-        } else {                        /* split it */
-            nbuf = mbuf_get();
-            if (nbuf == NULL) {
-                return NC_ENOMEM;
+        } else {                        /* share it */
+            status = msg_append_ref(dst, mbuf, len);
+            if (status != NC_OK) {
+                return status;
             }
-            mbuf_copy(nbuf, mbuf->pos, len);
-            mbuf_insert(&dst->mhdr, nbuf);
             mbuf->pos += len;
             break;
         }
     }
 
-    dst->mlen += bytes;
     src->mlen -= bytes;
     log_debug(LOG_VVERB, "memcache_copy_bulk copy bytes: %d", bytes);
     return NC_OK;
 }
 
+/*
+ * Coalesce the values of the leading keys of a fragmented 'get' or 'gets'
+ * into its response, in key order, for as far as their fragments are done.
+ * Called as each fragment arrives, so that the head of the reply can be
+ * sent before the slowest fragment is in (see req_stream)
+ */
+static void
+memcache_stream_get(struct msg *request)
+{
+    struct msg *response = request->peer;
+    struct msg_cold *cold = request->cold;
+    struct server_pool *pool;
+    struct msg *sub_msg;
+    rstatus_t status;
+
+    if (response == NULL || request->error || request->ferror) {
+        return;
+    }
+
+    pool = request->owner->owner;
+
+    for (; cold->nstream < array_n(&request->keys); cold->nstream++) {
+        sub_msg = cold->frag_seq[cold->nstream];
+        if (sub_msg->error ? !pool->partial_mget : sub_msg->peer == NULL) {
+            /* fragment is pending or failed; see req_error */
+            break;
+        }
+
+        if (sub_msg->error) {
+            /* key of a failed fragment is a miss; see partial_mget */
+            request->partial = 1;
+            continue;
+        }
+
+        status = memcache_copy_bulk(response, sub_msg->peer);
+        if (status != NC_OK) {
+            response->owner->err = 1;
+            return;
+        }
+    }
+}
+
 /*
  * Post-coalesce handler is invoked when the message is a response to
  * the fragmented multi vector request - 'get' or 'gets' and all the
@@ -1481,8 +1612,7 @@ void
 memcache_post_coalesce(struct msg *request)
 {
     struct msg *response = request->peer;
-    struct msg *sub_msg;
-    uint32_t i;
+    struct msg_cold *cold = request->cold;
     rstatus_t status;
 
     ASSERT(!response->request);
@@ -1492,17 +1622,11 @@ memcache_post_coalesce(struct msg *request)
         return;
     }
 
-    for (i = 0; i < array_n(request->keys); i++) {      /* for each  key */
-        sub_msg = request->frag_seq[i]->peer;           /* get it's peer response */
-        if (sub_msg == NULL) {
-            response->owner->err = 1;
-            return;
-        }
-        status = memcache_copy_bulk(response, sub_msg);
-        if (status != NC_OK) {
-            response->owner->err = 1;
-            return;
-        }
+    memcache_stream_get(request);
+
+    if (cold->nstream < array_n(&request->keys)) {
+        response->owner->err = 1;
+        return;
     }
 
     /* append END\r\n */
@@ -138,20 +138,176 @@
     (str15icmp(m, c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14) &&       \
      (m[15] == c15 || m[15] == (c15 ^ 0x20)))
 
+/*
+ * Redis command table. Every redis request type has exactly one entry,
+ * giving its name, the argument class the parser uses to frame it, the
+ * first, last and step of its key positions (last is -1 for variadic
+ * keys, all zero when the command carries no key), whether it reads or
+ * writes the keyspace, and how it fans out over the servers of a pool.
+ */
+#define REDIS_COMMAND_CODEC(ACTION)                                                                 \
+    ACTION( REQ_REDIS_DEL,               "del",              ARGX,        1, -1, 1, WRITE,     SUM   ) \
+    ACTION( REQ_REDIS_EXISTS,            "exists",           ARGX,        1, -1, 1, READ,      SUM   ) \
+    ACTION( REQ_REDIS_EXPIRE,            "expire",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_EXPIREAT,          "expireat",         ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PEXPIRE,           "pexpire",          ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PEXPIREAT,         "pexpireat",        ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PERSIST,           "persist",          ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PTTL,              "pttl",             ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SORT,              "sort",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_TOUCH,             "touch",            ARGX,        1, -1, 1, READ,      SUM   ) \
+    ACTION( REQ_REDIS_TTL,               "ttl",              ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_TYPE,              "type",             ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_UNLINK,            "unlink",           ARGX,        1, -1, 1, WRITE,     SUM   ) \
+    ACTION( REQ_REDIS_APPEND,            "append",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_BITCOUNT,          "bitcount",         ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_DECR,              "decr",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_DECRBY,            "decrby",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_DUMP,              "dump",             ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_GET,               "get",              ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_GETBIT,            "getbit",           ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_GETRANGE,          "getrange",         ARG2,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_GETSET,            "getset",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_INCR,              "incr",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_INCRBY,            "incrby",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_INCRBYFLOAT,       "incrbyfloat",      ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_MGET,              "mget",             ARGX,        1, -1, 1, READ,      MERGE ) \
+    ACTION( REQ_REDIS_MSET,              "mset",             ARGKVX,      1, -1, 2, WRITE,     OK    ) \
+    ACTION( REQ_REDIS_PSETEX,            "psetex",           ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_RESTORE,           "restore",          ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SET,               "set",              ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SETBIT,            "setbit",           ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SETEX,             "setex",            ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SETNX,             "setnx",            ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SETRANGE,          "setrange",         ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_STRLEN,            "strlen",           ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HDEL,              "hdel",             ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HEXISTS,           "hexists",          ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HGET,              "hget",             ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HGETALL,           "hgetall",          ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HINCRBY,           "hincrby",          ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HINCRBYFLOAT,      "hincrbyfloat",     ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HKEYS,             "hkeys",            ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HLEN,              "hlen",             ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HMGET,             "hmget",            ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HMSET,             "hmset",            ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HSET,              "hset",             ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HSETNX,            "hsetnx",           ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_HSCAN,             "hscan",            ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_HVALS,             "hvals",            ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_LINDEX,            "lindex",           ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_LINSERT,           "linsert",          ARG3,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LLEN,              "llen",             ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_LPOP,              "lpop",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LPUSH,             "lpush",            ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LPUSHX,            "lpushx",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LRANGE,            "lrange",           ARG2,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_LREM,              "lrem",             ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LSET,              "lset",             ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_LTRIM,             "ltrim",            ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PFADD,             "pfadd",            ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PFCOUNT,           "pfcount",          ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_PFMERGE,           "pfmerge",          ARGN,        1, -1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_RPOP,              "rpop",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_RPOPLPUSH,         "rpoplpush",        ARG1,        1,  2, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_RPUSH,             "rpush",            ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_RPUSHX,            "rpushx",           ARG1,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SADD,              "sadd",             ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SCARD,             "scard",            ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SDIFF,             "sdiff",            ARGT,        1, -1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SDIFFSTORE,        "sdiffstore",       ARGT,        1, -1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SINTER,            "sinter",           ARGT,        1, -1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SINTERSTORE,       "sinterstore",      ARGT,        1, -1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SISMEMBER,         "sismember",        ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SMEMBERS,          "smembers",         ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SMOVE,             "smove",            ARG2,        1,  2, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SPOP,              "spop",             ARG0,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SRANDMEMBER,       "srandmember",      ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SREM,              "srem",             ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SUNION,            "sunion",           ARGT,        1, -1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_SUNIONSTORE,       "sunionstore",      ARGT,        1, -1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_SSCAN,             "sscan",            ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZADD,              "zadd",             ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZCARD,             "zcard",            ARG0,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZCOUNT,            "zcount",           ARG2,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZINCRBY,           "zincrby",          ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZINTERSTORE,       "zinterstore",      ARGNUMKEYS,  1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZLEXCOUNT,         "zlexcount",        ARG2,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZRANGE,            "zrange",           ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZRANGEBYLEX,       "zrangebylex",      ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZRANGEBYSCORE,     "zrangebyscore",    ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZRANK,             "zrank",            ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZREM,              "zrem",             ARGN,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZREMRANGEBYRANK,   "zremrangebyrank",  ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZREMRANGEBYLEX,    "zremrangebylex",   ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZREMRANGEBYSCORE,  "zremrangebyscore", ARG2,        1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZREVRANGE,         "zrevrange",        ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZREVRANGEBYSCORE,  "zrevrangebyscore", ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZREVRANK,          "zrevrank",         ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZSCORE,            "zscore",           ARG1,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_ZUNIONSTORE,       "zunionstore",      ARGNUMKEYS,  1,  1, 1, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_ZSCAN,             "zscan",            ARGN,        1,  1, 1, READ,      NONE  ) \
+    ACTION( REQ_REDIS_EVAL,              "eval",             ARGEVAL,     0,  0, 0, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_EVALSHA,           "evalsha",          ARGEVAL,     0,  0, 0, WRITE,     NONE  ) \
+    ACTION( REQ_REDIS_PING,              "ping",             ARGZ,        0,  0, 0, NOFORWARD, NONE  ) \
+    ACTION( REQ_REDIS_QUIT,              "quit",             ARGZ,        0,  0, 0, QUIT,      NONE  ) \
+    ACTION( REQ_REDIS_AUTH,              "auth",             ARG0,        0,  0, 0, NOFORWARD, NONE  ) \
+    ACTION( REQ_REDIS_REPLACE_SERVER,    "replace_server",   ARGX,        0,  0, 0, NONE,      NONE  )
+
+typedef enum redis_args {
+    REDIS_ARGZ,                 /* no key */
+    REDIS_ARG0,                 /* key only */
+    REDIS_ARG1,                 /* key and one argument */
+    REDIS_ARG2,                 /* key and two arguments */
+    REDIS_ARG3,                 /* key and three arguments */
+    REDIS_ARGN,                 /* key and zero or more arguments */
+    REDIS_ARGX,                 /* one or more keys */
+    REDIS_ARGKVX,               /* one or more key-value pairs */
+    REDIS_ARGEVAL,              /* script, numkeys and keys and arguments */
+    REDIS_ARGT,                 /* one or more keys sharing a hash tag */
+    REDIS_ARGNUMKEYS            /* destination key, numkeys and keys and arguments */
+} redis_args_t;
+
+#define REDIS_CMD_NONE          0
+#define REDIS_CMD_READ          (1 << 0)    /* reads the keyspace */
+#define REDIS_CMD_WRITE         (1 << 1)    /* writes the keyspace */
+#define REDIS_CMD_NOFORWARD     (1 << 2)    /* answered by the proxy */
+#define REDIS_CMD_QUIT          (1 << 3)    /* closes the client connection */
+
+typedef enum redis_fanout {
+    REDIS_FANOUT_NONE,          /* forwarded whole to one server */
+    REDIS_FANOUT_MERGE,         /* bulk replies merged in key order */
+    REDIS_FANOUT_SUM,           /* integer replies summed */
+    REDIS_FANOUT_OK             /* status replies collapsed into one */
+} redis_fanout_t;
+
+struct redis_command {
+    msg_type_t     type;        /* request type */
+    struct string  name;        /* lowercase command name */
+    redis_args_t   args;        /* argument class */
+    int            first_key;   /* position of the first key */
+    int            last_key;    /* position of the last key, -1 for variadic */
+    int            key_step;    /* distance between keys */
+    unsigned       flags;       /* REDIS_CMD_* flags */
+    redis_fanout_t fanout;      /* fan-out strategy */
+};
+
 void memcache_parse_req(struct msg *r);
 void memcache_parse_rsp(struct msg *r);
 void memcache_pre_coalesce(struct msg *r);
 void memcache_post_coalesce(struct msg *r);
 rstatus_t memcache_add_auth_packet(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
-rstatus_t memcache_fragment(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msgq);
+rstatus_t memcache_fragment(struct msg *r, uint32_t nserver, uint32_t max_keys, struct msg_tqh *frag_msgq);
 rstatus_t memcache_reply(struct msg *r);
 
+void redis_init(void);
+const struct redis_command *redis_command(msg_type_t type);
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
 void redis_pre_coalesce(struct msg *r);
 void redis_post_coalesce(struct msg *r);
 rstatus_t redis_add_auth_packet(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
-rstatus_t redis_fragment(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msgq);
+rstatus_t redis_fragment(struct msg *r, uint32_t nserver, uint32_t max_keys, struct msg_tqh *frag_msgq);
 rstatus_t redis_reply(struct msg *r);
 
 #if 1 //shenzheng 2015-4-28 proxy administer
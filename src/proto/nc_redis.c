@@ -23,6 +23,8 @@
 
 #define REPL_OK     "+OK\r\n"
 #define REPL_PONG   "+PONG\r\n"
+#define REPL_NIL    "$-1\r\n"
+#define REPL_CROSS_TAG "-ERR keys of the command must share a hash tag\r\n"
 
 #define AUTH_INVALID_PASSWORD "-ERR invalid password\r\n"
 #define AUTH_REQUIRE_PASSWORD "-NOAUTH Authentication required\r\n"
@@ -30,174 +32,178 @@
 
 static rstatus_t redis_handle_auth_req(struct msg *request, struct msg *response);
 
+#define REDIS_COMMAND_NSLOT 2048    /* power of 2, many times # commands */
+
+#define DEFINE_ACTION(_type, _name, _args, _first, _last, _step, _flags, _fanout)  \
+    { MSG_##_type, string(_name), REDIS_##_args, _first, _last, _step,                \
+      REDIS_CMD_##_flags, REDIS_FANOUT_##_fanout },
+static struct redis_command redis_commands[] = {
+    REDIS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+static const struct redis_command *redis_command_types[MSG_SENTINEL];
+static uint8_t redis_command_slots[REDIS_COMMAND_NSLOT]; /* command index + 1 */
+static uint32_t redis_command_seed;
+
 /*
- * Return true, if the redis command take no key, otherwise
- * return false
+ * Hash the command name case-insensitively into a slot of the command
+ * lookup table. The seed is chosen by redis_init so that no two commands
+ * collide, which makes the hash perfect over the command table.
  */
-static bool
-redis_argz(struct msg *r)
+static uint32_t
+redis_command_hash(uint32_t seed, const uint8_t *name, uint32_t namelen)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_PING:
-    case MSG_REQ_REDIS_QUIT:
-        return true;
+    uint32_t i, hash;
 
-    default:
-        break;
+    hash = 2166136261UL ^ seed;
+    for (i = 0; i < namelen; i++) {
+        hash ^= (uint32_t)tolower(name[i]);
+        hash *= 16777619UL;
     }
 
-    return false;
+    return hash & (REDIS_COMMAND_NSLOT - 1);
 }
 
 /*
- * Return true, if the redis command accepts no arguments, otherwise
- * return false
+ * Place every command of the table into its slot for the given seed.
+ * Return false on the first collision.
  */
 static bool
-redis_arg0(struct msg *r)
+redis_command_place(uint32_t seed)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EXISTS:
-    case MSG_REQ_REDIS_PERSIST:
-    case MSG_REQ_REDIS_PTTL:
-    case MSG_REQ_REDIS_SORT:
-    case MSG_REQ_REDIS_TTL:
-    case MSG_REQ_REDIS_TYPE:
-    case MSG_REQ_REDIS_DUMP:
-
-    case MSG_REQ_REDIS_DECR:
-    case MSG_REQ_REDIS_GET:
-    case MSG_REQ_REDIS_INCR:
-    case MSG_REQ_REDIS_STRLEN:
-
-    case MSG_REQ_REDIS_HGETALL:
-    case MSG_REQ_REDIS_HKEYS:
-    case MSG_REQ_REDIS_HLEN:
-    case MSG_REQ_REDIS_HVALS:
-
-    case MSG_REQ_REDIS_LLEN:
-    case MSG_REQ_REDIS_LPOP:
-    case MSG_REQ_REDIS_RPOP:
-
-    case MSG_REQ_REDIS_SCARD:
-    case MSG_REQ_REDIS_SMEMBERS:
-    case MSG_REQ_REDIS_SPOP:
-
-    case MSG_REQ_REDIS_ZCARD:
-    case MSG_REQ_REDIS_PFCOUNT:
-    case MSG_REQ_REDIS_AUTH:
-        return true;
+    struct redis_command *cmd;
+    uint32_t i, slot;
 
-    default:
-        break;
+    memset(redis_command_slots, 0, sizeof(redis_command_slots));
+
+    for (i = 0; i < NELEMS(redis_commands); i++) {
+        cmd = &redis_commands[i];
+        slot = redis_command_hash(seed, cmd->name.data, cmd->name.len);
+        if (redis_command_slots[slot] != 0) {
+            return false;
+        }
+        redis_command_slots[slot] = (uint8_t)(i + 1);
     }
 
-    return false;
+    return true;
 }
 
-/*
- * Return true, if the redis command accepts exactly 1 argument, otherwise
- * return false
- */
-static bool
-redis_arg1(struct msg *r)
+void
+redis_init(void)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EXPIRE:
-    case MSG_REQ_REDIS_EXPIREAT:
-    case MSG_REQ_REDIS_PEXPIRE:
-    case MSG_REQ_REDIS_PEXPIREAT:
-
-    case MSG_REQ_REDIS_APPEND:
-    case MSG_REQ_REDIS_DECRBY:
-    case MSG_REQ_REDIS_GETBIT:
-    case MSG_REQ_REDIS_GETSET:
-    case MSG_REQ_REDIS_INCRBY:
-    case MSG_REQ_REDIS_INCRBYFLOAT:
-    case MSG_REQ_REDIS_SETNX:
-
-    case MSG_REQ_REDIS_HEXISTS:
-    case MSG_REQ_REDIS_HGET:
-
-    case MSG_REQ_REDIS_LINDEX:
-    case MSG_REQ_REDIS_LPUSHX:
-    case MSG_REQ_REDIS_RPOPLPUSH:
-    case MSG_REQ_REDIS_RPUSHX:
-
-    case MSG_REQ_REDIS_SISMEMBER:
-
-    case MSG_REQ_REDIS_ZRANK:
-    case MSG_REQ_REDIS_ZREVRANK:
-    case MSG_REQ_REDIS_ZSCORE:
-        return true;
+    struct redis_command *cmd;
+    uint32_t i, seed;
 
-    default:
-        break;
+    ASSERT(NELEMS(redis_commands) < UINT8_MAX);
+
+    for (i = 0; i < NELEMS(redis_commands); i++) {
+        cmd = &redis_commands[i];
+        ASSERT(redis_command_types[cmd->type] == NULL);
+        redis_command_types[cmd->type] = cmd;
+    }
+
+    for (seed = 0; !redis_command_place(seed); seed++) {
+        /* try the next seed */
     }
+    redis_command_seed = seed;
 
-    return false;
+    log_debug(LOG_VVERB, "redis command table of %d commands in %d slots, "
+              "seed %"PRIu32"", NELEMS(redis_commands), REDIS_COMMAND_NSLOT,
+              seed);
 }
 
 /*
- * Return true, if the redis command accepts exactly 2 arguments, otherwise
- * return false
+ * Return the command table entry of the redis request type
  */
-static bool
-redis_arg2(struct msg *r)
+const struct redis_command *
+redis_command(msg_type_t type)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_GETRANGE:
-    case MSG_REQ_REDIS_PSETEX:
-    case MSG_REQ_REDIS_SETBIT:
-    case MSG_REQ_REDIS_SETEX:
-    case MSG_REQ_REDIS_SETRANGE:
+    ASSERT(type > MSG_UNKNOWN && type < MSG_SENTINEL);
+    ASSERT(redis_command_types[type] != NULL);
 
-    case MSG_REQ_REDIS_HINCRBY:
-    case MSG_REQ_REDIS_HINCRBYFLOAT:
-    case MSG_REQ_REDIS_HSET:
-    case MSG_REQ_REDIS_HSETNX:
+    return redis_command_types[type];
+}
 
-    case MSG_REQ_REDIS_LRANGE:
-    case MSG_REQ_REDIS_LREM:
-    case MSG_REQ_REDIS_LSET:
-    case MSG_REQ_REDIS_LTRIM:
+/*
+ * Return the command table entry of the command name, or NULL when the
+ * name is not that of a supported command
+ */
+static const struct redis_command *
+redis_command_lookup(const uint8_t *name, uint32_t namelen)
+{
+    const struct redis_command *cmd;
+    uint32_t i;
+    uint8_t idx;
 
-    case MSG_REQ_REDIS_SMOVE:
+    idx = redis_command_slots[redis_command_hash(redis_command_seed, name,
+                                                 namelen)];
+    if (idx == 0) {
+        return NULL;
+    }
 
-    case MSG_REQ_REDIS_ZCOUNT:
-    case MSG_REQ_REDIS_ZLEXCOUNT:
-    case MSG_REQ_REDIS_ZINCRBY:
-    case MSG_REQ_REDIS_ZREMRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREMRANGEBYRANK:
-    case MSG_REQ_REDIS_ZREMRANGEBYSCORE:
+    cmd = &redis_commands[idx - 1];
+    if (cmd->name.len != namelen) {
+        return NULL;
+    }
 
-    case MSG_REQ_REDIS_RESTORE:
+    for (i = 0; i < namelen; i++) {
+        if (tolower(name[i]) != cmd->name.data[i]) {
+            return NULL;
+        }
+    }
 
-        return true;
+    return cmd;
+}
 
-    default:
-        break;
-    }
+/*
+ * Return true, if the redis command take no key, otherwise
+ * return false
+ */
+static bool
+redis_argz(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARGZ;
+}
 
-    return false;
+/*
+ * Return true, if the redis command accepts no arguments, otherwise
+ * return false
+ */
+static bool
+redis_arg0(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARG0;
 }
 
 /*
- * Return true, if the redis command accepts exactly 3 arguments, otherwise
+ * Return true, if the redis command accepts exactly 1 argument, otherwise
  * return false
  */
 static bool
-redis_arg3(struct msg *r)
+redis_arg1(struct msg *r)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_LINSERT:
-        return true;
+    return redis_command(r->type)->args == REDIS_ARG1;
+}
 
-    default:
-        break;
-    }
+/*
+ * Return true, if the redis command accepts exactly 2 arguments, otherwise
+ * return false
+ */
+static bool
+redis_arg2(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARG2;
+}
 
-    return false;
+/*
+ * Return true, if the redis command accepts exactly 3 arguments, otherwise
+ * return false
+ */
+static bool
+redis_arg3(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARG3;
 }
 
 /*
@@ -207,49 +213,7 @@ redis_arg3(struct msg *r)
 static bool
 redis_argn(struct msg *r)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_BITCOUNT:
-
-    case MSG_REQ_REDIS_SET:
-    case MSG_REQ_REDIS_HDEL:
-    case MSG_REQ_REDIS_HMGET:
-    case MSG_REQ_REDIS_HMSET:
-    case MSG_REQ_REDIS_HSCAN:
-
-    case MSG_REQ_REDIS_LPUSH:
-    case MSG_REQ_REDIS_RPUSH:
-
-    case MSG_REQ_REDIS_SADD:
-    case MSG_REQ_REDIS_SDIFF:
-    case MSG_REQ_REDIS_SDIFFSTORE:
-    case MSG_REQ_REDIS_SINTER:
-    case MSG_REQ_REDIS_SINTERSTORE:
-    case MSG_REQ_REDIS_SREM:
-    case MSG_REQ_REDIS_SUNION:
-    case MSG_REQ_REDIS_SUNIONSTORE:
-    case MSG_REQ_REDIS_SRANDMEMBER:
-    case MSG_REQ_REDIS_SSCAN:
-
-    case MSG_REQ_REDIS_PFADD:
-    case MSG_REQ_REDIS_PFMERGE:
-
-    case MSG_REQ_REDIS_ZADD:
-    case MSG_REQ_REDIS_ZINTERSTORE:
-    case MSG_REQ_REDIS_ZRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZREM:
-    case MSG_REQ_REDIS_ZREVRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZUNIONSTORE:
-    case MSG_REQ_REDIS_ZSCAN:
-        return true;
-
-    default:
-        break;
-    }
-
-    return false;
+    return redis_command(r->type)->args == REDIS_ARGN;
 }
 
 /*
@@ -259,19 +223,7 @@ redis_argn(struct msg *r)
 static bool
 redis_argx(struct msg *r)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_MGET:
-    case MSG_REQ_REDIS_DEL:
-#if 1 //shenzheng 2014-9-2 replace server
-	case MSG_REQ_REDIS_REPLACE_SERVER:
-#endif //shenzheng 2014-9-2 replace server
-        return true;
-
-    default:
-        break;
-    }
-
-    return false;
+    return redis_command(r->type)->args == REDIS_ARGX;
 }
 
 /*
@@ -281,15 +233,68 @@ redis_argx(struct msg *r)
 static bool
 redis_argkvx(struct msg *r)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_MSET:
+    return redis_command(r->type)->args == REDIS_ARGKVX;
+}
+
+/*
+ * Return true, if the redis command is a vector command accepting one or
+ * more keys that is not fragmented, and hence all of whose keys must share
+ * a hash tag, otherwise return false
+ */
+static bool
+redis_argt(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARGT;
+}
+
+/*
+ * Return true, if the redis command is either ZUNIONSTORE or ZINTERSTORE.
+ * These commands have a destination key, followed by numkeys, followed by
+ * numkeys keys, followed by zero or more arguments. All keys must share a
+ * hash tag.
+ */
+static bool
+redis_argnumkeys(struct msg *r)
+{
+    return redis_command(r->type)->args == REDIS_ARGNUMKEYS;
+}
+
+/*
+ * Return true, if all keys of the request share a hash tag, or are the same
+ * key when they carry none, and hence map to the same server of the pool
+ * for every distribution, otherwise return false
+ */
+static bool
+redis_keys_share_tag(struct msg *r)
+{
+    struct server_pool *pool = r->owner->owner;
+    struct keypos *kpos;
+    uint8_t *tag, *key;
+    uint32_t i, taglen, keylen;
+
+    ASSERT(r->owner->client && !r->owner->proxy);
+
+    if (array_n(&pool->server) == 1) {
         return true;
+    }
 
-    default:
-        break;
+    kpos = array_get(&r->keys, 0);
+    tag = kpos->start;
+    taglen = (uint32_t)(kpos->end - kpos->start);
+    server_pool_hash_tag(pool, &tag, &taglen);
+
+    for (i = 1; i < array_n(&r->keys); i++) {
+        kpos = array_get(&r->keys, i);
+        key = kpos->start;
+        keylen = (uint32_t)(kpos->end - kpos->start);
+        server_pool_hash_tag(pool, &key, &keylen);
+
+        if (keylen != taglen || memcmp(key, tag, keylen) != 0) {
+            return false;
+        }
     }
 
-    return false;
+    return true;
 }
 
 /*
@@ -301,16 +306,7 @@ redis_argkvx(struct msg *r)
 static bool
 redis_argeval(struct msg *r)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EVAL:
-    case MSG_REQ_REDIS_EVALSHA:
-        return true;
-
-    default:
-        break;
-    }
-
-    return false;
+    return redis_command(r->type)->args == REDIS_ARGEVAL;
 }
 
 /*
@@ -343,6 +339,7 @@ redis_parse_req(struct msg *r)
     struct mbuf *b;
     uint8_t *p, *m;
     uint8_t ch;
+    const struct redis_command *cmd;
 	//example : msg->pos = "*3\r\n$3\r\nset\r\n$5\r\nplace\r\n$8\r\nshanghai\r\n"
     enum {
         SW_START,	// begin to parse
@@ -485,676 +482,112 @@ redis_parse_req(struct msg *r)
             r->rlen = 0;
             m = r->token;
             r->token = NULL;
-            r->type = MSG_UNKNOWN;
-
-            switch (p - m) {
+            cmd = redis_command_lookup(m, (uint32_t)(p - m));
+            if (cmd == NULL) {
+                r->type = MSG_UNKNOWN;
+                log_error("parsed unsupported command '%.*s'", p - m, m);
+                goto error;
+            }
 
-            case 3:
-                if (str3icmp(m, 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GET;
-                    break;
-                }
+            r->type = cmd->type;
+            if (cmd->flags & REDIS_CMD_NOFORWARD) {
+                r->noforward = 1;
+            }
+            if (cmd->flags & REDIS_CMD_QUIT) {
+                r->quit = 1;
+            }
+            if (r->type == MSG_REQ_REDIS_REPLACE_SERVER) {
+                r->replace_server = 1;
+                log_debug(LOG_DEBUG, "new command : replace_server");
+            }
 
-                if (str3icmp(m, 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_SET;
-                    break;
-                }
+            log_debug(LOG_VERB, "parsed command '%.*s'", p - m, m);
 
-                if (str3icmp(m, 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_TTL;
-                    break;
-                }
+            state = SW_REQ_TYPE_LF;
+            break;
 
-                if (str3icmp(m, 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_DEL;
-                    break;
+        case SW_REQ_TYPE_LF:
+            switch (ch) {
+            case LF:
+                if (redis_argz(r)) {
+                    goto done;
+                } else if (redis_argeval(r)) {
+                    state = SW_ARG1_LEN;
+                } else {
+                    state = SW_KEY_LEN;
                 }
-
                 break;
 
-            case 4:
-                if (str4icmp(m, 'p', 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_PTTL;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'e', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_DECR;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'd', 'u', 'm', 'p')) {
-                    r->type = MSG_REQ_REDIS_DUMP;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'h', 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_HDEL;
-                    break;
+        case SW_KEY_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str4icmp(m, 'h', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HGET;
-                    break;
+                r->token = p;
+                r->rlen = 0;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if (r->rlen >= mbuf_data_size()) {
+                    log_error("parsed bad req %"PRIu64" of type %d with key "
+                              "length %d that greater than or equal to maximum"
+                              " redis key length of %d", r->id, r->type,
+                              r->rlen, mbuf_data_size());
+                    goto error;
                 }
-
-                if (str4icmp(m, 'h', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_HLEN;
-                    break;
+                if (r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_KEY_LEN_LF;
+            } else {
+                goto error;
+            }
 
-                if (str4icmp(m, 'h', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HSET;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'i', 'n', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_INCR;
-                    break;
-                }
+        case SW_KEY_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_KEY;
+                break;
 
-                if (str4icmp(m, 'l', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_LLEN;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'l', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_LPOP;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'l', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_LREM;
-                    break;
-                }
+        case SW_KEY:
+            if (r->token == NULL) {
+                r->token = p;
+            }
 
-                if (str4icmp(m, 'l', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_LSET;
-                    break;
-                }
+            m = r->token + r->rlen;
+            if (m >= b->last) {
+                m = b->last - 1;
+                p = m;
+                break;
+            }
 
-                if (str4icmp(m, 'r', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_RPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_SADD;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_SPOP;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_SREM;
-                    break;
-                }
-
-                if (str4icmp(m, 't', 'y', 'p', 'e')) {
-                    r->type = MSG_REQ_REDIS_TYPE;
-                    break;
-                }
-
-                if (str4icmp(m, 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MGET;
-                    break;
-                }
-                if (str4icmp(m, 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MSET;
-                    break;
-                }
-
-                if (str4icmp(m, 'z', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZADD;
-                    break;
-                }
-
-                if (str4icmp(m, 'z', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_ZREM;
-                    break;
-                }
-
-                if (str4icmp(m, 'e', 'v', 'a', 'l')) {
-                    r->type = MSG_REQ_REDIS_EVAL;
-                    break;
-                }
-
-                if (str4icmp(m, 's', 'o', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_SORT;
-                    break;
-                }
-
-                if (str4icmp(m, 'p', 'i', 'n', 'g')) {
-                    r->type = MSG_REQ_REDIS_PING;
-                    r->noforward = 1;
-                    break;
-                }
-
-                if (str4icmp(m, 'q', 'u', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_QUIT;
-                    r->quit = 1;
-                    break;
-                }
-
-                if (str4icmp(m, 'a', 'u', 't', 'h')) {
-                    r->type = MSG_REQ_REDIS_AUTH;
-                    r->noforward = 1;
-                    break;
-                }
-
-                break;
-
-            case 5:
-                if (str5icmp(m, 'h', 'k', 'e', 'y', 's')) {
-                    r->type = MSG_REQ_REDIS_HKEYS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMGET;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMSET;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 'v', 'a', 'l', 's')) {
-                    r->type = MSG_REQ_REDIS_HVALS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_HSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_LPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 'l', 't', 'r', 'i', 'm')) {
-                    r->type = MSG_REQ_REDIS_LTRIM;
-                    break;
-                }
-
-                if (str5icmp(m, 'r', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPUSH;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_SCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'd', 'i', 'f', 'f')) {
-                    r->type = MSG_REQ_REDIS_SDIFF;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETEX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETNX;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_SMOVE;
-                    break;
-                }
-
-                if (str5icmp(m, 's', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_SSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZCARD;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZRANK;
-                    break;
-                }
-
-                if (str5icmp(m, 'z', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_ZSCAN;
-                    break;
-                }
-
-                if (str5icmp(m, 'p', 'f', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_PFADD;
-                    break;
-                }
-
-                break;
-
-            case 6:
-                if (str6icmp(m, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                    r->type = MSG_REQ_REDIS_APPEND;
-                    break;
-                }
-
-                if (str6icmp(m, 'd', 'e', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_DECRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_EXISTS;
-                    break;
-                }
-
-                if (str6icmp(m, 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_EXPIRE;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_GETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 't', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GETSET;
-                    break;
-                }
-
-                if (str6icmp(m, 'p', 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_PSETEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'h', 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_HSETNX;
-                    break;
-                }
-
-                if (str6icmp(m, 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_INCRBY;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'i', 'n', 'd', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_LINDEX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_LPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 'l', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_LRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'r', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_RPUSHX;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_SETBIT;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'i', 'n', 't', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SINTER;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 't', 'r', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_STRLEN;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'u', 'n', 'i', 'o', 'n')) {
-                    r->type = MSG_REQ_REDIS_SUNION;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZCOUNT;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGE;
-                    break;
-                }
-
-                if (str6icmp(m, 'z', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZSCORE;
-                    break;
-                }
-
-                break;
-
-            case 7:
-                if (str7icmp(m, 'p', 'e', 'r', 's', 'i', 's', 't')) {
-                    r->type = MSG_REQ_REDIS_PERSIST;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_PEXPIRE;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_HEXISTS;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'g', 'e', 't', 'a', 'l', 'l')) {
-                    r->type = MSG_REQ_REDIS_HGETALL;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_HINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'l', 'i', 'n', 's', 'e', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_LINSERT;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_ZINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'e', 'v', 'a', 'l', 's', 'h', 'a')) {
-                    r->type = MSG_REQ_REDIS_EVALSHA;
-                    break;
-                }
-
-                if (str7icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_RESTORE;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_PFCOUNT;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'm', 'e', 'r', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_PFMERGE;
-                    break;
-                }
-
-                break;
-
-            case 8:
-                if (str8icmp(m, 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_EXPIREAT;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_BITCOUNT;
-                    break;
-                }
-
-                if (str8icmp(m, 'g', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_GETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_SETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'm', 'e', 'm', 'b', 'e', 'r', 's')) {
-                    r->type = MSG_REQ_REDIS_SMEMBERS;
-                    break;
-                }
-
-                if (str8icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANK;
-                    break;
-                }
-
-                break;
-
-            case 9:
-                if (str9icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_PEXPIREAT;
-                    break;
-                }
-
-                if (str9icmp(m, 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPOPLPUSH;
-                    break;
-                }
-
-                if (str9icmp(m, 's', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SISMEMBER;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGE;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'l', 'e', 'x', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZLEXCOUNT;
-                    break;
-                }
-
-                break;
-
-            case 10:
-                if (str10icmp(m, 's', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SDIFFSTORE;
-                    break;
-                }
-
-            case 11:
-                if (str11icmp(m, 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_INCRBYFLOAT;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SRANDMEMBER;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYLEX;
-                    break;
-                }
-
-                break;
-
-            case 12:
-                if (str12icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_HINCRBYFLOAT;
-                    break;
-                }
-
-
-                break;
-
-            case 13:
-                if (str13icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYSCORE;
-                    break;
-                }
-
-                break;
-
-            case 14:
-                if (str14icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYLEX;
-                    break;
-                }
-#if 1 // shenzheng 2014-9-1 replace server
-				if (str14icmp(m, 'r', 'e', 'p', 'l', 'a', 'c', 'e', '_', 's', 'e', 'r', 'v', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_REPLACE_SERVER;
-					r->replace_server = 1;
-					log_debug(LOG_DEBUG, "new command : replace_server");
-					break;
-                }
-#endif // shenzheng 2015-6-23 replace server
-                break;
-
-            case 15:
-                if (str15icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYRANK;
-                    break;
-                }
-
-                break;
-
-            case 16:
-                if (str16icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYSCORE;
-                    break;
-                }
-
-                if (str16icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGEBYSCORE;
-                    break;
-                }
-
-                break;
-
-            default:
-                break;
-            }
-
-            if (r->type == MSG_UNKNOWN) {
-                log_error("parsed unsupported command '%.*s'", p - m, m);
-                goto error;
-            }
-
-            log_debug(LOG_VERB, "parsed command '%.*s'", p - m, m);
-
-            state = SW_REQ_TYPE_LF;
-            break;
-
-        case SW_REQ_TYPE_LF:
-            switch (ch) {
-            case LF:
-                if (redis_argz(r)) {
-                    goto done;
-                } else if (redis_argeval(r)) {
-                    state = SW_ARG1_LEN;
-                } else {
-                    state = SW_KEY_LEN;
-                }
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->token = p;
-                r->rlen = 0;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if (r->rlen >= mbuf_data_size()) {
-                    log_error("parsed bad req %"PRIu64" of type %d with key "
-                              "length %d that greater than or equal to maximum"
-                              " redis key length of %d", r->id, r->type,
-                              r->rlen, mbuf_data_size());
-                    goto error;
-                }
-                if (r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_KEY_LEN_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_KEY;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_KEY:
-            if (r->token == NULL) {
-                r->token = p;
-            }
-
-            m = r->token + r->rlen;
-            if (m >= b->last) {
-                m = b->last - 1;
-                p = m;
-                break;
-            }
-
-            if (*m != CR) {
-                goto error;
-            } else {        /* got a key */
-                struct keypos *kpos;
+            if (*m != CR) {
+                goto error;
+            } else {        /* got a key */
+                struct keypos *kpos;
 
                 p = m;      /* move forward by rlen bytes */
                 r->rlen = 0;
                 m = r->token;
                 r->token = NULL;
 
-                kpos = array_push(r->keys);
+                kpos = array_push(&r->keys);
                 if (kpos == NULL) {
                     goto enomem;
                 }
@@ -1194,11 +627,24 @@ redis_parse_req(struct msg *r)
                         goto done;
                     }
                     state = SW_ARG1_LEN;
-                } else if (redis_argx(r)) {
+                } else if (redis_argx(r) || redis_argt(r)) {
                     if (r->rnarg == 0) {
                         goto done;
                     }
                     state = SW_KEY_LEN;
+                } else if (redis_argnumkeys(r)) {
+                    if (array_n(&r->keys) == 1) {   /* destination key */
+                        if (r->rnarg < 2) {
+                            goto error;
+                        }
+                        state = SW_ARG1_LEN;
+                    } else if (--r->integer != 0) {
+                        state = SW_KEY_LEN;
+                    } else if (r->rnarg == 0) {
+                        goto done;
+                    } else {
+                        state = SW_ARGN_LEN;
+                    }
                 } else if (redis_argkvx(r)) {
                     if (r->rnarg == 0) {
                         goto done;
@@ -1258,7 +704,20 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_ARG1:
+        case SW_ARG1:
+            if (redis_argnumkeys(r) && r->rlen != 0) {
+                /* numkeys is kept in integer while its keys are parsed */
+                if (!isdigit(ch)) {
+                    goto error;
+                }
+                r->integer = r->integer * 10 + (uint32_t)(ch - '0');
+                if (r->integer > r->rnarg) {
+                    goto error;
+                }
+                r->rlen--;
+                break;
+            }
+
             m = p + r->rlen;
             if (m >= b->last) {
                 r->rlen -= (uint32_t)(b->last - p);
@@ -1311,6 +770,11 @@ redis_parse_req(struct msg *r)
                         goto done;
                     }
                     state = SW_KEY_LEN;
+                } else if (redis_argnumkeys(r)) {
+                    if (r->integer == 0) {
+                        goto error;
+                    }
+                    state = SW_KEY_LEN;
                 } else {
                     goto error;
                 }
@@ -1449,46 +913,352 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_ARG3_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->rlen = 0;
-                r->token = p;
-            } else if (isdigit(ch)) {
+        case SW_ARG3_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
+                }
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
+                }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_ARG3_LEN_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_ARG3_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_ARG3;
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_ARG3:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
+                break;
+            }
+
+            if (*m != CR) {
+                goto error;
+            }
+
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
+            state = SW_ARG3_LF;
+
+            break;
+
+        case SW_ARG3_LF:
+            switch (ch) {
+            case LF:
+                if (redis_arg3(r)) {
+                    if (r->rnarg != 0) {
+                        goto error;
+                    }
+                    goto done;
+                } else if (redis_argn(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else {
+                    goto error;
+                }
+
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_ARGN_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
+                }
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
+                }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_ARGN_LEN_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_ARGN_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_ARGN;
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_ARGN:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
+                break;
+            }
+
+            if (*m != CR) {
+                goto error;
+            }
+
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
+            state = SW_ARGN_LF;
+
+            break;
+
+        case SW_ARGN_LF:
+            switch (ch) {
+            case LF:
+                if (redis_argn(r) || redis_argeval(r) || redis_argnumkeys(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else {
+                    goto error;
+                }
+
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_SENTINEL:
+        default:
+            NOT_REACHED();
+            break;
+        }
+    }
+
+    ASSERT(p == b->last);
+    r->pos = p;
+    r->state = state;
+
+    if (b->last == b->end && r->token != NULL) {
+        r->pos = r->token;
+        r->token = NULL;
+        r->result = MSG_PARSE_REPAIR;
+    } else {
+        r->result = MSG_PARSE_AGAIN;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+done:
+    ASSERT(r->type > MSG_UNKNOWN && r->type < MSG_SENTINEL);
+    if ((redis_argt(r) || redis_argnumkeys(r)) && !redis_keys_share_tag(r)) {
+        /* not forwarded; redis_reply answers it with an error */
+        r->noforward = 1;
+    }
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "out of memory on parse req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type, r->state);
+
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Return true, if the response r only needs its boundaries found. That
+ * is the case when r answers a request that was not fragmented, as it is
+ * then forwarded to the client as is and never coalesced. Responses on a
+ * server connection arrive in the order of its outstanding requests, so
+ * the request is the head of the out q.
+ */
+static bool
+redis_rsp_frame_only(struct msg *r)
+{
+    struct msg *pmsg;
+
+    ASSERT(!r->request);
+
+    pmsg = TAILQ_FIRST(&r->owner->omsg_q);
+
+    return pmsg != NULL && pmsg->frag_id == 0;
+}
+
+/*
+ * Find the end of the response r without interpreting its replies beyond
+ * what framing requires. r->rnarg counts the replies still to be framed,
+ * so nested multi-bulk replies of any depth need no stack: a multi-bulk
+ * header replaces itself by its elements. Bulk bodies are skipped by their
+ * length and the remaining lines are scanned with memchr.
+ */
+static void
+redis_frame_rsp(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p, *m;
+    uint8_t ch;
+
+    enum {
+        SW_START,
+        SW_BULK_LEN,
+        SW_BULK_LEN_LF,
+        SW_BULK,
+        SW_MULTIBULK_LEN,
+        SW_MULTIBULK_LEN_LF,
+        SW_RUNTO_CRLF,
+        SW_ALMOST_DONE,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    for (p = r->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+        case SW_START:
+            if (r->type == MSG_UNKNOWN) {
+                /* first byte of the response */
+                r->rnarg = 1;
+            }
+
+            switch (ch) {
+            case '+':
+                if (r->type == MSG_UNKNOWN) {
+                    r->type = MSG_RSP_REDIS_STATUS;
+                }
+                state = SW_RUNTO_CRLF;
+                break;
+
+            case '-':
+                if (r->type == MSG_UNKNOWN) {
+                    r->type = MSG_RSP_REDIS_ERROR;
+                }
+                state = SW_RUNTO_CRLF;
+                break;
+
+            case ':':
+                if (r->type == MSG_UNKNOWN) {
+                    r->type = MSG_RSP_REDIS_INTEGER;
+                }
+                state = SW_RUNTO_CRLF;
+                break;
+
+            case '$':
+                if (r->type == MSG_UNKNOWN) {
+                    r->type = MSG_RSP_REDIS_BULK;
+                }
+                r->rlen = 0;
+                state = SW_BULK_LEN;
+                break;
+
+            case '*':
+                if (r->type == MSG_UNKNOWN) {
+                    r->type = MSG_RSP_REDIS_MULTIBULK;
+                }
+                r->rlen = 0;
+                state = SW_MULTIBULK_LEN;
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_BULK_LEN:
+        case SW_MULTIBULK_LEN:
+            if (isdigit(ch)) {
                 r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == '-') {
+                /* null bulk '$-1' or null multi-bulk '*-1' */
+                state = SW_RUNTO_CRLF;
             } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_ARG3_LEN_LF;
+                state = (state == SW_BULK_LEN) ? SW_BULK_LEN_LF :
+                                                 SW_MULTIBULK_LEN_LF;
             } else {
                 goto error;
             }
 
             break;
 
-        case SW_ARG3_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_ARG3;
-                break;
-
-            default:
+        case SW_BULK_LEN_LF:
+            if (ch != LF) {
                 goto error;
             }
+            state = SW_BULK;
 
             break;
 
-        case SW_ARG3:
+        case SW_BULK:
             m = p + r->rlen;
             if (m >= b->last) {
                 r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
+                p = b->last - 1;
                 break;
             }
 
@@ -1498,105 +1268,46 @@ redis_parse_req(struct msg *r)
 
             p = m; /* move forward by rlen bytes */
             r->rlen = 0;
-            state = SW_ARG3_LF;
+            state = SW_ALMOST_DONE;
 
             break;
 
-        case SW_ARG3_LF:
-            switch (ch) {
-            case LF:
-                if (redis_arg3(r)) {
-                    if (r->rnarg != 0) {
-                        goto error;
-                    }
-                    goto done;
-                } else if (redis_argn(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else {
-                    goto error;
-                }
-
-                break;
-
-            default:
+        case SW_MULTIBULK_LEN_LF:
+            if (ch != LF) {
                 goto error;
             }
 
-            break;
-
-        case SW_ARGN_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->rlen = 0;
-                r->token = p;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_ARGN_LEN_LF;
-            } else {
-                goto error;
+            /* the multi-bulk reply is framed once its elements are */
+            r->rnarg += r->rlen;
+            r->rlen = 0;
+            if (--r->rnarg == 0) {
+                goto done;
             }
+            state = SW_START;
 
             break;
 
-        case SW_ARGN_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_ARGN;
+        case SW_RUNTO_CRLF:
+            m = memchr(p, CR, (size_t)(b->last - p));
+            if (m == NULL) {
+                p = b->last - 1;
                 break;
-
-            default:
-                goto error;
             }
 
-            break;
+            p = m;
+            state = SW_ALMOST_DONE;
 
-        case SW_ARGN:
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
-                break;
-            }
+            break;
 
-            if (*m != CR) {
+        case SW_ALMOST_DONE:
+            if (ch != LF) {
                 goto error;
             }
 
-            p = m; /* move forward by rlen bytes */
-            r->rlen = 0;
-            state = SW_ARGN_LF;
-
-            break;
-
-        case SW_ARGN_LF:
-            switch (ch) {
-            case LF:
-                if (redis_argn(r) || redis_argeval(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else {
-                    goto error;
-                }
-
-                break;
-
-            default:
-                goto error;
+            if (--r->rnarg == 0) {
+                goto done;
             }
+            state = SW_START;
 
             break;
 
@@ -1610,16 +1321,9 @@ redis_parse_req(struct msg *r)
     ASSERT(p == b->last);
     r->pos = p;
     r->state = state;
+    r->result = MSG_PARSE_AGAIN;
 
-    if (b->last == b->end && r->token != NULL) {
-        r->pos = r->token;
-        r->token = NULL;
-        r->result = MSG_PARSE_REPAIR;
-    } else {
-        r->result = MSG_PARSE_AGAIN;
-    }
-
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "framed rsp %"PRIu64" res %d "
                 "type %d state %d rpos %d of %d", r->id, r->result, r->type,
                 r->state, r->pos - b->pos, b->last - b->pos);
     return;
@@ -1629,29 +1333,19 @@ done:
     r->pos = p + 1;
     ASSERT(r->pos <= b->last);
     r->state = SW_START;
-    r->token = NULL;
     r->result = MSG_PARSE_OK;
 
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "framed rsp %"PRIu64" res %d "
                 "type %d state %d rpos %d of %d", r->id, r->result, r->type,
                 r->state, r->pos - b->pos, b->last - b->pos);
     return;
 
-enomem:
-    r->result = MSG_PARSE_ERROR;
-    r->state = state;
-
-    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "out of memory on parse req %"PRIu64" "
-                "res %d type %d state %d", r->id, r->result, r->type, r->state);
-
-    return;
-
 error:
     r->result = MSG_PARSE_ERROR;
     r->state = state;
     errno = EINVAL;
 
-    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "framed bad rsp %"PRIu64" "
                 "res %d type %d state %d", r->id, r->result, r->type,
                 r->state);
 }
@@ -1712,6 +1406,11 @@ redis_parse_rsp(struct msg *r)
         SW_SENTINEL
     } state;
 
+    if (redis_rsp_frame_only(r)) {
+        redis_frame_rsp(r);
+        return;
+    }
+
     state = r->state;
     b = STAILQ_LAST(&r->mhdr, mbuf, next);
 
@@ -1796,15 +1495,16 @@ redis_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
-            switch (ch) {
-            case CR:
-                state = SW_ALMOST_DONE;
-                break;
-
-            default:
+            /* scan for the CR of the line at once, not a byte per state */
+            m = memchr(p, CR, (size_t)(b->last - p));
+            if (m == NULL) {
+                p = b->last - 1;
                 break;
             }
 
+            p = m;
+            state = SW_ALMOST_DONE;
+
             break;
 
         case SW_ALMOST_DONE:
@@ -2132,19 +1832,24 @@ redis_copy_bulk(struct msg *dst, struct msg *src)
     }
     bytes = len;
 
-    /* copy len bytes to dst */
+    /* move len bytes to dst, without copying */
     for (; mbuf;) {
-        if (mbuf_length(mbuf) <= len) {     /* steal this buf from src to dst */
+        uint32_t n = mbuf_length(mbuf);
+
+        if (n <= len) {                      /* steal this buf from src to dst */
             nbuf = STAILQ_NEXT(mbuf, next);
             mbuf_remove(&src->mhdr, mbuf);
             if (dst != NULL) {
                 mbuf_insert(&dst->mhdr, mbuf);
+                dst->mlen += n;
+            } else {
+                mbuf_put(mbuf);
             }
-            len -= mbuf_length(mbuf);
+            len -= n;
             mbuf = nbuf;
-        } else {                             /* split it */
+        } else {                             /* share it */
             if (dst != NULL) {
-                status = msg_append(dst, mbuf->pos, len);
+                status = msg_append_ref(dst, mbuf, len);
                 if (status != NC_OK) {
                     return status;
                 }
@@ -2154,14 +1859,62 @@ redis_copy_bulk(struct msg *dst, struct msg *src)
         }
     }
 
-    if (dst != NULL) {
-        dst->mlen += bytes;
-    }
     src->mlen -= bytes;
     log_debug(LOG_VVERB, "redis_copy_bulk copy bytes: %d", bytes);
     return NC_OK;
 }
 
+/*
+ * Coalesce the values of the leading keys of a fragmented 'mget' into its
+ * response, in key order, for as far as their fragments are done. Called
+ * as each fragment arrives, so that the head of the reply can be sent
+ * before the slowest fragment is in (see req_stream)
+ */
+static void
+redis_stream_mget(struct msg *request)
+{
+    struct msg *response = request->peer;
+    struct msg_cold *cold = request->cold;
+    struct server_pool *pool;
+    struct msg *sub_msg;
+    rstatus_t status;
+
+    if (response == NULL || request->error || request->ferror) {
+        return;
+    }
+
+    pool = request->owner->owner;
+
+    for (; cold->nstream < array_n(&request->keys); cold->nstream++) {
+        sub_msg = cold->frag_seq[cold->nstream];
+        if (sub_msg->error ? !pool->partial_mget : sub_msg->peer == NULL) {
+            /* fragment is pending or failed; see req_error */
+            break;
+        }
+
+        if (cold->nstream == 0) {
+            status = msg_prepend_format(response, "*%d\r\n", request->narg - 1);
+            if (status != NC_OK) {
+                response->owner->err = 1;
+                return;
+            }
+        }
+
+        if (sub_msg->error) {
+            /* key of a failed fragment is a miss; see partial_mget */
+            request->partial = 1;
+            status = msg_append(response, (uint8_t *)REPL_NIL,
+                                nc_strlen(REPL_NIL));
+        } else {
+            status = redis_copy_bulk(response, sub_msg->peer);
+        }
+        if (status != NC_OK) {
+            response->owner->err = 1;
+            return;
+        }
+    }
+}
+
 /*
  * Pre-coalesce handler is invoked when the message is a response to
  * the fragmented multi vector request - 'mget' or 'del' and all the
@@ -2180,12 +1933,15 @@ redis_pre_coalesce(struct msg *r)
         /* do nothing, if not a response to a fragmented request */
         return;
     }
-    pr->frag_owner->nfrag_done++;
+    pr->frag_owner->cold->nfrag_done++;
 
     switch (r->type) {
     case MSG_RSP_REDIS_INTEGER:
-        /* only redis 'del' fragmented request sends back integer reply */
-        ASSERT(pr->type == MSG_REQ_REDIS_DEL);
+        /*
+         * only redis 'del', 'exists', 'touch' and 'unlink' fragmented
+         * requests send back integer reply
+         */
+        ASSERT(redis_command(pr->type)->fanout == REDIS_FANOUT_SUM);
 
         mbuf = STAILQ_FIRST(&r->mhdr);
         /*
@@ -2206,7 +1962,7 @@ redis_pre_coalesce(struct msg *r)
 
     case MSG_RSP_REDIS_MULTIBULK:
         /* only redis 'mget' fragmented request sends back multi-bulk reply */
-        ASSERT(pr->type == MSG_REQ_REDIS_MGET);
+        ASSERT(redis_command(pr->type)->fanout == REDIS_FANOUT_MERGE);
 
         mbuf = STAILQ_FIRST(&r->mhdr);
         /*
@@ -2222,10 +1978,11 @@ redis_pre_coalesce(struct msg *r)
         r->mlen -= (uint32_t)(r->narg_end - r->narg_start);
         mbuf->pos = r->narg_end;
 
+        redis_stream_mget(pr->frag_owner);
         break;
 
     case MSG_RSP_REDIS_STATUS:
-        if (pr->type == MSG_REQ_REDIS_MSET) {       /* MSET segments */
+        if (redis_command(pr->type)->fanout == REDIS_FANOUT_OK) { /* MSET segments */
             mbuf = STAILQ_FIRST(&r->mhdr);
             r->mlen -= mbuf_length(mbuf);
             mbuf_rewind(mbuf);
@@ -2270,7 +2027,7 @@ redis_append_key(struct msg *r, uint8_t *key, uint32_t keylen)
         return NC_ENOMEM;
     }
 
-    kpos = array_push(r->keys);
+    kpos = array_push(&r->keys);
     if (kpos == NULL) {
         return NC_ENOMEM;
     }
@@ -2291,12 +2048,43 @@ redis_append_key(struct msg *r, uint8_t *key, uint32_t keylen)
     return NC_OK;
 }
 
+/*
+ * Complete fragment sub_msg of r by prepending the command header, and
+ * queue it in frag_msgq
+ */
+static rstatus_t
+redis_fragment_add(struct msg *r, struct msg *sub_msg, struct msg_tqh *frag_msgq)
+{
+    const struct redis_command *cmd = redis_command(r->type);
+    rstatus_t status;
+
+    status = msg_prepend_format(sub_msg, "*%d\r\n$%d\r\n%.*s\r\n",
+                                sub_msg->narg + 1, cmd->name.len,
+                                cmd->name.len, cmd->name.data);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    sub_msg->type = r->type;
+    sub_msg->frag_id = r->frag_id;
+    sub_msg->frag_owner = r->frag_owner;
+
+    TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
+    r->cold->nfrag++;
+
+    return NC_OK;
+}
+
 /*
  * input a msg, return a msg chain.
- * ncontinuum is the number of backend redis/memcache server
+ * nserver is the number of backend redis/memcache server
  *
- * the original msg will be fragment into at most ncontinuum fragments.
+ * the original msg will be fragment into at most nserver fragments.
  * all the keys map to the same backend will group into one fragment.
+ * when max_keys is not 0, the keys of a backend are split into fragments
+ * of at most max_keys keys. only the first fragment to each backend is sent
+ * right away; every other one is held until the one before it is done
+ * (see req_forward_frag)
  *
  * frag_id:
  * a unique fragment id for all fragments of the message vector. including the orig msg.
@@ -2344,25 +2132,28 @@ redis_append_key(struct msg *r, uint8_t *key, uint32_t keylen)
  *
  */
 static rstatus_t
-redis_fragment_argx(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msgq,
-                    uint32_t key_step)
+redis_fragment_argx(struct msg *r, uint32_t nserver, uint32_t max_keys,
+                    struct msg_tqh *frag_msgq, uint32_t key_step)
 {
     struct mbuf *mbuf;
+    struct msg_cold *cold;
     struct msg **sub_msgs;
     uint32_t i;
     rstatus_t status;
 
-    ASSERT(array_n(r->keys) == (r->narg - 1) / key_step);
+    ASSERT(array_n(&r->keys) == (r->narg - 1) / key_step);
 
-    sub_msgs = nc_zalloc(ncontinuum * sizeof(*sub_msgs));
+    /* fan-out tables live in the arena of r, and are released with it */
+    sub_msgs = msg_arena_alloc(r, nserver * sizeof(*sub_msgs));
     if (sub_msgs == NULL) {
         return NC_ENOMEM;
     }
+    memset(sub_msgs, 0, nserver * sizeof(*sub_msgs));
 
-    ASSERT(r->frag_seq == NULL);
-    r->frag_seq = nc_alloc(array_n(r->keys) * sizeof(*r->frag_seq));
-    if (r->frag_seq == NULL) {
-        nc_free(sub_msgs);
+    cold = r->cold;
+    ASSERT(cold->frag_seq == NULL);
+    cold->frag_seq = msg_arena_alloc(r, array_n(&r->keys) * sizeof(*cold->frag_seq));
+    if (cold->frag_seq == NULL) {
         return NC_ENOMEM;
     }
 
@@ -2373,7 +2164,8 @@ redis_fragment_argx(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msg
      * This code is based on the assumption that '*narg\r\n$4\r\nMGET\r\n' is located
      * in a contiguous location.
      * This is always true because we have capped our MBUF_MIN_SIZE at 512 and
-     * whenever we have multiple messages, we copy the tail message into a new mbuf
+     * whenever we have multiple messages, the tail message starts in an mbuf
+     * with at least MBUF_MIN_SIZE bytes of room (see msg_parsed)
      */
     for (i = 0; i < 3; i++) {                 /* eat *narg\r\n$4\r\nMGET\r\n */
         for (; *(mbuf->pos) != '\n';) {
@@ -2383,96 +2175,90 @@ redis_fragment_argx(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msg
     }
 
     r->frag_id = msg_gen_frag_id();
-    r->nfrag = 0;
+    cold->nfrag = 0;
     r->frag_owner = r;
 
-    for (i = 0; i < array_n(r->keys); i++) {        /* for each key */
+    for (i = 0; i < array_n(&r->keys); i++) {        /* for each key */
         struct msg *sub_msg;
-        struct keypos *kpos = array_get(r->keys, i);
+        struct keypos *kpos = array_get(&r->keys, i);
         uint32_t idx = msg_backend_idx(r, kpos->start, kpos->end - kpos->start);
 
-        if (sub_msgs[idx] == NULL) {
+        sub_msg = sub_msgs[idx];
+        if (sub_msg == NULL || sub_msg->frag_id != 0) {
             sub_msgs[idx] = msg_get(r->owner, r->request, r->redis);
             if (sub_msgs[idx] == NULL) {
-                nc_free(sub_msgs);
                 return NC_ENOMEM;
             }
         }
-        r->frag_seq[i] = sub_msg = sub_msgs[idx];
+
+        if (sub_msg != NULL && sub_msg->frag_id != 0) {
+            /*
+             * fragment to this server is full and already in frag_msgq;
+             * the next one is held until it is done
+             */
+            if (msg_cold(sub_msg) == NULL) {
+                return NC_ENOMEM;
+            }
+            sub_msg->cold->frag_next = sub_msgs[idx];
+            sub_msgs[idx]->held = 1;
+        }
+        cold->frag_seq[i] = sub_msg = sub_msgs[idx];
 
         sub_msg->narg++;
         status = redis_append_key(sub_msg, kpos->start, kpos->end - kpos->start);
         if (status != NC_OK) {
-            nc_free(sub_msgs);
             return status;
         }
 
-        if (key_step == 1) {                            /* mget,del */
-            continue;
-        } else {                                        /* mset */
+        if (key_step != 1) {                            /* mset */
             status = redis_copy_bulk(NULL, r);          /* eat key */
             if (status != NC_OK) {
-                nc_free(sub_msgs);
                 return status;
             }
 
             status = redis_copy_bulk(sub_msg, r);
             if (status != NC_OK) {
-                nc_free(sub_msgs);
                 return status;
             }
 
             sub_msg->narg++;
         }
+
+        if (max_keys != 0 && sub_msg->narg / key_step == max_keys) {
+            status = redis_fragment_add(r, sub_msg, frag_msgq);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
     }
 
-    for (i = 0; i < ncontinuum; i++) {     /* prepend mget header, and forward it */
+    for (i = 0; i < nserver; i++) {     /* prepend mget header, and forward it */
         struct msg *sub_msg = sub_msgs[i];
-        if (sub_msg == NULL) {
+        if (sub_msg == NULL || sub_msg->frag_id != 0) {
             continue;
         }
 
-        if (r->type == MSG_REQ_REDIS_MGET) {
-            status = msg_prepend_format(sub_msg, "*%d\r\n$4\r\nmget\r\n",
-                                        sub_msg->narg + 1);
-        } else if (r->type == MSG_REQ_REDIS_DEL) {
-            status = msg_prepend_format(sub_msg, "*%d\r\n$3\r\ndel\r\n",
-                                        sub_msg->narg + 1);
-        } else if (r->type == MSG_REQ_REDIS_MSET) {
-            status = msg_prepend_format(sub_msg, "*%d\r\n$4\r\nmset\r\n",
-                                        sub_msg->narg + 1);
-        } else {
-            NOT_REACHED();
-        }
+        status = redis_fragment_add(r, sub_msg, frag_msgq);
         if (status != NC_OK) {
-            nc_free(sub_msgs);
             return status;
         }
-
-        sub_msg->type = r->type;
-        sub_msg->frag_id = r->frag_id;
-        sub_msg->frag_owner = r->frag_owner;
-
-        TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
-        r->nfrag++;
     }
 
-    nc_free(sub_msgs);
     return NC_OK;
 }
 
 rstatus_t
-redis_fragment(struct msg *r, uint32_t ncontinuum, struct msg_tqh *frag_msgq)
+redis_fragment(struct msg *r, uint32_t nserver, uint32_t max_keys,
+               struct msg_tqh *frag_msgq)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_MGET:
-    case MSG_REQ_REDIS_DEL:
-        return redis_fragment_argx(r, ncontinuum, frag_msgq, 1);
-    case MSG_REQ_REDIS_MSET:
-        return redis_fragment_argx(r, ncontinuum, frag_msgq, 2);
-    default:
+    const struct redis_command *cmd = redis_command(r->type);
+
+    if (cmd->fanout == REDIS_FANOUT_NONE) {
         return NC_OK;
     }
+
+    return redis_fragment_argx(r, nserver, max_keys, frag_msgq,
+                               (uint32_t)cmd->key_step);
 }
 
 rstatus_t
@@ -2492,6 +2278,12 @@ redis_reply(struct msg *r)
         return msg_append(response, (uint8_t *)AUTH_REQUIRE_PASSWORD, strlen(AUTH_REQUIRE_PASSWORD));
     }
 
+    if (redis_argt(r) || redis_argnumkeys(r)) {
+        /* keys do not share a hash tag; see redis_keys_share_tag */
+        return msg_append(response, (uint8_t *)REPL_CROSS_TAG,
+                          nc_strlen(REPL_CROSS_TAG));
+    }
+
     switch (r->type) {
     case MSG_REQ_REDIS_PING:
         return msg_append(response, (uint8_t *)REPL_PONG, nc_strlen(REPL_PONG));
@@ -2532,31 +2324,17 @@ static void
 redis_post_coalesce_mget(struct msg *request)
 {
     struct msg *response = request->peer;
-    struct msg *sub_msg;
-    rstatus_t status;
-    uint32_t i;
+    struct msg_cold *cold = request->cold;
 
-    status = msg_prepend_format(response, "*%d\r\n", request->narg - 1);
-    if (status != NC_OK) {
+    redis_stream_mget(request);
+
+    if (cold->nstream < array_n(&request->keys) &&
+        cold->frag_seq[cold->nstream]->peer == NULL) {
         /*
          * the fragments is still in c_conn->omsg_q, we have to discard all of them,
          * we just close the conn here
          */
         response->owner->err = 1;
-        return;
-    }
-
-    for (i = 0; i < array_n(request->keys); i++) {      /* for each key */
-        sub_msg = request->frag_seq[i]->peer;           /* get it's peer response */
-        if (sub_msg == NULL) {
-            response->owner->err = 1;
-            return;
-        }
-        status = redis_copy_bulk(response, sub_msg);
-        if (status != NC_OK) {
-            response->owner->err = 1;
-            return;
-        }
     }
 }
 
@@ -2578,12 +2356,12 @@ redis_post_coalesce(struct msg *r)
         return;
     }
 
-    switch (r->type) {
-    case MSG_REQ_REDIS_MGET:
+    switch (redis_command(r->type)->fanout) {
+    case REDIS_FANOUT_MERGE:
         return redis_post_coalesce_mget(r);
-    case MSG_REQ_REDIS_DEL:
+    case REDIS_FANOUT_SUM:
         return redis_post_coalesce_del(r);
-    case MSG_REQ_REDIS_MSET:
+    case REDIS_FANOUT_OK:
         return redis_post_coalesce_mset(r);
     default:
         NOT_REACHED();
@@ -2600,7 +2378,7 @@ redis_valid_auth(struct conn *conn, struct msg *msg)
         uint8_t *key;
         uint32_t keylen;
 
-        kpos = array_get(msg->keys, 0);
+        kpos = array_get(&msg->keys, 0);
         key = kpos->start;
         keylen = (uint32_t)(kpos->end - kpos->start);
         if (keylen != pool->redis_auth.len) {
@@ -2666,7 +2444,7 @@ redis_add_auth_packet(struct context *ctx, struct conn *c_conn, struct conn *s_c
     }
 
     msg->swallow = 1;
-    s_conn->enqueue_inq(ctx, s_conn, msg);
+    s_conn->ops->enqueue_inq(ctx, s_conn, msg);
     s_conn->need_auth = 0;
 
     return NC_OK;